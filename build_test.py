@@ -77,7 +77,7 @@ def assert_same_filedata(lhs, rhs):
 
 def test_cleanup(msg = ""):
     files = [f for f in os.listdir('.') if os.path.isfile(os.path.join('.', f))]
-    files = [f for f in files if re.match(r'^fsarc_.*\.zip$', f)]
+    files = [f for f in files if re.match(r'^fsarc_.*\.(zip|idx)$', f)]
     for f in files:
         os.remove(f)
     shutil.rmtree(TEST_DATA_TMPDIR, ignore_errors=True)
@@ -202,9 +202,132 @@ def run_test_nocomp():
     assert_same_filedata(in_files, out_files)
 
 
+def run_test_cmod():
+    for opt in ["", "-F", "--no-comp"]:
+        test_cleanup(f"run_test_cmod {opt}")
+        cmod_file = f"{TEST_DATA_DIR}/cmodfile.dat"
+        run_process(f"cat /dev/random | head -c 20000 > {cmod_file}")
+        arc = run_fsarchive(f"-a . -b --bsdiff-window 4k {opt} {TEST_DATA_DIR}")
+        assert len(arc) == 1, "We should have created one archive"
+        # change a few windows and the file size
+        with open(cmod_file, 'rb') as f:
+            data = f.read()
+        data = data[:5000] + os.urandom(100) + data[5100:12000] + os.urandom(2000) + data[12000:]
+        with open(cmod_file, 'wb') as f:
+            f.write(data)
+        arc = run_fsarchive(f"-a . -b --bsdiff-window 4k {opt} {TEST_DATA_DIR}")
+        assert len(arc) == 2, "We should have created two archives"
+        # decompress in another subdirectory
+        run_fsarchive(f"-d {TEST_DATA_TMPDIR} -r {arc[-1]}")
+        # get all the input files
+        in_files = get_filedata(TEST_DATA_DIR)
+        # get the test output
+        out_files = get_filedata(TEST_DATA_DIR, TEST_DATA_TMPDIR)
+        # compare the two
+        assert_same_filedata(in_files, out_files)
+
+
+def run_test_cdc():
+    test_cleanup("run_test_cdc")
+    cdc_file = f"{TEST_DATA_DIR}/cdcfile.dat"
+    run_process(f"cat /dev/random | head -c 65536 > {cdc_file}")
+    arc = run_fsarchive(f"-a . --cdc --cdc-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 1, "We should have created one archive"
+    # modify some bytes and insert new data in the middle
+    with open(cdc_file, 'rb') as f:
+        data = f.read()
+    data = data[:8192] + os.urandom(64) + data[8256:32768] + os.urandom(1000) + data[32768:]
+    with open(cdc_file, 'wb') as f:
+        f.write(data)
+    arc = run_fsarchive(f"-a . --cdc --cdc-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 2, "We should have created two archives"
+    # remove a block so that the following data moves backwards
+    data = data[:1024] + data[5120:]
+    with open(cdc_file, 'wb') as f:
+        f.write(data)
+    arc = run_fsarchive(f"-a . --cdc --cdc-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 3, "We should have created three archives"
+    # decompress in another subdirectory
+    run_fsarchive(f"-d {TEST_DATA_TMPDIR} -r {arc[-1]}")
+    # get all the input files
+    in_files = get_filedata(TEST_DATA_DIR)
+    # get the test output
+    out_files = get_filedata(TEST_DATA_DIR, TEST_DATA_TMPDIR)
+    # compare the two
+    assert_same_filedata(in_files, out_files)
+
+
+def run_test_dedup():
+    test_cleanup("run_test_dedup")
+    src_file = f"{TEST_DATA_DIR}/dedupfile.dat"
+    run_process(f"cat /dev/random | head -c 16384 > {src_file}")
+    arc = run_fsarchive(f"-a . --dedup --dedup-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 1, "We should have created one archive"
+    # copy the file to a new path, stored as duplicate (DUP)
+    shutil.copyfile(src_file, f"{TEST_DATA_DIR}/abc/dedupfile.dat")
+    arc = run_fsarchive(f"-a . --dedup --dedup-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 2, "We should have created two archives"
+    assert os.stat(arc[-1]).st_size < 16384, "Duplicate file stored again"
+    # decompress in another subdirectory
+    run_fsarchive(f"-d {TEST_DATA_TMPDIR} -r {arc[-1]}")
+    # get all the input files
+    in_files = get_filedata(TEST_DATA_DIR)
+    # get the test output
+    out_files = get_filedata(TEST_DATA_DIR, TEST_DATA_TMPDIR)
+    # compare the two
+    assert_same_filedata(in_files, out_files)
+    # then consolidate and restore again
+    shutil.rmtree(TEST_DATA_TMPDIR)
+    arc = run_fsarchive(f"--consolidate .")
+    assert len(arc) == 3, "We should have created the consolidated archive"
+    run_fsarchive(f"-d {TEST_DATA_TMPDIR} -r {arc[-1]}")
+    out_files = get_filedata(TEST_DATA_DIR, TEST_DATA_TMPDIR)
+    assert_same_filedata(in_files, out_files)
+
+
+def run_test_consolidate():
+    test_cleanup("run_test_consolidate")
+    mod_file = f"{TEST_DATA_DIR}/modfile.dat"
+    dup_file = f"{TEST_DATA_DIR}/dupfile.dat"
+    run_process(f"cat /dev/random | head -c 16384 > {mod_file}")
+    run_process(f"cat /dev/random | head -c 16384 > {dup_file}")
+    arc = run_fsarchive(f"-a . -b --dedup --dedup-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 1, "We should have created one archive"
+    # change one file (MOD) and copy another one (DUP), the rest is unchanged (UNC)
+    run_process(f"cat /dev/random | head -c 16 >> {mod_file}")
+    shutil.copyfile(dup_file, f"{TEST_DATA_DIR}/abc/dupfile.dat")
+    arc = run_fsarchive(f"-a . -b --dedup --dedup-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 2, "We should have created two archives"
+    # and change the same file once more
+    run_process(f"cat /dev/random | head -c 16 >> {mod_file}")
+    arc = run_fsarchive(f"-a . -b --dedup --dedup-min-size 1k {TEST_DATA_DIR}")
+    assert len(arc) == 3, "We should have created three archives"
+    arc = run_fsarchive(f"--consolidate .")
+    assert len(arc) == 4, "We should have created the consolidated archive"
+    # the consolidated archive doesn't need the previous ones
+    for f in arc[:-1]:
+        os.remove(f)
+    # decompress in another subdirectory
+    run_fsarchive(f"-d {TEST_DATA_TMPDIR} -r {arc[-1]}")
+    # get all the input files
+    in_files = get_filedata(TEST_DATA_DIR)
+    # get the test output
+    out_files = get_filedata(TEST_DATA_DIR, TEST_DATA_TMPDIR)
+    # compare the two
+    assert_same_filedata(in_files, out_files)
+
+
+def run_test_crc32():
+    print("run_test_crc32")
+    # check_output raises if any check fails
+    run_process("make crc32_test FLAGS='-g -Wall -O3 -D_RELEASE' && ./crc32_test")
+
+
 def main():
     # first build
     run_process("make clean && make release -j $(nproc)")
+    # CRC32 implementation vs table one
+    run_test_crc32()
     # run a first test without changing data
     run_test_base()
     # adding a file
@@ -216,6 +339,14 @@ def main():
     run_test_exclude1()
     # archive compressed
     run_test_nocomp()
+    # files changed by bsdiff windows (CMOD)
+    run_test_cmod()
+    # files changed by chunks (CDC)
+    run_test_cdc()
+    # duplicated files
+    run_test_dedup()
+    # consolidation of a chain of delta archives
+    run_test_consolidate()
     # file test cleanup
     test_cleanup()
 
@@ -0,0 +1,93 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _BQUEUE_H_
+#define _BQUEUE_H_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace fsarchive {
+	// Bounded blocking queue to connect two stages
+	// (threads) of a pipeline; the producer closes
+	// it when done (optionally with an error to be
+	// forwarded), the consumer when it wants the
+	// producer to stop
+	template<typename T>
+	class bqueue {
+		const size_t			max_sz_;
+		std::deque<T>			q_;
+		std::mutex			mtx_;
+		std::condition_variable		cv_push_,
+						cv_pop_;
+		bool				closed_;
+		std::exception_ptr		err_;
+
+		bqueue();
+		bqueue(const bqueue&);
+		bqueue& operator=(const bqueue&);
+	public:
+		bqueue(const size_t max_sz) : max_sz_(max_sz), closed_(false) {
+		}
+
+		// returns false if the queue has been closed
+		bool push(T&& v) {
+			std::unique_lock<std::mutex>	l(mtx_);
+			cv_push_.wait(l, [this](){ return closed_ || (q_.size() < max_sz_); });
+			if(closed_)
+				return false;
+			q_.push_back(std::move(v));
+			l.unlock();
+			cv_pop_.notify_one();
+			return true;
+		}
+
+		// returns false once the queue is closed and
+		// empty, rethrows the error set by close
+		bool pop(T& v) {
+			std::unique_lock<std::mutex>	l(mtx_);
+			cv_pop_.wait(l, [this](){ return closed_ || !q_.empty(); });
+			if(q_.empty()) {
+				if(err_)
+					std::rethrow_exception(err_);
+				return false;
+			}
+			v = std::move(q_.front());
+			q_.pop_front();
+			l.unlock();
+			cv_push_.notify_one();
+			return true;
+		}
+
+		void close(std::exception_ptr err = 0) {
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				closed_ = true;
+				err_ = err;
+			}
+			cv_push_.notify_all();
+			cv_pop_.notify_all();
+		}
+	};
+}
+
+#endif //_BQUEUE_H_
+
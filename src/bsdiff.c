@@ -131,42 +131,198 @@ static void qsufsort(int64_t *I,int64_t *V,const uint8_t *old,int64_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
-static int64_t matchlen(const uint8_t *old,int64_t oldsize,const uint8_t *new,int64_t newsize)
-{
-	int64_t i;
+/* SA-IS suffix array construction (Nong, Zhang & Chan), linear time and
+ * with 32 bits indices; used instead of qsufsort for files smaller
+ * than 4 GiB. The suffix array is unique, hence the resulting I is
+ * exactly the one qsufsort would produce (the empty suffix, i.e. the
+ * sentinel, sorts first and I[0]=oldsize) and so are the patches. */
 
-	for(i=0;(i<oldsize)&&(i<newsize);i++)
-		if(old[i]!=new[i]) break;
+#define SAIS_EMPTY UINT32_MAX
+#define SAIS_MAX_SIZE ((int64_t)UINT32_MAX-2)
 
-	return i;
+struct sais_text
+{
+	/* either one of them is set; when 8 bits
+	 * the virtual sentinel is at n-1 */
+	const uint8_t *s8;
+	const uint32_t *s32;
+	int64_t n;
+};
+
+static inline uint32_t sais_chr(const struct sais_text *s,int64_t i)
+{
+	if(s->s32) return s->s32[i];
+	return (i==s->n-1) ? 0 : (uint32_t)s->s8[i]+1;
 }
 
-static int64_t search(const int64_t *I,const uint8_t *old,int64_t oldsize,
-		const uint8_t *new,int64_t newsize,int64_t st,int64_t en,int64_t *pos)
+#define SAIS_TGET(t,i) (((t)[(i)>>3]>>((i)&7))&1)
+#define SAIS_TSET(t,i,b) ((b) ? ((t)[(i)>>3]|=(1<<((i)&7))) : ((t)[(i)>>3]&=~(1<<((i)&7))))
+#define SAIS_ISLMS(t,i) ((i)>0 && SAIS_TGET(t,i) && !SAIS_TGET(t,(i)-1))
+
+static void sais_buckets(const struct sais_text *s,uint32_t *bkt,int64_t K,int end)
 {
-	int64_t x,y;
+	int64_t i,sum=0;
 
-	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+	for(i=0;i<=K;i++) bkt[i]=0;
+	for(i=0;i<s->n;i++) bkt[sais_chr(s,i)]++;
+	for(i=0;i<=K;i++) {
+		sum+=bkt[i];
+		bkt[i]=end ? sum : sum-bkt[i];
+	};
+}
 
-		if(x>y) {
-			*pos=I[st];
-			return x;
-		} else {
-			*pos=I[en];
-			return y;
-		}
+static void sais_induce(const struct sais_text *s,const uint8_t *t,uint32_t *SA,uint32_t *bkt,int64_t K)
+{
+	int64_t i,j;
+
+	/* L-type from the bucket heads */
+	sais_buckets(s,bkt,K,0);
+	for(i=0;i<s->n;i++) {
+		if(SA[i]==SAIS_EMPTY || SA[i]==0) continue;
+		j=SA[i]-1;
+		if(!SAIS_TGET(t,j)) SA[bkt[sais_chr(s,j)]++]=j;
+	};
+	/* S-type from the bucket tails */
+	sais_buckets(s,bkt,K,1);
+	for(i=s->n-1;i>=0;i--) {
+		if(SA[i]==SAIS_EMPTY || SA[i]==0) continue;
+		j=SA[i]-1;
+		if(SAIS_TGET(t,j)) SA[--bkt[sais_chr(s,j)]]=j;
+	};
+}
+
+static int sais_main(const struct sais_text *s,uint32_t *SA,int64_t K,struct bsdiff_stream *stream)
+{
+	const int64_t n=s->n;
+	int64_t i,j,d,n1,name,prev,pos;
+	uint8_t *t;
+	uint32_t *bkt,*s1;
+	struct sais_text txt1;
+	int diff;
+
+	if((t=stream->malloc(n/8+1))==NULL) return -1;
+	if((bkt=stream->malloc((K+1)*sizeof(uint32_t)))==NULL) {
+		stream->free(t);
+		return -1;
 	};
 
-	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+	/* classify the suffixes, the sentinel is S-type */
+	SAIS_TSET(t,n-1,1);
+	if(n>1) SAIS_TSET(t,n-2,0);
+	for(i=n-3;i>=0;i--)
+		SAIS_TSET(t,i,(sais_chr(s,i)<sais_chr(s,i+1) ||
+			(sais_chr(s,i)==sais_chr(s,i+1) && SAIS_TGET(t,i+1))) ? 1 : 0);
+
+	/* sort the LMS substrings */
+	sais_buckets(s,bkt,K,1);
+	for(i=0;i<n;i++) SA[i]=SAIS_EMPTY;
+	for(i=1;i<n;i++) if(SAIS_ISLMS(t,i)) SA[--bkt[sais_chr(s,i)]]=i;
+	sais_induce(s,t,SA,bkt,K);
+
+	/* compact them in the first n1 items and name them */
+	n1=0;
+	for(i=0;i<n;i++) if(SAIS_ISLMS(t,(int64_t)SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=SAIS_EMPTY;
+	name=0;prev=-1;
+	for(i=0;i<n1;i++) {
+		pos=SA[i];diff=0;
+		for(d=0;d<n;d++) {
+			if(prev==-1 || sais_chr(s,pos+d)!=sais_chr(s,prev+d) ||
+				SAIS_TGET(t,pos+d)!=SAIS_TGET(t,prev+d)) {
+				diff=1;
+				break;
+			} else if(d>0 && (SAIS_ISLMS(t,pos+d) || SAIS_ISLMS(t,prev+d))) break;
+		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=n1;i--) if(SA[i]!=SAIS_EMPTY) SA[j--]=SA[i];
+
+	/* sort the LMS suffixes, recursing if names aren't unique */
+	s1=SA+n-n1;
+	if(name<n1) {
+		txt1.s8=NULL;txt1.s32=s1;txt1.n=n1;
+		stream->free(bkt);
+		if(sais_main(&txt1,SA,name-1,stream)) {
+			stream->free(t);
+			return -1;
+		};
+		if((bkt=stream->malloc((K+1)*sizeof(uint32_t)))==NULL) {
+			stream->free(t);
+			return -1;
+		};
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		for(i=0;i<n1;i++) SA[s1[i]]=i;
+	};
+
+	/* and induce the final order from them */
+	for(i=1,j=0;i<n;i++) if(SAIS_ISLMS(t,i)) s1[j++]=i;
+	for(i=0;i<n1;i++) SA[i]=s1[SA[i]];
+	for(i=n1;i<n;i++) SA[i]=SAIS_EMPTY;
+	sais_buckets(s,bkt,K,1);
+	for(i=n1-1;i>=0;i--) {
+		j=SA[i];SA[i]=SAIS_EMPTY;
+		SA[--bkt[sais_chr(s,j)]]=j;
+	};
+	sais_induce(s,t,SA,bkt,K);
+
+	stream->free(bkt);
+	stream->free(t);
+	return 0;
+}
+
+static int sais(uint32_t *I,const uint8_t *old,int64_t oldsize,struct bsdiff_stream *stream)
+{
+	struct sais_text txt;
+
+	txt.s8=old;txt.s32=NULL;txt.n=oldsize+1;
+	if(oldsize==0) {
+		I[0]=0;
+		return 0;
 	};
+	return sais_main(&txt,I,256,stream);
 }
 
+static int64_t matchlen(const uint8_t *old,int64_t oldsize,const uint8_t *new,int64_t newsize)
+{
+	int64_t i;
+
+	for(i=0;(i<oldsize)&&(i<newsize);i++)
+		if(old[i]!=new[i]) break;
+
+	return i;
+}
+
+#define DEFINE_SEARCH(name,idx_t) \
+static int64_t name(const idx_t *I,const uint8_t *old,int64_t oldsize, \
+		const uint8_t *new,int64_t newsize,int64_t st,int64_t en,int64_t *pos) \
+{ \
+	int64_t x,y; \
+ \
+	while(en-st>=2) { \
+		x=st+(en-st)/2; \
+		if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) { \
+			st=x; \
+		} else { \
+			en=x; \
+		}; \
+	}; \
+ \
+	x=matchlen(old+I[st],oldsize-I[st],new,newsize); \
+	y=matchlen(old+I[en],oldsize-I[en],new,newsize); \
+ \
+	if(x>y) { \
+		*pos=I[st]; \
+		return x; \
+	} else { \
+		*pos=I[en]; \
+		return y; \
+	} \
+}
+
+DEFINE_SEARCH(search,int64_t)
+DEFINE_SEARCH(search32,uint32_t)
+
 static void offtout(int64_t x,uint8_t *buf)
 {
 	int64_t y;
@@ -213,13 +369,16 @@ struct bsdiff_request
 	const uint8_t* new;
 	int64_t newsize;
 	struct bsdiff_stream* stream;
+	/* only one is used, I32 when oldsize <= SAIS_MAX_SIZE */
 	int64_t *I;
+	uint32_t *I32;
 	uint8_t *buffer;
 };
 
 static int bsdiff_internal(const struct bsdiff_request req)
 {
 	int64_t *I,*V;
+	uint32_t *I32;
 	int64_t scan,pos,len;
 	int64_t lastscan,lastpos,lastoffset;
 	int64_t oldscore,scsc;
@@ -229,11 +388,15 @@ static int bsdiff_internal(const struct bsdiff_request req)
 	uint8_t *buffer;
 	uint8_t buf[8 * 3];
 
-	if((V=req.stream->malloc((req.oldsize+1)*sizeof(int64_t)))==NULL) return -1;
 	I = req.I;
-
-	qsufsort(I,V,req.old,req.oldsize);
-	req.stream->free(V);
+	I32 = req.I32;
+	if(I32) {
+		if(sais(I32,req.old,req.oldsize,req.stream)) return -1;
+	} else {
+		if((V=req.stream->malloc((req.oldsize+1)*sizeof(int64_t)))==NULL) return -1;
+		qsufsort(I,V,req.old,req.oldsize);
+		req.stream->free(V);
+	};
 
 	buffer = req.buffer;
 
@@ -244,8 +407,12 @@ static int bsdiff_internal(const struct bsdiff_request req)
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<req.newsize;scan++) {
-			len=search(I,req.old,req.oldsize,req.new+scan,req.newsize-scan,
-					0,req.oldsize,&pos);
+			if(I32)
+				len=search32(I32,req.old,req.oldsize,req.new+scan,req.newsize-scan,
+						0,req.oldsize,&pos);
+			else
+				len=search(I,req.old,req.oldsize,req.new+scan,req.newsize-scan,
+						0,req.oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
 			if((scsc+lastoffset<req.oldsize) &&
@@ -326,12 +493,19 @@ int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t news
 	int result;
 	struct bsdiff_request req;
 
-	if((req.I=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL)
-		return -1;
+	req.I = NULL;
+	req.I32 = NULL;
+	if(oldsize<=SAIS_MAX_SIZE) {
+		if((req.I32=stream->malloc((oldsize+1)*sizeof(uint32_t)))==NULL)
+			return -1;
+	} else {
+		if((req.I=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL)
+			return -1;
+	}
 
 	if((req.buffer=stream->malloc(newsize+1))==NULL)
 	{
-		stream->free(req.I);
+		stream->free(req.I32 ? (void*)req.I32 : (void*)req.I);
 		return -1;
 	}
 
@@ -344,7 +518,7 @@ int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t news
 	result = bsdiff_internal(req);
 
 	stream->free(req.buffer);
-	stream->free(req.I);
+	stream->free(req.I32 ? (void*)req.I32 : (void*)req.I);
 
 	return result;
 }
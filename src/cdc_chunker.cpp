@@ -0,0 +1,111 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "cdc_chunker.h"
+#include "sha256.h"
+#include "utils.h"
+#include <cstring>
+
+namespace {
+	// random values for each byte, the very same
+	// across versions (boundaries would move otherwise)
+	struct gear_table {
+		uint64_t	v[256];
+
+		gear_table() {
+			// splitmix64
+			uint64_t	s = 0x66736172632d6364ULL;
+			for(auto& x : v) {
+				uint64_t	z = (s += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				x = z ^ (z >> 31);
+			}
+		}
+	};
+
+	const gear_table	GEAR;
+
+	// n_bits set in the high part of the fingerprint,
+	// which depends on the last 64 bytes
+	uint64_t high_mask(const int n_bits) {
+		return ~0ULL << (64 - n_bits);
+	}
+}
+
+fsarchive::cdc_chunker::cdc_chunker(const read_fn_t& rd, const size_t avg_sz) : min_sz_(avg_sz/4), avg_sz_(avg_sz), max_sz_(avg_sz*4), rd_(rd), buf_(2*max_sz_), beg_(0), end_(0), eof_(false) {
+	if(!avg_sz || (avg_sz & (avg_sz - 1)) || (avg_sz < 256))
+		throw fsarchive::rt_error("Invalid average chunk size ") << avg_sz;
+	int	bits = 0;
+	while(((size_t)1 << bits) < avg_sz)
+		++bits;
+	// harder to match before avg_sz and
+	// easier after, see FastCDC paper
+	mask_s_ = high_mask(bits + 2);
+	mask_l_ = high_mask(bits - 2);
+}
+
+size_t fsarchive::cdc_chunker::cut(const uint8_t* p, const size_t n) const {
+	if(n <= min_sz_)
+		return n;
+	const size_t	normal = std::min(avg_sz_, n),
+			limit = std::min(max_sz_, n);
+	uint64_t	fp = 0;
+	size_t		i = min_sz_;
+	for(; i < normal; ++i) {
+		fp = (fp << 1) + GEAR.v[p[i]];
+		if(!(fp & mask_s_))
+			return i + 1;
+	}
+	for(; i < limit; ++i) {
+		fp = (fp << 1) + GEAR.v[p[i]];
+		if(!(fp & mask_l_))
+			return i + 1;
+	}
+	return limit;
+}
+
+bool fsarchive::cdc_chunker::next(const uint8_t*& p, size_t& sz) {
+	// always have a full max_sz_ to cut, unless
+	// the data is over
+	if(!eof_ && (end_ - beg_ < max_sz_)) {
+		memmove(buf_.data(), buf_.data() + beg_, end_ - beg_);
+		end_ -= beg_;
+		beg_ = 0;
+		while(!eof_ && (end_ < buf_.size())) {
+			const size_t	rd = rd_(buf_.data() + end_, buf_.size() - end_);
+			end_ += rd;
+			eof_ = !rd;
+		}
+	}
+	if(beg_ == end_)
+		return false;
+	p = buf_.data() + beg_;
+	sz = cut(p, end_ - beg_);
+	beg_ += sz;
+	return true;
+}
+
+fsarchive::cdc_chunker::hash_t fsarchive::cdc_chunker::hash(const uint8_t* p, const size_t sz) {
+	const sha256::digest_t	d = sha256::compute(p, sz);
+	hash_t			rv;
+	memcpy(rv.data(), d.data(), rv.size());
+	return rv;
+}
@@ -0,0 +1,71 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _CDC_CHUNKER_H_
+#define _CDC_CHUNKER_H_
+
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <functional>
+
+namespace fsarchive {
+	// Splits a stream of data in chunks with content defined
+	// boundaries (FastCDC, with normalized chunking): a boundary
+	// is where the gear rolling hash of the last bytes matches
+	// a mask, hence inserting or removing data only changes
+	// the chunks around it. Chunks are between avg_sz/4 and
+	// 4*avg_sz bytes, mostly close to avg_sz
+	class cdc_chunker {
+	public:
+		typedef std::function<size_t(uint8_t*, const size_t)>	read_fn_t;
+
+		// truncated SHA-256
+		typedef std::array<uint8_t, 16>				hash_t;
+	private:
+		const size_t		min_sz_,
+					avg_sz_,
+					max_sz_;
+		uint64_t		mask_s_,
+					mask_l_;
+		const read_fn_t		rd_;
+		std::vector<uint8_t>	buf_;
+		// data in buf_ not chunked yet
+		size_t			beg_,
+					end_;
+		bool			eof_;
+
+		size_t cut(const uint8_t* p, const size_t n) const;
+	public:
+		// avg_sz has to be a power of 2, rd is invoked
+		// until it returns 0
+		cdc_chunker(const read_fn_t& rd, const size_t avg_sz = 64*1024);
+
+		// returns false once the data is over, otherwise
+		// p and sz are the next chunk (valid until the
+		// next call)
+		bool next(const uint8_t*& p, size_t& sz);
+
+		static hash_t hash(const uint8_t* p, const size_t sz);
+	};
+}
+
+#endif //_CDC_CHUNKER_H_
+
@@ -0,0 +1,133 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CHUNK_BUFFER_H_
+#define _CHUNK_BUFFER_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+namespace fsarchive {
+	// Growable buffer made of malloc'ed chunks, so that
+	// appending data never moves what has been written
+	// already; chunks start small and double in size,
+	// hence small buffers don't waste memory.
+	// The chunks can be handed over (see release) to
+	// whom will free them, i.e. libzip
+	class chunk_buffer {
+	public:
+		typedef struct {
+			uint8_t	*data;
+			size_t	size;
+		} chunk_t;
+
+		typedef std::vector<chunk_t>	chunks_t;
+	private:
+		static constexpr size_t	MIN_CHUNK = 4*1024,
+					MAX_CHUNK = 4*1024*1024;
+
+		chunks_t	chunks_;
+		// capacity of the last chunk
+		size_t		last_cap_;
+		size_t		size_;
+
+		void clear(void) {
+			for(auto& c : chunks_)
+				free(c.data);
+			chunks_.clear();
+			last_cap_ = size_ = 0;
+		}
+
+		chunk_buffer(const chunk_buffer&);
+		chunk_buffer& operator=(const chunk_buffer&);
+	public:
+		chunk_buffer() : last_cap_(0), size_(0) {
+		}
+
+		chunk_buffer(chunk_buffer&& rhs) : chunks_(std::move(rhs.chunks_)), last_cap_(rhs.last_cap_), size_(rhs.size_) {
+			rhs.chunks_.clear();
+			rhs.last_cap_ = rhs.size_ = 0;
+		}
+
+		chunk_buffer& operator=(chunk_buffer&& rhs) {
+			if(this != &rhs) {
+				clear();
+				chunks_.swap(rhs.chunks_);
+				last_cap_ = rhs.last_cap_;
+				size_ = rhs.size_;
+				rhs.last_cap_ = rhs.size_ = 0;
+			}
+			return *this;
+		}
+
+		void append(const void *data, size_t len) {
+			const uint8_t	*p = (const uint8_t*)data;
+			while(len) {
+				if(chunks_.empty() || (chunks_.back().size == last_cap_)) {
+					const size_t	cap = chunks_.empty() ? MIN_CHUNK : std::min(2*last_cap_, MAX_CHUNK);
+					uint8_t		*c = (uint8_t*)malloc(cap);
+					if(!c)
+						throw std::bad_alloc();
+					chunks_.push_back({ .data = c, .size = 0 });
+					last_cap_ = cap;
+				}
+				chunk_t&	c = chunks_.back();
+				const size_t	n = std::min(len, last_cap_ - c.size);
+				memcpy(c.data + c.size, p, n);
+				c.size += n;
+				p += n;
+				len -= n;
+				size_ += n;
+			}
+		}
+
+		size_t size(void) const {
+			return size_;
+		}
+
+		const chunks_t& chunks(void) const {
+			return chunks_;
+		}
+
+		// gives up the ownership of the chunks, the last
+		// one is shrunk to its size first
+		chunks_t release(void) {
+			if(!chunks_.empty() && chunks_.back().size && (chunks_.back().size < last_cap_)) {
+				uint8_t	*c = (uint8_t*)realloc(chunks_.back().data, chunks_.back().size);
+				if(c)
+					chunks_.back().data = c;
+			}
+			chunks_t	rv;
+			rv.swap(chunks_);
+			last_cap_ = size_ = 0;
+			return rv;
+		}
+
+		~chunk_buffer() {
+			clear();
+		}
+	};
+}
+
+#endif //_CHUNK_BUFFER_H_
+
@@ -0,0 +1,86 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "content_cache.h"
+
+std::string fsarchive::content_cache::key(const std::string& ar, const std::string& f) {
+	// paths can't contain '\0'
+	std::string	rv(ar);
+	rv += '\0';
+	rv += f;
+	return rv;
+}
+
+fsarchive::content_cache::content_cache(const size_t max_mem) : max_mem_(max_mem), stats_({0}) {
+}
+
+fsarchive::content_cache::data_t fsarchive::content_cache::get(const std::string& ar, const std::string& f) {
+	const std::string		k = key(ar, f);
+	std::lock_guard<std::mutex>	l(mtx_);
+	const auto	it = map_.find(k);
+	if(map_.end() == it) {
+		++stats_.misses;
+		return 0;
+	}
+	++stats_.hits;
+	lru_.splice(lru_.begin(), lru_, it->second);
+	return it->second->second;
+}
+
+void fsarchive::content_cache::put(const std::string& ar, const std::string& f, const data_t& data) {
+	if(!data || data->size() > max_mem_)
+		return;
+	const std::string		k = key(ar, f);
+	std::lock_guard<std::mutex>	l(mtx_);
+	if(map_.end() != map_.find(k))
+		return;
+	while(!lru_.empty() && (stats_.mem_used + data->size() > max_mem_)) {
+		stats_.mem_used -= lru_.back().second->size();
+		map_.erase(lru_.back().first);
+		lru_.pop_back();
+		++stats_.evictions;
+	}
+	lru_.push_front(entry_t(k, data));
+	map_[k] = lru_.begin();
+	stats_.mem_used += data->size();
+}
+
+bool fsarchive::content_cache::missed(const std::string& ar, const std::string& f) {
+	std::lock_guard<std::mutex>	l(mtx_);
+	return !missed_.insert(key(ar, f)).second;
+}
+
+bool fsarchive::content_cache::get_crc(const std::string& ar, const std::string& f, uint32_t& crc) {
+	std::lock_guard<std::mutex>	l(mtx_);
+	const auto	it = crcs_.find(key(ar, f));
+	if(crcs_.end() == it)
+		return false;
+	crc = it->second;
+	return true;
+}
+
+void fsarchive::content_cache::put_crc(const std::string& ar, const std::string& f, const uint32_t crc) {
+	std::lock_guard<std::mutex>	l(mtx_);
+	crcs_[key(ar, f)] = crc;
+}
+
+fsarchive::content_cache::stats_t fsarchive::content_cache::get_stats(void) const {
+	std::lock_guard<std::mutex>	l(mtx_);
+	return stats_;
+}
@@ -0,0 +1,94 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CONTENT_CACHE_H_
+#define _CONTENT_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace fsarchive {
+	// LRU cache of the versions of files rebuilt from
+	// the archives, bounded by max_mem bytes; a version
+	// is identified by the archive holding it and the
+	// file path. Data is shared (read only), hence an
+	// evicted version stays valid for its current users.
+	// CRC32s of the versions are memoised as well, and the
+	// versions looked up which weren't cached are recorded
+	// (these are never evicted, being very small).
+	// Can be used by multiple threads at the same time
+	class content_cache {
+	public:
+		typedef std::shared_ptr<const std::vector<uint8_t>>	data_t;
+
+		typedef struct {
+			size_t	hits,
+				misses,
+				evictions,
+				mem_used;
+		} stats_t;
+	private:
+		typedef std::pair<std::string, data_t>			entry_t;
+		typedef std::list<entry_t>				lru_t;
+
+		const size_t						max_mem_;
+		mutable std::mutex					mtx_;
+		// most recently used first
+		lru_t							lru_;
+		std::unordered_map<std::string, lru_t::iterator>	map_;
+		std::unordered_map<std::string, uint32_t>		crcs_;
+		std::unordered_set<std::string>				missed_;
+		stats_t							stats_;
+
+		content_cache();
+		content_cache(const content_cache&);
+		content_cache& operator=(const content_cache&);
+
+		static std::string key(const std::string& ar, const std::string& f);
+	public:
+		content_cache(const size_t max_mem);
+
+		// returns the data of file f in archive
+		// ar, null if not cached
+		data_t get(const std::string& ar, const std::string& f);
+
+		// versions larger than max_mem are not cached
+		void put(const std::string& ar, const std::string& f, const data_t& data);
+
+		// records that file f in archive ar wasn't cached,
+		// returns true if it had been recorded already
+		bool missed(const std::string& ar, const std::string& f);
+
+		bool get_crc(const std::string& ar, const std::string& f, uint32_t& crc);
+
+		void put_crc(const std::string& ar, const std::string& f, const uint32_t crc);
+
+		stats_t get_stats(void) const;
+	};
+}
+
+#endif //_CONTENT_CACHE_H_
+
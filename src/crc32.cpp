@@ -11,8 +11,21 @@
 
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <memory>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include "utils.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
 namespace {
 	uint32_t crc32_for_byte(uint32_t r) {
 	  for(int j = 0; j < 8; ++j)
@@ -36,11 +49,20 @@ namespace {
 	    }
 	}
 
+	struct tables {
+		uint32_t	table[0x100],
+				wtable[0x100*sizeof(accum_t)];
+
+		tables() {
+			init_tables(table, wtable);
+		}
+	};
+
 	void crc32imp(const void* data, size_t n_bytes, uint32_t* crc) {
-	  static uint32_t table[0x100], wtable[0x100*sizeof(accum_t)];
+	  // initialized once, even with multiple threads
+	  static const tables t;
+	  const uint32_t *table = t.table, *wtable = t.wtable;
 	  size_t n_accum = n_bytes/sizeof(accum_t);
-	  if(!*table)
-	    init_tables(table, wtable);
 	  for(size_t i = 0; i < n_accum; ++i) {
 	    accum_t a = *crc ^ ((accum_t*)data)[i];
 	    for(size_t j = *crc = 0; j < sizeof(accum_t); ++j)
@@ -49,19 +71,187 @@ namespace {
 	  for(size_t i = n_accum*sizeof(accum_t); i < n_bytes; ++i)
 	    *crc = table[(uint8_t)*crc ^ ((uint8_t*)data)[i]] ^ *crc >> 8;
 	}
+
+	uint32_t crc32_table(const uint8_t* data, size_t n_bytes, uint32_t crc) {
+		crc32imp(data, n_bytes, &crc);
+		return crc;
+	}
+
+#if defined(__x86_64__)
+	// Folding with carry-less multiplications, as per Intel's "Fast CRC
+	// Computation for Generic Polynomials Using PCLMULQDQ Instruction";
+	// constants are the bit-reflected ones for the CRC32 polynomial.
+	// crc is not inverted (zlib style) and n_bytes has to be a
+	// multiple of 16, at least 64
+	__attribute__((target("pclmul,sse4.1")))
+	uint32_t crc32_pclmul_fold(const uint8_t* buf, size_t n_bytes, uint32_t crc) {
+		alignas(16) static const uint64_t	k1k2[] = { 0x0154442bd4, 0x01c6e41596 },
+							k3k4[] = { 0x01751997d0, 0x00ccaa009e },
+							k5k0[] = { 0x0163cd6124, 0x0000000000 },
+							poly[] = { 0x01db710641, 0x01f7011641 };
+
+		__m128i	x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+		x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+		x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+		x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+		x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+		x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+		x0 = _mm_load_si128((const __m128i*)k1k2);
+		buf += 64;
+		n_bytes -= 64;
+		// fold 4 blocks of 16 bytes in parallel
+		while(n_bytes >= 64) {
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+			x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+			x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+			x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+			x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+			x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+			x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+			x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+			buf += 64;
+			n_bytes -= 64;
+		}
+		// fold into 128 bits
+		x0 = _mm_load_si128((const __m128i*)k3k4);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+		// then the remaining blocks of 16 bytes
+		while(n_bytes >= 16) {
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf)), x5);
+			buf += 16;
+			n_bytes -= 16;
+		}
+		// fold 128 bits to 64
+		x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+		x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+		x1 = _mm_srli_si128(x1, 8);
+		x1 = _mm_xor_si128(x1, x2);
+		x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+		x2 = _mm_srli_si128(x1, 4);
+		x1 = _mm_and_si128(x1, x3);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+		// Barrett reduction to 32 bits
+		x0 = _mm_load_si128((const __m128i*)poly);
+		x2 = _mm_and_si128(x1, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+		x2 = _mm_and_si128(x2, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+		return _mm_extract_epi32(x1, 1);
+	}
+
+	uint32_t crc32_pclmul(const uint8_t* data, size_t n_bytes, uint32_t crc) {
+		const size_t	n_fold = (n_bytes >= 64) ? (n_bytes & ~(size_t)15) : 0;
+		if(n_fold) {
+			crc = ~crc32_pclmul_fold(data, n_fold, ~crc);
+			data += n_fold;
+			n_bytes -= n_fold;
+		}
+		return crc32_table(data, n_bytes, crc);
+	}
+#elif defined(__aarch64__)
+	// ARMv8 CRC32 instructions (same polynomial as zlib),
+	// crc is not inverted
+	__attribute__((target("+crc")))
+	uint32_t crc32_armv8_imp(const uint8_t* data, size_t n_bytes, uint32_t crc) {
+		for(; n_bytes && ((uintptr_t)data & 7); --n_bytes)
+			crc = __crc32b(crc, *data++);
+		for(; n_bytes >= 8; n_bytes -= 8, data += 8) {
+			uint64_t	v;
+			memcpy(&v, data, sizeof(v));
+			crc = __crc32d(crc, v);
+		}
+		for(; n_bytes; --n_bytes)
+			crc = __crc32b(crc, *data++);
+		return crc;
+	}
+
+	uint32_t crc32_armv8(const uint8_t* data, size_t n_bytes, uint32_t crc) {
+		return ~crc32_armv8_imp(data, n_bytes, ~crc);
+	}
+#endif
+
+	typedef uint32_t (*crc32_fn_t)(const uint8_t*, size_t, uint32_t);
+
+	struct crc32_impl {
+		crc32_fn_t	fn;
+		const char	*name;
+	};
+
+	crc32_impl select_impl(void) {
+#if defined(__x86_64__)
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+			return { crc32_pclmul, "pclmul" };
+#elif defined(__aarch64__)
+		if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+			return { crc32_armv8, "armv8" };
+#endif
+		return { crc32_table, "table" };
+	}
+
+	const crc32_impl& get_impl(void) {
+		static const crc32_impl	impl = select_impl();
+		return impl;
+	}
 }
 
 uint32_t crc32::compute(const char* fname, uint32_t start_crc) {
-	char buf[1L << 15];
-	FILE *fp = fopen(fname, "rb"); 
-	uint32_t crc = start_crc;
-	while(!feof(fp) && !ferror(fp))
-		crc32imp(buf, fread(buf, 1, sizeof(buf), fp), &crc);
-	if(!ferror(fp)) {
-		fclose(fp);
-		return crc;
-	} else {
-		fclose(fp);
-		throw fsarchive::rt_error("Couldn't CRC32 the file ") << fname;
+	// page aligned, so that the kernel can copy
+	// whole pages; one per thread
+	const size_t			BUF_SZ = 1024*1024;
+	thread_local std::unique_ptr<uint8_t, void (*)(void*)>	buf((uint8_t*)aligned_alloc(4096, BUF_SZ), free);
+	if(!buf)
+		throw fsarchive::rt_error("Couldn't allocate buffer to CRC32 the file ") << fname;
+	const int	fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if(-1 == fd)
+		throw fsarchive::rt_error("Couldn't open file ") << fname << " to CRC32 it";
+	// let the kernel read ahead aggressively
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	uint32_t	crc = start_crc;
+	while(true) {
+		const ssize_t	rd = read(fd, buf.get(), BUF_SZ);
+		if(rd < 0) {
+			if(EINTR == errno)
+				continue;
+			close(fd);
+			throw fsarchive::rt_error("Couldn't CRC32 the file ") << fname << " : " << strerror(errno);
+		}
+		if(!rd)
+			break;
+		crc = compute(buf.get(), rd, crc);
 	}
+	// the data is not needed anymore, don't let
+	// it evict more useful pages from the cache
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	return crc;
+}
+
+uint32_t crc32::compute(const void* data, const size_t n_bytes, uint32_t start_crc) {
+	return get_impl().fn((const uint8_t*)data, n_bytes, start_crc);
+}
+
+uint32_t crc32::compute_table(const void* data, const size_t n_bytes, uint32_t start_crc) {
+	return crc32_table((const uint8_t*)data, n_bytes, start_crc);
+}
+
+const char* crc32::impl_name(void) {
+	return get_impl().name;
 }
@@ -1,10 +1,23 @@
 #ifndef _CRC32_H_
 #define _CRC32_H_
 
+#include <cstddef>
 #include <cstdint>
 
 namespace crc32 {
 	uint32_t compute(const char* fname, uint32_t start_crc = 0);
+
+	// data can be CRC'ed in pieces, passing the
+	// previous result as start_crc; uses the fastest
+	// implementation the CPU supports
+	uint32_t compute(const void* data, const size_t n_bytes, uint32_t start_crc = 0);
+
+	// table based implementation, always available
+	uint32_t compute_table(const void* data, const size_t n_bytes, uint32_t start_crc = 0);
+
+	// name of the implementation used by compute
+	// (i.e. "pclmul", "armv8" or "table")
+	const char* impl_name(void);
 }
 
 #endif //_CRC32_H_
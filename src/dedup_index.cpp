@@ -0,0 +1,137 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "dedup_index.h"
+#include "utils.h"
+#include "log.h"
+#include <cstdio>
+#include <fstream>
+
+namespace {
+	const char	DEDUP_INDEX_MAGIC[8] = { 'F', 'S', 'A', 'D', 'D', 'P', '0', '1' };
+
+	typedef struct {
+		char		magic[8];
+		uint64_t	n_entries;
+	} __attribute__((packed)) header_t;
+
+	typedef struct {
+		uint8_t		digest[32];
+		int64_t		size;
+		uint32_t	archive_sz,
+				path_sz;
+	} __attribute__((packed)) entry_header_t;
+
+	void write_data(std::ofstream& ostr, const void* data, const size_t sz) {
+		ostr.write((const char*)data, sz);
+	}
+
+	void read_data(std::ifstream& istr, void* data, const size_t sz) {
+		istr.read((char*)data, sz);
+		if((size_t)istr.gcount() != sz)
+			throw fsarchive::rt_error("Truncated dedup index");
+	}
+
+	void read_string(std::ifstream& istr, std::string& s, const size_t sz) {
+		if(sz > 64*1024)
+			throw fsarchive::rt_error("Invalid dedup index string size ") << sz;
+		s.resize(sz);
+		read_data(istr, &s[0], sz);
+	}
+}
+
+fsarchive::dedup_index::dedup_index() {
+}
+
+const fsarchive::dedup_index::entry_t* fsarchive::dedup_index::find(const sha256::digest_t& d, const int64_t size) const {
+	const auto	it = entries_.find(d);
+	if((entries_.end() == it) || (it->second.size != size))
+		return 0;
+	return &it->second;
+}
+
+void fsarchive::dedup_index::add(const sha256::digest_t& d, const int64_t size, const std::string& archive, const std::string& path) {
+	entries_[d] = { .size = size, .archive = archive, .path = path };
+}
+
+bool fsarchive::dedup_index::load(const std::string& path, const std::set<std::string>& archives) {
+	entries_.clear();
+	std::ifstream	istr(path, std::ios_base::binary);
+	if(!istr)
+		return false;
+	try {
+		header_t	h;
+		read_data(istr, &h, sizeof(h));
+		if(memcmp(h.magic, DEDUP_INDEX_MAGIC, sizeof(DEDUP_INDEX_MAGIC)))
+			throw fsarchive::rt_error("Invalid dedup index magic");
+		size_t	n_pruned = 0;
+		for(uint64_t i = 0; i < h.n_entries; ++i) {
+			entry_header_t	eh;
+			read_data(istr, &eh, sizeof(eh));
+			entry_t		e;
+			e.size = eh.size;
+			read_string(istr, e.archive, eh.archive_sz);
+			read_string(istr, e.path, eh.path_sz);
+			// archives which have been removed
+			if(!archives.count(e.archive)) {
+				++n_pruned;
+				continue;
+			}
+			sha256::digest_t	d;
+			memcpy(d.data(), eh.digest, d.size());
+			entries_[d] = std::move(e);
+		}
+		if(n_pruned)
+			LOG_INFO << "Dedup index " << path << " had " << n_pruned << " entries of archives not present anymore";
+	} catch(const std::exception& e) {
+		LOG_WARNING << "Can't load dedup index " << path << ": " << e.what();
+		entries_.clear();
+		return false;
+	}
+	return true;
+}
+
+void fsarchive::dedup_index::save(const std::string& path) const {
+	const std::string	tmp_path = path + ".tmp";
+	{
+		std::ofstream	ostr(tmp_path, std::ios_base::binary|std::ios_base::trunc);
+		if(!ostr)
+			throw fsarchive::rt_error("Can't open dedup index ") << tmp_path << " for writing";
+		header_t	h;
+		memcpy(h.magic, DEDUP_INDEX_MAGIC, sizeof(DEDUP_INDEX_MAGIC));
+		h.n_entries = entries_.size();
+		write_data(ostr, &h, sizeof(h));
+		for(const auto& e : entries_) {
+			entry_header_t	eh;
+			memcpy(eh.digest, e.first.data(), sizeof(eh.digest));
+			eh.size = e.second.size;
+			eh.archive_sz = e.second.archive.size();
+			eh.path_sz = e.second.path.size();
+			write_data(ostr, &eh, sizeof(eh));
+			write_data(ostr, e.second.archive.c_str(), e.second.archive.size());
+			write_data(ostr, e.second.path.c_str(), e.second.path.size());
+		}
+		ostr.flush();
+		if(!ostr)
+			throw fsarchive::rt_error("Can't write dedup index ") << tmp_path;
+	}
+	if(rename(tmp_path.c_str(), path.c_str()))
+		throw fsarchive::rt_error("Can't rename dedup index ") << tmp_path << " to " << path;
+}
@@ -0,0 +1,95 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _DEDUP_INDEX_H_
+#define _DEDUP_INDEX_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <set>
+#include <unordered_map>
+#include "sha256.h"
+
+namespace fsarchive {
+	// Sidecar index (see --dedup) of the content of the files
+	// stored as FS_TYPE_FILE_NEW: for each SHA-256 (and size)
+	// the archive and the path of an entry holding such data,
+	// which new files with the same content can point to
+	// (see FS_TYPE_FILE_DUP) rather than being stored again
+	class dedup_index {
+	public:
+		typedef struct {
+			int64_t		size;
+			std::string	archive,
+					path;
+		} entry_t;
+	private:
+		struct digest_hash {
+			size_t operator()(const sha256::digest_t& d) const {
+				size_t	rv;
+				memcpy(&rv, d.data(), sizeof(rv));
+				return rv;
+			}
+		};
+
+		std::unordered_map<sha256::digest_t, entry_t, digest_hash>	entries_;
+
+		dedup_index(const dedup_index&);
+		dedup_index& operator=(const dedup_index&);
+	public:
+		dedup_index();
+
+		// returns the entry with content d and size,
+		// null if not present
+		const entry_t* find(const sha256::digest_t& d, const int64_t size) const;
+
+		// replaces the entry with the same content, if any
+		void add(const sha256::digest_t& d, const int64_t size, const std::string& archive, const std::string& path);
+
+		// invokes fn on every entry, which can change its
+		// archive and path; the ones fn returns false for
+		// are removed
+		template<typename Fn>
+		void update(Fn fn) {
+			for(auto it = entries_.begin(); it != entries_.end(); ) {
+				if(fn(it->second))
+					++it;
+				else
+					it = entries_.erase(it);
+			}
+		}
+
+		size_t size(void) const {
+			return entries_.size();
+		}
+
+		// loads the index at path keeping only the entries
+		// of archives, returns false if it doesn't exist or
+		// is invalid
+		bool load(const std::string& path, const std::set<std::string>& archives);
+
+		// atomically replaces the index at path
+		void save(const std::string& path) const;
+	};
+}
+
+#endif //_DEDUP_INDEX_H_
+
@@ -0,0 +1,99 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "deflate_raw.h"
+#include "utils.h"
+#include <string.h>
+#include <memory>
+#include <algorithm>
+#include <zlib.h>
+
+namespace {
+	// zlib works with 32 bits sizes
+	const size_t	MAX_STEP = 1024*1024*1024;
+}
+
+void fsarchive::deflate_raw(const uint8_t *dict, const size_t dict_sz, const uint8_t *in, const size_t in_sz, const bool last, const int level, std::vector<uint8_t>& out) {
+	z_stream	zs;
+	memset(&zs, 0, sizeof(zs));
+	if(Z_OK != deflateInit2(&zs, (level > 0) ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY))
+		throw fsarchive::rt_error("Can't initialize deflate stream");
+	std::unique_ptr<z_stream, int (*)(z_stream*)>	p_zs(&zs, deflateEnd);
+	if(dict_sz && (Z_OK != deflateSetDictionary(&zs, dict, dict_sz)))
+		throw fsarchive::rt_error("Can't set deflate dictionary");
+	const uint8_t	*in_cur = in;
+	size_t		in_left = in_sz;
+	out.resize(deflateBound(&zs, std::min(in_sz, MAX_STEP)) + 64);
+	while(true) {
+		if(!zs.avail_in && in_left) {
+			zs.next_in = (Bytef*)in_cur;
+			zs.avail_in = std::min(in_left, MAX_STEP);
+			in_cur += zs.avail_in;
+			in_left -= zs.avail_in;
+		}
+		const int	flush = (in_left) ? Z_NO_FLUSH : ((last) ? Z_FINISH : Z_SYNC_FLUSH);
+		if(out.size() - zs.total_out < 64)
+			out.resize(2*out.size());
+		zs.next_out = out.data() + zs.total_out;
+		zs.avail_out = std::min(out.size() - zs.total_out, MAX_STEP);
+		const int	rc = deflate(&zs, flush);
+		if((Z_OK != rc) && (Z_BUF_ERROR != rc) && (Z_STREAM_END != rc))
+			throw fsarchive::rt_error("Can't deflate data: ") << rc;
+		if(Z_STREAM_END == rc)
+			break;
+		// a sync flush is complete when there
+		// is still room for the output
+		if((Z_SYNC_FLUSH == flush) && !zs.avail_in && zs.avail_out)
+			break;
+	}
+	out.resize(zs.total_out);
+}
+
+void fsarchive::inflate_raw(const uint8_t *in, const size_t in_sz, uint8_t *out, const size_t out_sz) {
+	z_stream	zs;
+	memset(&zs, 0, sizeof(zs));
+	if(Z_OK != inflateInit2(&zs, -MAX_WBITS))
+		throw fsarchive::rt_error("Can't initialize inflate stream");
+	std::unique_ptr<z_stream, int (*)(z_stream*)>	p_zs(&zs, inflateEnd);
+	const uint8_t	*in_cur = in;
+	size_t		in_left = in_sz,
+			out_done = 0;
+	while(true) {
+		if(!zs.avail_in && in_left) {
+			zs.next_in = (Bytef*)in_cur;
+			zs.avail_in = std::min(in_left, MAX_STEP);
+			in_cur += zs.avail_in;
+			in_left -= zs.avail_in;
+		}
+		zs.next_out = out + out_done;
+		zs.avail_out = std::min(out_sz - out_done, MAX_STEP);
+		const uInt	prev_avail = zs.avail_out;
+		const int	rc = inflate(&zs, Z_NO_FLUSH);
+		out_done += prev_avail - zs.avail_out;
+		if(Z_STREAM_END == rc)
+			break;
+		if((Z_OK != rc) && (Z_BUF_ERROR != rc))
+			throw fsarchive::rt_error("Can't inflate data: ") << rc;
+		// no progress possible
+		if((Z_BUF_ERROR == rc) && (!in_left || out_done == out_sz))
+			break;
+	}
+	if(out_done != out_sz)
+		throw fsarchive::rt_error("Invalid inflated size ") << out_done << " (expected " << out_sz << ")";
+}
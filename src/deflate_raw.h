@@ -0,0 +1,40 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DEFLATE_RAW_H_
+#define _DEFLATE_RAW_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fsarchive {
+	// deflates in into a raw deflate stream (no zlib/gzip header),
+	// using the dict_sz bytes of dict as dictionary; if not last the
+	// stream is terminated with a sync flush, so that it can be
+	// followed by the next chunk. level 0 means default
+	void deflate_raw(const uint8_t *dict, const size_t dict_sz, const uint8_t *in, const size_t in_sz, const bool last, const int level, std::vector<uint8_t>& out);
+
+	// inflates the raw deflate stream in, which has to
+	// produce exactly out_sz bytes; throws otherwise
+	void inflate_raw(const uint8_t *in, const size_t in_sz, uint8_t *out, const size_t out_sz);
+}
+
+#endif //_DEFLATE_RAW_H_
+
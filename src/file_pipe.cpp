@@ -0,0 +1,273 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "file_pipe.h"
+#include "deflate_raw.h"
+#include "utils.h"
+#include "log.h"
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+
+namespace {
+	const size_t	CHUNK_SIZE = 4*1024*1024;
+	// max deflate distance
+	const size_t	DICT_SIZE = 32*1024;
+}
+
+fsarchive::file_pipe::job_t& fsarchive::file_pipe::get_job(const id_t id) {
+	if(id < base_id_ || id >= base_id_ + jobs_.size())
+		throw fsarchive::rt_error("Invalid file_pipe id ") << id;
+	return *jobs_[id - base_id_];
+}
+
+void fsarchive::file_pipe::read_chunk(job_t& j, const size_t c) {
+	chunk_t&	ch = j.chunks[c];
+	try {
+		int	fd = -1;
+		{
+			std::lock_guard<std::mutex>	l(j.fd_mtx);
+			if(-1 == j.fd) {
+				j.fd = open(j.path.c_str(), O_RDONLY|O_CLOEXEC);
+				if(-1 == j.fd)
+					throw fsarchive::rt_error("Can't open file ") << j.path << " for reading";
+				posix_fadvise(j.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			}
+			fd = j.fd;
+		}
+		// the last chunk reads all the
+		// remaining data, if any
+		const bool	last = (c + 1 == j.chunks.size());
+		// when deflating, read the previous data
+		// too to be used as dictionary
+		const size_t	dict_sz = ((j.comp_level >= 0) && c) ? DICT_SIZE : 0;
+		const off64_t	off = c*CHUNK_SIZE - dict_sz;
+		// size the last buffer on the expected size (plus
+		// one byte to spot EOF without growing it)
+		const uint64_t	exp_sz = (j.sz > c*CHUNK_SIZE) ? j.sz - c*CHUNK_SIZE : 0;
+		std::vector<uint8_t>	buf(dict_sz + ((last) ? exp_sz + 1 : CHUNK_SIZE));
+		size_t		rd = 0;
+		while(true) {
+			if(rd == buf.size()) {
+				if(!last)
+					break;
+				buf.resize(rd + CHUNK_SIZE);
+			}
+			const ssize_t	r = pread64(fd, buf.data() + rd, buf.size() - rd, off + rd);
+			if(r < 0) {
+				if(EINTR == errno)
+					continue;
+				throw fsarchive::rt_error("Can't read file ") << j.path << " : " << strerror(errno);
+			}
+			if(!r)
+				break;
+			rd += r;
+		}
+		// the file may have been truncated meanwhile
+		const size_t	dict_rd = std::min(rd, dict_sz);
+		const uint8_t	*raw = buf.data() + dict_rd;
+		ch.raw_sz = rd - dict_rd;
+		ch.crc = crc32_z(0, raw, ch.raw_sz);
+		if(j.comp_level >= 0) {
+			fsarchive::deflate_raw(buf.data(), dict_rd, raw, ch.raw_sz, last, j.comp_level, ch.data);
+		} else {
+			buf.resize(rd);
+			ch.data.swap(buf);
+		}
+	} catch(...) {
+		ch.err = std::current_exception();
+	}
+}
+
+// expected memory of chunk c of j, so that small
+// files aren't accounted for as whole chunks
+size_t fsarchive::file_pipe::chunk_mem(const job_t& j, const size_t c) const {
+	const size_t	dict_sz = ((j.comp_level >= 0) && c) ? DICT_SIZE : 0;
+	const uint64_t	exp_sz = (j.sz > c*CHUNK_SIZE) ? j.sz - c*CHUNK_SIZE : 0;
+	return dict_sz + std::min((uint64_t)CHUNK_SIZE, exp_sz) + 1;
+}
+
+// moves the dispatch position past any job
+// closed already, returns true if there is
+// a chunk to be read
+bool fsarchive::file_pipe::next_chunk(void) {
+	if(disp_id_ < base_id_) {
+		disp_id_ = base_id_;
+		disp_chunk_ = 0;
+	}
+	while(disp_id_ < base_id_ + jobs_.size()) {
+		if(!jobs_[disp_id_ - base_id_]->closed)
+			return true;
+		++disp_id_;
+		disp_chunk_ = 0;
+	}
+	return false;
+}
+
+void fsarchive::file_pipe::purge(void) {
+	while(!jobs_.empty() && jobs_.front()->closed && !jobs_.front()->busy) {
+		if(-1 != jobs_.front()->fd)
+			::close(jobs_.front()->fd);
+		jobs_.pop_front();
+		++base_id_;
+	}
+}
+
+void fsarchive::file_pipe::worker(void) {
+	while(true) {
+		job_t	*j = 0;
+		size_t	c = 0;
+		{
+			std::unique_lock<std::mutex>	l(mtx_);
+			// always let at least one chunk through
+			cv_work_.wait(l, [this](){ return quit_ || (next_chunk() && ((in_flight_ + chunk_mem(*jobs_[disp_id_ - base_id_], disp_chunk_) <= max_mem_) || !in_flight_)); });
+			if(quit_)
+				return;
+			j = jobs_[disp_id_ - base_id_].get();
+			c = disp_chunk_;
+			if(++disp_chunk_ == j->chunks.size()) {
+				++disp_id_;
+				disp_chunk_ = 0;
+			}
+			++j->busy;
+			j->chunks[c].mem = chunk_mem(*j, c);
+			in_flight_ += j->chunks[c].mem;
+		}
+		read_chunk(*j, c);
+		{
+			std::lock_guard<std::mutex>	l(mtx_);
+			j->chunks[c].ready = true;
+			--j->busy;
+			purge();
+		}
+		cv_ready_.notify_all();
+	}
+}
+
+fsarchive::file_pipe::file_pipe(const size_t n_threads, const size_t max_mem) : max_mem_(max_mem), base_id_(0), disp_id_(0), disp_chunk_(0), in_flight_(0), quit_(false) {
+	for(size_t i = 0; i < n_threads; ++i)
+		workers_.push_back(std::thread(&file_pipe::worker, this));
+	LOG_SPAM << "File pipe started with " << n_threads << " thread(s) and " << max_mem << " bytes";
+}
+
+fsarchive::file_pipe::id_t fsarchive::file_pipe::add(const std::string& f, const uint64_t sz, const int comp_level) {
+	pjob_t	j(new job_t());
+	j->path = f;
+	j->fd = -1;
+	j->sz = sz;
+	j->chunks.resize((sz > CHUNK_SIZE) ? (sz + CHUNK_SIZE - 1)/CHUNK_SIZE : 1);
+	j->comp_level = comp_level;
+	j->crc = 0;
+	j->raw_sz = 0;
+	j->cur_chunk = j->cur_off = 0;
+	j->busy = 0;
+	j->closed = false;
+	id_t	id = 0;
+	{
+		std::lock_guard<std::mutex>	l(mtx_);
+		jobs_.push_back(std::move(j));
+		id = base_id_ + jobs_.size() - 1;
+	}
+	cv_work_.notify_one();
+	return id;
+}
+
+uint64_t fsarchive::file_pipe::read(const id_t id, void *data, const uint64_t len) {
+	uint8_t		*out = (uint8_t*)data;
+	uint64_t	rv = 0;
+	job_t		*j = 0;
+	{
+		std::lock_guard<std::mutex>	l(mtx_);
+		j = &get_job(id);
+	}
+	while(rv < len && j->cur_chunk < j->chunks.size()) {
+		chunk_t&	ch = j->chunks[j->cur_chunk];
+		{
+			std::unique_lock<std::mutex>	l(mtx_);
+			cv_ready_.wait(l, [&ch](){ return ch.ready; });
+		}
+		if(ch.err)
+			std::rethrow_exception(ch.err);
+		const size_t	n = std::min(len - rv, (uint64_t)(ch.data.size() - j->cur_off));
+		memcpy(out + rv, ch.data.data() + j->cur_off, n);
+		rv += n;
+		j->cur_off += n;
+		if(j->cur_off == ch.data.size()) {
+			// done with this chunk, let the
+			// workers read some more
+			std::vector<uint8_t>().swap(ch.data);
+			j->crc = (j->raw_sz) ? crc32_combine(j->crc, ch.crc, ch.raw_sz) : ch.crc;
+			j->raw_sz += ch.raw_sz;
+			j->cur_off = 0;
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				++j->cur_chunk;
+				in_flight_ -= ch.mem;
+			}
+			cv_work_.notify_all();
+		}
+	}
+	return rv;
+}
+
+void fsarchive::file_pipe::get_crc_size(const id_t id, uint32_t& crc, uint64_t& sz) {
+	std::lock_guard<std::mutex>	l(mtx_);
+	const job_t&	j = get_job(id);
+	crc = j.crc;
+	sz = j.raw_sz;
+}
+
+void fsarchive::file_pipe::close(const id_t id) {
+	{
+		std::lock_guard<std::mutex>	l(mtx_);
+		job_t&	j = get_job(id);
+		if(j.closed)
+			return;
+		// release the chunks which have been
+		// read but not consumed and skip the
+		// ones not read yet
+		for(size_t c = j.cur_chunk; c < j.chunks.size(); ++c)
+			if((id < disp_id_) || ((id == disp_id_) && (c < disp_chunk_)))
+				in_flight_ -= j.chunks[c].mem;
+		if(id == disp_id_) {
+			++disp_id_;
+			disp_chunk_ = 0;
+		}
+		j.cur_chunk = j.chunks.size();
+		j.closed = true;
+		purge();
+	}
+	cv_work_.notify_all();
+}
+
+fsarchive::file_pipe::~file_pipe() {
+	{
+		std::lock_guard<std::mutex>	l(mtx_);
+		quit_ = true;
+	}
+	cv_work_.notify_all();
+	for(auto& t : workers_)
+		t.join();
+	for(const auto& j : jobs_)
+		if(-1 != j->fd)
+			::close(j->fd);
+}
@@ -0,0 +1,142 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _FILE_PIPE_H_
+#define _FILE_PIPE_H_
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace fsarchive {
+	// Reads files with a pool of threads ahead of the
+	// consumer (libzip when saving the archive), so that
+	// while a file is being written the next ones are
+	// already being loaded and compressed.
+	// Files are read in chunks, in the same order they
+	// have been added, and no more than max_mem bytes
+	// are kept in memory at any given time; the consumer
+	// has to read the files in the same order too.
+	// When requested, each chunk is deflated on its own
+	// (with the previous 32 KiB as dictionary) so that the
+	// concatenation of all of them is a single raw deflate
+	// stream of the whole file
+	class file_pipe {
+	public:
+		typedef size_t	id_t;
+	private:
+		typedef struct {
+			std::vector<uint8_t>	data;
+			// CRC32 and size of the file data
+			// (data may be deflated)
+			uint32_t		crc;
+			uint64_t		raw_sz;
+			// memory accounted for in in_flight_
+			size_t			mem;
+			bool			ready;
+			std::exception_ptr	err;
+		} chunk_t;
+
+		typedef struct {
+			std::string		path;
+			std::mutex		fd_mtx;
+			int			fd;
+			uint64_t		sz;
+			std::vector<chunk_t>	chunks;
+			// deflate level, -1 to leave
+			// the data as is
+			int			comp_level;
+			// CRC32 and size of the file data
+			// consumed so far
+			uint32_t		crc;
+			uint64_t		raw_sz;
+			// consumer position
+			size_t			cur_chunk,
+						cur_off;
+			// chunks being read
+			size_t			busy;
+			bool			closed;
+		} job_t;
+
+		typedef std::unique_ptr<job_t>	pjob_t;
+
+		const size_t			max_mem_;
+		std::mutex			mtx_;
+		std::condition_variable		cv_work_,
+						cv_ready_;
+		// jobs not yet fully consumed, the first
+		// one has id base_id_
+		std::deque<pjob_t>		jobs_;
+		id_t				base_id_;
+		// next chunk to be read
+		id_t				disp_id_;
+		size_t				disp_chunk_;
+		size_t				in_flight_;
+		bool				quit_;
+		std::vector<std::thread>	workers_;
+
+		file_pipe();
+		file_pipe(const file_pipe&);
+		file_pipe& operator=(const file_pipe&);
+
+		job_t& get_job(const id_t id);
+
+		size_t chunk_mem(const job_t& j, const size_t c) const;
+
+		bool next_chunk(void);
+
+		void purge(void);
+
+		void read_chunk(job_t& j, const size_t c);
+
+		void worker(void);
+	public:
+		file_pipe(const size_t n_threads, const size_t max_mem);
+
+		// sz is the expected size of the file, comp_level
+		// is the deflate level (0 for default) or -1 to
+		// read the file as is
+		id_t add(const std::string& f, const uint64_t sz, const int comp_level = -1);
+
+		// reads up to len bytes of file id (deflated if so
+		// requested) and returns the number of bytes read, 0
+		// once the file is over
+		// throws if the file couldn't be read
+		uint64_t read(const id_t id, void *data, const uint64_t len);
+
+		// returns the CRC32 and size of the file data read
+		// so far; to be called once read has returned 0
+		void get_crc_size(const id_t id, uint32_t& crc, uint64_t& sz);
+
+		// to be called once the consumer is done with file id,
+		// can be called more than once
+		void close(const id_t id);
+
+		~file_pipe();
+	};
+}
+
+#endif //_FILE_PIPE_H_
+
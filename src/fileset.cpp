@@ -0,0 +1,283 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "fileset.h"
+#include "utils.h"
+#include <cstring>
+#include <algorithm>
+#include <functional>
+
+namespace {
+	const size_t	MIN_SLOTS = 1024;
+}
+
+// "a/b/c" -> "a/b/" + "c" and "a/b/" -> "a/" + "b/"
+void fsarchive::fileset::split(const std::string& f, std::string_view& dir, std::string_view& name) {
+	const size_t	pos = (f.size() > 1) ? f.rfind('/', f.size() - 2) : std::string::npos;
+	if(std::string::npos == pos) {
+		dir = std::string_view();
+		name = std::string_view(f);
+	} else {
+		dir = std::string_view(f.c_str(), pos + 1);
+		name = std::string_view(f.c_str() + pos + 1, f.size() - pos - 1);
+	}
+}
+
+uint64_t fsarchive::fileset::hash(const uint32_t dir, const std::string_view& name) {
+	return std::hash<std::string_view>()(name) ^ ((uint64_t)dir*0x9e3779b97f4a7c15ULL);
+}
+
+size_t fsarchive::fileset::find_slot(const uint32_t dir, const std::string_view& name) const {
+	const size_t	mask = slots_.size() - 1;
+	const uint64_t	h = hash(dir, name);
+	for(size_t i = (h ^ (h >> 32)) & mask; ; i = (i + 1) & mask) {
+		const uint32_t	s = slots_[i];
+		if(!s)
+			return i;
+		const entry_t&	e = entries_[s - 1];
+		if((e.dir == dir) && (name == this->name(e)))
+			return i;
+	}
+}
+
+void fsarchive::fileset::rehash(const size_t n_slots) {
+	std::vector<uint32_t>(n_slots, 0).swap(slots_);
+	for(size_t i = 0; i < entries_.size(); ++i)
+		slots_[find_slot(entries_[i].dir, name(entries_[i]))] = i + 1;
+}
+
+int64_t fsarchive::fileset::find_idx(const std::string& f) const {
+	std::string_view	dir,
+				name;
+	split(f, dir, name);
+	const auto	it_dir = dirs_idx_.find(dir);
+	if(dirs_idx_.end() == it_dir)
+		return -1;
+	const uint32_t	s = slots_[find_slot(it_dir->second, name)];
+	return (s) ? (int64_t)s - 1 : -1;
+}
+
+fsarchive::fileset::fileset() {
+	clear();
+}
+
+bool fsarchive::fileset::insert(const std::string& f, const stat64_ext_t& s) {
+	std::string_view	dir,
+				name;
+	split(f, dir, name);
+	if(name.size() > 0xffff)
+		throw fsarchive::rt_error("Name too long for entry ") << f;
+	if(entries_.size() >= 0xfffffffe)
+		throw fsarchive::rt_error("Too many entries, can't add ") << f;
+	auto	it_dir = dirs_idx_.find(dir);
+	if(dirs_idx_.end() == it_dir) {
+		dirs_.push_back(std::string(dir));
+		it_dir = dirs_idx_.insert(std::make_pair(std::string_view(dirs_.back()), (uint32_t)dirs_.size() - 1)).first;
+	}
+	// keep the load factor under 3/4
+	if(4*(entries_.size() + 1) > 3*slots_.size())
+		rehash(2*slots_.size());
+	const size_t	slot = find_slot(it_dir->second, name);
+	if(slots_[slot])
+		return false;
+	const std::string_view	prev(s.s.fs_prev, strnlen(s.s.fs_prev, sizeof(s.s.fs_prev)));
+	auto	it_prev = prevs_idx_.find(prev);
+	if(prevs_idx_.end() == it_prev) {
+		if(prevs_.size() >= (1 << 24))
+			throw fsarchive::rt_error("Too many previous archives, can't add ") << f;
+		prevs_.push_back(std::string(prev));
+		it_prev = prevs_idx_.insert(std::make_pair(std::string_view(prevs_.back()), (uint32_t)prevs_.size() - 1)).first;
+	}
+	const attr_t	attr = { (uint32_t)s.s.fs_mode, (uint32_t)s.s.fs_uid, (uint32_t)s.s.fs_gid };
+	auto	it_attr = attrs_idx_.find(attr);
+	if(attrs_idx_.end() == it_attr) {
+		attrs_.push_back(attr);
+		it_attr = attrs_idx_.insert(std::make_pair(attr, (uint32_t)attrs_.size() - 1)).first;
+	}
+	const uint64_t	name_off = names_.size();
+	if(name_off >> 40)
+		throw fsarchive::rt_error("Too much data for paths, can't add ") << f;
+	entry_t	e;
+	memset(&e, 0, sizeof(e));
+	e.size = s.s.fs_size;
+	e.crc = s.crc;
+	e.dir = it_dir->second;
+	e.attr = it_attr->second;
+	e.name_off = name_off;
+	e.name_off_hi = name_off >> 32;
+	e.prev = it_prev->second;
+	e.type = s.s.fs_type;
+	e.name_len = name.size();
+	auto fn_fits = [](const time_t t) -> bool { return (t >= 0) && (t <= (time_t)0xffffffff); };
+	if(fn_fits(s.s.fs_atime) && fn_fits(s.s.fs_mtime) && fn_fits(s.s.fs_ctime)) {
+		e.atime = s.s.fs_atime;
+		e.mtime = s.s.fs_mtime;
+		e.ctime = s.s.fs_ctime;
+	} else {
+		e.wide_times = 1;
+		wide_times_[entries_.size()] = { .atime = s.s.fs_atime, .mtime = s.s.fs_mtime, .ctime = s.s.fs_ctime };
+	}
+	names_.insert(names_.end(), name.begin(), name.end());
+	entries_.push_back(e);
+	slots_[slot] = entries_.size();
+	paths_sz_ += f.size();
+	return true;
+}
+
+bool fsarchive::fileset::find(const std::string& f, stat64_ext_t& s) const {
+	const int64_t	idx = find_idx(f);
+	if(idx < 0)
+		return false;
+	get(idx, s);
+	return true;
+}
+
+std::string fsarchive::fileset::path(const size_t i) const {
+	const entry_t&	e = entries_[i];
+	std::string	rv;
+	rv.reserve(dirs_[e.dir].size() + e.name_len);
+	rv += dirs_[e.dir];
+	rv += name(e);
+	return rv;
+}
+
+void fsarchive::fileset::get(const size_t i, stat64_ext_t& s) const {
+	const entry_t&	e = entries_[i];
+	const attr_t&	attr = attrs_[e.attr];
+	memset(&s, 0, sizeof(s));
+	s.s.fs_mode = attr[0];
+	s.s.fs_uid = attr[1];
+	s.s.fs_gid = attr[2];
+	s.s.fs_type = e.type;
+	if(e.wide_times) {
+		const times_t&	t = wide_times_.find(i)->second;
+		s.s.fs_atime = t.atime;
+		s.s.fs_mtime = t.mtime;
+		s.s.fs_ctime = t.ctime;
+	} else {
+		s.s.fs_atime = e.atime;
+		s.s.fs_mtime = e.mtime;
+		s.s.fs_ctime = e.ctime;
+	}
+	s.s.fs_size = e.size;
+	strncpy(s.s.fs_prev, prevs_[e.prev].c_str(), sizeof(s.s.fs_prev) - 1);
+	s.crc = e.crc;
+}
+
+int fsarchive::fileset::compare(const size_t i, const std::string_view& f) const {
+	const entry_t&		e = entries_[i];
+	const std::string&	dir = dirs_[e.dir];
+	// f is in the same directory, which is
+	// by far the most common case
+	if((f.size() >= dir.size()) && !memcmp(f.data(), dir.data(), dir.size()))
+		return path_cmp(name(e), f.substr(dir.size()));
+	return path_cmp(dir, f.substr(0, dir.size()));
+}
+
+int fsarchive::fileset::compare(const entry_t& a, const entry_t& b) const {
+	if(a.dir == b.dir)
+		return path_cmp(name(a), name(b));
+	// walk both the paths (directory + name)
+	// without building them
+	const std::string_view	a_p[] = { dirs_[a.dir], name(a) },
+				b_p[] = { dirs_[b.dir], name(b) };
+	auto fn_key = [](const std::string_view* p, size_t k) -> int {
+		if(k >= p[0].size()) {
+			k -= p[0].size();
+			if(k >= p[1].size())
+				return -1;
+			return ('/' == p[1][k]) ? 0 : (uint8_t)p[1][k] + 1;
+		}
+		return ('/' == p[0][k]) ? 0 : (uint8_t)p[0][k] + 1;
+	};
+	for(size_t k = 0; ; ++k) {
+		const int	c_a = fn_key(a_p, k),
+				c_b = fn_key(b_p, k);
+		if(c_a != c_b)
+			return (c_a < c_b) ? -1 : 1;
+		if(-1 == c_a)
+			return 0;
+	}
+}
+
+void fsarchive::fileset::sort(void) {
+	bool	sorted = true;
+	for(size_t i = 1; sorted && (i < entries_.size()); ++i)
+		sorted = (compare(entries_[i-1], entries_[i]) < 0);
+	if(sorted)
+		return;
+	std::vector<uint32_t>	perm(entries_.size());
+	for(size_t i = 0; i < perm.size(); ++i)
+		perm[i] = i;
+	std::sort(perm.begin(), perm.end(), [this](const uint32_t a, const uint32_t b) { return compare(entries_[a], entries_[b]) < 0; });
+	std::vector<entry_t>			entries;
+	std::unordered_map<uint32_t, times_t>	wide_times;
+	entries.reserve(entries_.size());
+	for(const auto i : perm) {
+		if(entries_[i].wide_times)
+			wide_times[entries.size()] = wide_times_[i];
+		entries.push_back(entries_[i]);
+	}
+	entries_.swap(entries);
+	wide_times_.swap(wide_times);
+	rehash(slots_.size());
+}
+
+void fsarchive::fileset::reserve(const size_t n) {
+	entries_.reserve(n);
+	size_t	n_slots = slots_.size();
+	while(4*n > 3*n_slots)
+		n_slots *= 2;
+	if(n_slots != slots_.size())
+		rehash(n_slots);
+}
+
+void fsarchive::fileset::shrink(void) {
+	entries_.shrink_to_fit();
+	names_.shrink_to_fit();
+}
+
+void fsarchive::fileset::clear(void) {
+	std::vector<entry_t>().swap(entries_);
+	std::vector<char>().swap(names_);
+	dirs_idx_.clear();
+	dirs_.clear();
+	prevs_idx_.clear();
+	prevs_.clear();
+	prevs_.push_back(std::string());
+	prevs_idx_[prevs_.back()] = 0;
+	attrs_idx_.clear();
+	attrs_.clear();
+	wide_times_.clear();
+	std::vector<uint32_t>(MIN_SLOTS, 0).swap(slots_);
+	paths_sz_ = 0;
+}
+
+size_t fsarchive::fileset::mem_usage(void) const {
+	// hash/tree nodes and string headers
+	const size_t	NODE_OVERHEAD = 64;
+	size_t		rv = sizeof(*this) + entries_.capacity()*sizeof(entry_t) + names_.capacity() + slots_.capacity()*sizeof(uint32_t);
+	for(const auto& d : dirs_)
+		rv += d.capacity() + NODE_OVERHEAD;
+	for(const auto& p : prevs_)
+		rv += p.capacity() + NODE_OVERHEAD;
+	rv += attrs_.size()*(sizeof(attr_t) + NODE_OVERHEAD) + wide_times_.size()*(sizeof(times_t) + NODE_OVERHEAD);
+	return rv;
+}
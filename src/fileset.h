@@ -0,0 +1,222 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _FILESET_H_
+#define _FILESET_H_
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+namespace fsarchive {
+	typedef struct _stat64 {
+		mode_t fs_mode;
+		uid_t fs_uid;
+		gid_t fs_gid;
+		uint32_t fs_type;
+		time_t fs_atime;
+		time_t fs_mtime;
+		time_t fs_ctime;
+		off64_t fs_size;
+		char	fs_prev[32];
+	} stat64_t;
+
+	typedef struct _stat64_ext_t {
+		stat64_t	s;
+		uint32_t	crc;
+	} stat64_ext_t;
+
+	static_assert(sizeof(stat64_t) == (48 + 32), "sizeof(stat64_t) is not 48 + 32 bytes");
+
+	// Entries (files and directories) of an archive with their
+	// metadata, kept compact in memory: each entry is a fixed size
+	// record, its path is split in directory (stored once for all
+	// the entries in it) and name (stored in an arena), while fs_prev
+	// and mode/uid/gid are indexes in tables of the distinct values.
+	// Lookups go through an open addressing hash table of the
+	// records. Entries are iterated in insertion order, by value
+	class fileset {
+	public:
+		typedef std::pair<std::string, stat64_ext_t>	value_type;
+
+		class const_iterator {
+			const fileset	*fs_;
+			size_t		i_;
+		public:
+			const_iterator(const fileset* fs, const size_t i) : fs_(fs), i_(i) {
+			}
+
+			value_type operator*() const {
+				value_type	rv;
+				rv.first = fs_->path(i_);
+				fs_->get(i_, rv.second);
+				return rv;
+			}
+
+			const_iterator& operator++() {
+				++i_;
+				return *this;
+			}
+
+			bool operator==(const const_iterator& rhs) const {
+				return i_ == rhs.i_;
+			}
+
+			bool operator!=(const const_iterator& rhs) const {
+				return i_ != rhs.i_;
+			}
+		};
+	private:
+		// 44 bytes, times are stored in 32 bits (till 2106)
+		// and the few which don't fit in wide_times_
+		typedef struct __attribute__((packed, aligned(4))) {
+			int64_t		size;
+			uint32_t	atime,
+					mtime,
+					ctime,
+					crc,
+					dir,
+					// index in attrs_
+					attr,
+					name_off;
+			uint32_t	prev : 24,
+					type : 8;
+			uint16_t	name_len;
+			uint8_t		name_off_hi,
+					wide_times;
+		} entry_t;
+
+		typedef struct {
+			int64_t	atime,
+				mtime,
+				ctime;
+		} times_t;
+
+		// mode, uid and gid
+		typedef std::array<uint32_t, 3>				attr_t;
+
+		std::vector<entry_t>					entries_;
+		std::vector<char>					names_;
+		// directories paths, with the final '/'
+		std::deque<std::string>					dirs_;
+		std::unordered_map<std::string_view, uint32_t>		dirs_idx_;
+		// 0 is the empty name
+		std::deque<std::string>					prevs_;
+		std::unordered_map<std::string_view, uint32_t>		prevs_idx_;
+		std::vector<attr_t>					attrs_;
+		std::map<attr_t, uint32_t>				attrs_idx_;
+		std::unordered_map<uint32_t, times_t>			wide_times_;
+		// entry index + 1, 0 being an empty slot
+		std::vector<uint32_t>					slots_;
+		size_t							paths_sz_;
+
+		static_assert(sizeof(entry_t) == 44, "sizeof(entry_t) is not 44 bytes");
+
+		std::string_view name(const entry_t& e) const {
+			return std::string_view(&names_[((uint64_t)e.name_off_hi << 32) | e.name_off], e.name_len);
+		}
+
+		static void split(const std::string& f, std::string_view& dir, std::string_view& name);
+
+		static uint64_t hash(const uint32_t dir, const std::string_view& name);
+
+		// returns the slot of (dir, name), either
+		// the one holding it or the empty one
+		// where it would be
+		size_t find_slot(const uint32_t dir, const std::string_view& name) const;
+
+		void rehash(const size_t n_slots);
+
+		// returns the index of f, -1 if not present
+		int64_t find_idx(const std::string& f) const;
+
+		// as path_cmp (see utils.h) of the paths of a and b
+		int compare(const entry_t& a, const entry_t& b) const;
+	public:
+		fileset();
+
+		// returns false if f is already present
+		bool insert(const std::string& f, const stat64_ext_t& s);
+
+		bool contains(const std::string& f) const {
+			return find_idx(f) >= 0;
+		}
+
+		// copies the metadata of f into s, returns
+		// false if f is not present
+		bool find(const std::string& f, stat64_ext_t& s) const;
+
+		size_t size(void) const {
+			return entries_.size();
+		}
+
+		bool empty(void) const {
+			return entries_.empty();
+		}
+
+		// path and metadata of the i-th entry
+		std::string path(const size_t i) const;
+
+		void get(const size_t i, stat64_ext_t& s) const;
+
+		// as path_cmp (see utils.h) of the path of
+		// the i-th entry and f
+		int compare(const size_t i, const std::string_view& f) const;
+
+		// reorders the entries by path (see path_cmp in
+		// utils.h), so that they can be merged with the
+		// output of fs_scan; does nothing if they are
+		// sorted already (i.e. loaded from a catalog)
+		void sort(void);
+
+		const_iterator begin(void) const {
+			return const_iterator(this, 0);
+		}
+
+		const_iterator end(void) const {
+			return const_iterator(this, entries_.size());
+		}
+
+		void reserve(const size_t n);
+
+		// releases the memory reserved
+		// and not used
+		void shrink(void);
+
+		void clear(void);
+
+		// sum of the lengths of all the paths
+		size_t paths_size(void) const {
+			return paths_sz_;
+		}
+
+		size_t mem_usage(void) const;
+	};
+}
+
+#endif //_FILESET_H_
+
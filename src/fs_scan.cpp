@@ -0,0 +1,427 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fs_scan.h"
+#include "utils.h"
+#include "log.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <exception>
+
+namespace {
+	using namespace fsarchive;
+
+	// max number of entries which have been scanned
+	// but not yet passed to on_elem; after this
+	// worker threads pause until the calling thread
+	// catches up, capping the memory used
+	const size_t	MAX_PENDING_ENTRIES = 1024*1024;
+
+	struct dir_node;
+
+	typedef std::shared_ptr<dir_node>	pdir_node_t;
+
+	// open directory handle, shared between a directory
+	// and its children still waiting to be scanned, so
+	// that these can be opened/stat'ed relative to it
+	typedef std::shared_ptr<DIR>		pdir_t;
+
+	typedef struct {
+		std::string	path;
+		struct stat64	s;
+		// only set for directories
+		pdir_node_t	dir;
+	} entry_t;
+
+	struct dir_node {
+		enum STATE {
+			S_PENDING = 0,
+			S_CLAIMED = 1,
+			S_DONE = 2
+		};
+
+		const std::string	path;
+		// as lstat'ed by the parent
+		const struct stat64	s;
+		// when parent is set, the directory is
+		// opened as name relative to it, otherwise
+		// through the full path
+		pdir_t			parent;
+		const std::string	name;
+		// exclusions state matching path + '/'
+		const glob_set::state_t	g_state;
+		std::atomic<int>	state;
+		// children sorted by name, stops
+		// at the first error (if any)
+		std::vector<entry_t>	entries;
+		std::exception_ptr	err;
+
+		dir_node(const std::string& p, const struct stat64& st, const pdir_t& pd, const char *n, const glob_set::state_t g_s) : path(p), s(st), parent(pd), name(n), g_state(g_s), state(S_PENDING) {
+		}
+	};
+
+	// we only ask for the fields fsarchive actually stores
+	// (see fsarc_stat64_from_stat64) plus the inode for
+	// the scan index, which lets some filesystems (i.e.
+	// network ones) skip fetching the rest
+	const unsigned int	STATX_FSARC_MASK = STATX_TYPE|STATX_MODE|STATX_UID|STATX_GID|STATX_ATIME|STATX_MTIME|STATX_CTIME|STATX_SIZE|STATX_INO;
+
+	std::atomic<bool>	has_statx(true);
+
+	// lstat64 of name relative to the directory dir_fd
+	int fsarc_lstat_at(const int dir_fd, const char *name, struct stat64& s) {
+		if(has_statx) {
+			struct statx	stx;
+			if(!statx(dir_fd, name, AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT, STATX_FSARC_MASK, &stx)) {
+				memset(&s, 0, sizeof(s));
+				s.st_mode = stx.stx_mode;
+				s.st_ino = stx.stx_ino;
+				s.st_uid = stx.stx_uid;
+				s.st_gid = stx.stx_gid;
+				s.st_size = stx.stx_size;
+				s.st_atim.tv_sec = stx.stx_atime.tv_sec;
+				s.st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+				s.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+				s.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+				s.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+				s.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+				return 0;
+			}
+			if(ENOSYS != errno)
+				return -1;
+			// kernel too old, don't try again
+			has_statx = false;
+		}
+		return fstatat64(dir_fd, name, &s, AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT);
+	}
+
+	class scanner {
+		typedef struct {
+			std::mutex		mtx;
+			std::deque<pdir_node_t>	q;
+		} work_queue_t;
+
+		const glob_set&			excl_;
+		const int64_t			sz_excl_;
+		const scan_index		*idx_in_;
+		scan_index			*idx_out_;
+		const time_t			scan_start_;
+		// queue 0 belongs to the calling thread, the
+		// others to each worker thread
+		std::vector<work_queue_t>	queues_;
+		std::mutex			mtx_;
+		std::condition_variable		cv_work_,
+						cv_done_;
+		std::atomic<size_t>		queued_,
+						pending_,
+						open_dirs_,
+						idx_dirs_,
+						idx_files_;
+		size_t				max_open_dirs_;
+		bool				quit_;
+		std::vector<std::thread>	workers_;
+
+		scanner();
+		scanner(const scanner&);
+		scanner& operator=(const scanner&);
+
+		void push(const size_t q_idx, const pdir_node_t& d) {
+			if(workers_.empty())
+				return;
+			{
+				std::lock_guard<std::mutex>	l(queues_[q_idx].mtx);
+				queues_[q_idx].q.push_back(d);
+			}
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				++queued_;
+			}
+			cv_work_.notify_one();
+		}
+
+		// own queue is used as a stack (depth first
+		// locality), other queues get stolen from the
+		// front, where the largest subtrees sit
+		pdir_node_t pop_or_steal(const size_t q_idx) {
+			for(size_t i = 0; i < queues_.size(); ++i) {
+				const size_t	cur_idx = (q_idx + i) % queues_.size();
+				auto&		wq = queues_[cur_idx];
+				std::lock_guard<std::mutex>	l(wq.mtx);
+				if(wq.q.empty())
+					continue;
+				pdir_node_t	rv;
+				if(cur_idx == q_idx) {
+					rv = wq.q.back();
+					wq.q.pop_back();
+				} else {
+					rv = wq.q.front();
+					wq.q.pop_front();
+				}
+				--queued_;
+				return rv;
+			}
+			return 0;
+		}
+
+		pdir_t open_dir(dir_node& d) {
+			const int	fd = (d.parent) ? openat(dirfd(d.parent.get()), d.name.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC) : open(d.path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			// we don't need the parent anymore
+			d.parent.reset();
+			DIR		*p_dir = (-1 == fd) ? 0 : fdopendir(fd);
+			if(!p_dir) {
+				if(-1 != fd)
+					close(fd);
+				return 0;
+			}
+			++open_dirs_;
+			return pdir_t(p_dir, [this](DIR *d){ closedir(d); --open_dirs_; });
+		}
+
+		// returns false if the element has to be skipped
+		// p_dir is the directory f is in (if any), name is
+		// f relative to p_dir and g_state the exclusions
+		// state matching f
+		bool scan_elem(const std::string& f, const pdir_t& p_dir, const char *name, const glob_set::state_t g_state, entry_t& e) {
+			// first check we are not a match anywhere in our
+			// exclusions
+			if(excl_.is_match(g_state)) {
+				LOG_INFO << "File " << f << " is excluded";
+				return false;
+			}
+			if(fsarc_lstat_at((p_dir) ? dirfd(p_dir.get()) : AT_FDCWD, name, e.s))
+				throw fsarchive::rt_error("Invalid/unable to lstat64 file/directory: ") << f;
+			// exclusions for size
+			if((sz_excl_ > 0) && (e.s.st_size > sz_excl_)) {
+				LOG_INFO << "File " << f << " is size excluded";
+				return false;
+			}
+			if(S_ISDIR(e.s.st_mode)) {
+				// if every child would be excluded
+				// don't even open the directory
+				const glob_set::state_t	g_child = ('/' == *f.rbegin()) ? g_state : excl_.step(g_state, "/", 1);
+				if(excl_.is_match_all_next(g_child)) {
+					LOG_INFO << "Directory " << f << " content is excluded";
+				} else {
+					// don't keep too many directories open
+					// just to speed up opening their children
+					e.dir = std::make_shared<dir_node>(f, e.s, (open_dirs_ < max_open_dirs_) ? p_dir : 0, name, g_child);
+				}
+			} else if(!S_ISREG(e.s.st_mode)) {
+				return false;
+			}
+			e.path = f;
+			return true;
+		}
+
+		void add_entry(dir_node& d, const size_t q_idx, entry_t&& e) {
+			if(e.dir)
+				push(q_idx, e.dir);
+			d.entries.push_back(std::move(e));
+		}
+
+		// the entries haven't changed since idx_in_ has been
+		// built, only the subdirectories need to be lstat'ed
+		void scan_node_index(dir_node& d, const pdir_t& p_dir, const scan_index::dir_t& idx_d, const size_t q_idx) {
+			for(const auto& i_e : idx_d.entries) {
+				entry_t	e;
+				if(S_ISDIR(i_e.m.mode)) {
+					if(!scan_elem(combine_paths(d.path, i_e.name), p_dir, i_e.name.c_str(), excl_.step(d.g_state, i_e.name.c_str(), i_e.name.size()), e))
+						continue;
+				} else {
+					e.path = combine_paths(d.path, i_e.name);
+					scan_index::from_meta(i_e.m, e.s);
+					++idx_files_;
+				}
+				add_entry(d, q_idx, std::move(e));
+			}
+			++idx_dirs_;
+		}
+
+		void scan_node(dir_node& d, const size_t q_idx) {
+			try {
+				const pdir_t	p_dir = open_dir(d);
+				// this is the case when we try to opena  directory we don't have permissions on
+				if(!p_dir)
+					throw fsarchive::rt_error("Invalid/unable to opendir directory: ") << d.path;
+				const scan_index::dir_t	*idx_d = (idx_in_) ? idx_in_->find(d.path, d.s) : 0;
+				if(idx_d) {
+					scan_node_index(d, p_dir, *idx_d, q_idx);
+				} else {
+					struct dirent64	*de = 0;
+					while((de = readdir64(p_dir.get()))) {
+						if(std::string(".") == de->d_name ||
+						   std::string("..") == de->d_name)
+							continue;
+						// we only need to lstat64 what is or could
+						// be a file or directory, some filesystems
+						// don't report d_type at all
+						if(DT_REG != de->d_type && DT_DIR != de->d_type && DT_UNKNOWN != de->d_type)
+							continue;
+						entry_t	e;
+						if(!scan_elem(combine_paths(d.path, de->d_name), p_dir, de->d_name, excl_.step(d.g_state, de->d_name, strlen(de->d_name)), e))
+							continue;
+						add_entry(d, q_idx, std::move(e));
+					}
+				}
+			} catch(...) {
+				d.err = std::current_exception();
+			}
+			// all the paths have d.path as prefix, hence
+			// this is the order of path_cmp (see utils.h)
+			std::sort(d.entries.begin(), d.entries.end(), [](const entry_t& a, const entry_t& b) { return a.path < b.path; });
+			pending_ += d.entries.size();
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				d.state = dir_node::S_DONE;
+			}
+			cv_done_.notify_all();
+		}
+
+		void worker(const size_t q_idx) {
+			while(true) {
+				{
+					std::unique_lock<std::mutex>	l(mtx_);
+					cv_work_.wait(l, [this](){ return quit_ || (queued_ > 0 && pending_ < MAX_PENDING_ENTRIES); });
+					if(quit_)
+						return;
+				}
+				const pdir_node_t	d = pop_or_steal(q_idx);
+				if(!d)
+					continue;
+				// the calling thread may have got there first
+				int	exp_state = dir_node::S_PENDING;
+				if(!d->state.compare_exchange_strong(exp_state, dir_node::S_CLAIMED))
+					continue;
+				scan_node(*d, q_idx);
+			}
+		}
+
+		// if nobody has started reading d yet, do it
+		// ourselves, otherwise wait for it
+		void wait_or_scan(dir_node& d) {
+			int	exp_state = dir_node::S_PENDING;
+			if(d.state.compare_exchange_strong(exp_state, dir_node::S_CLAIMED)) {
+				scan_node(d, 0);
+				return;
+			}
+			std::unique_lock<std::mutex>	l(mtx_);
+			cv_done_.wait(l, [&d](){ return dir_node::S_DONE == d.state; });
+		}
+
+		void emit(dir_node& d, const fs_scan::on_elem_t& on_elem) {
+			wait_or_scan(d);
+			// directories are added to the index after
+			// their subdirectories
+			std::vector<scan_index::entry_t>	idx_entries;
+			if(idx_out_ && !d.err) {
+				const size_t	name_off = ('/' == *d.path.rbegin()) ? d.path.size() : d.path.size() + 1;
+				idx_entries.reserve(d.entries.size());
+				for(const auto& e : d.entries)
+					idx_entries.push_back({ .name = e.path.substr(name_off), .m = scan_index::to_meta(e.s) });
+			}
+			for(auto& e : d.entries) {
+				on_elem(e.path, e.s);
+				// wake up the workers if we're back
+				// under the max pending entries
+				if(MAX_PENDING_ENTRIES == pending_--) {
+					{
+						std::lock_guard<std::mutex>	l(mtx_);
+					}
+					cv_work_.notify_all();
+				}
+				if(e.dir) {
+					emit(*e.dir, on_elem);
+					e.dir.reset();
+				}
+			}
+			if(d.err)
+				std::rethrow_exception(d.err);
+			if(idx_out_)
+				idx_out_->add(d.path, d.s, std::move(idx_entries), scan_start_);
+			std::vector<entry_t>().swap(d.entries);
+		}
+	public:
+		scanner(const glob_set& excl, const int64_t sz_excl, const int n_threads, const scan_index* idx_in, scan_index* idx_out) : excl_(excl), sz_excl_(sz_excl), idx_in_(idx_in), idx_out_(idx_out), scan_start_(time(0)), queues_((n_threads > 1) ? n_threads : 1), queued_(0), pending_(0), open_dirs_(0), idx_dirs_(0), idx_files_(0), max_open_dirs_(0), quit_(false) {
+			// directories waiting to be scanned keep their parent
+			// open, hence try to get as many descriptors as we can
+			// and use up to half of them
+			struct rlimit	rl = {0};
+			if(!getrlimit(RLIMIT_NOFILE, &rl)) {
+				if(rl.rlim_cur < rl.rlim_max) {
+					rl.rlim_cur = rl.rlim_max;
+					setrlimit(RLIMIT_NOFILE, &rl);
+					getrlimit(RLIMIT_NOFILE, &rl);
+				}
+				max_open_dirs_ = rl.rlim_cur/2;
+			}
+			for(size_t i = 1; i < queues_.size(); ++i)
+				workers_.push_back(std::thread(&scanner::worker, this, i));
+			LOG_SPAM << "Scanner started with " << queues_.size() << " thread(s)";
+		}
+
+		void run(const std::string& f, const fs_scan::on_elem_t& on_elem) {
+			entry_t	e;
+			if(!scan_elem(f, 0, f.c_str(), excl_.step(excl_.start(), f.c_str(), f.size()), e))
+				return;
+			on_elem(e.path, e.s);
+			if(e.dir) {
+				push(0, e.dir);
+				emit(*e.dir, on_elem);
+			}
+		}
+
+		void log_stats(void) const {
+			if(idx_in_)
+				LOG_INFO << "Scan index: " << idx_dirs_ << " directories unchanged, " << idx_files_ << " files not lstat'ed";
+		}
+
+		~scanner() {
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				quit_ = true;
+			}
+			cv_work_.notify_all();
+			for(auto& t : workers_)
+				t.join();
+		}
+	};
+}
+
+void fsarchive::fs_scan::scan(char *in_dirs[], const int n, const on_elem_t& on_elem, const glob_set& excl, const int64_t sz_excl, const int n_threads, const scan_index* idx_in, scan_index* idx_out) {
+	std::vector<std::string>	roots(in_dirs, in_dirs + n);
+	std::sort(roots.begin(), roots.end(), [](const std::string& a, const std::string& b) { return path_cmp(a, b) < 0; });
+	scanner	s(excl, sz_excl, n_threads, idx_in, idx_out);
+	for(const auto& r : roots)
+		s.run(r, on_elem);
+	s.log_stats();
+}
@@ -0,0 +1,54 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _FS_SCAN_H_
+#define _FS_SCAN_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <functional>
+#include <string>
+#include "glob_set.h"
+#include "scan_index.h"
+
+namespace fsarchive {
+	namespace fs_scan {
+		typedef std::function<void(const std::string&, const struct stat64&)>	on_elem_t;
+
+		// Scans all the paths in in_dirs and invokes on_elem for every
+		// regular file and directory found (not following symlinks).
+		// Elements matching excl or larger than sz_excl (when > 0)
+		// are skipped; directories whose content would all match
+		// excl are not read at all.
+		// The directories are read and lstat64'ed by n_threads threads
+		// (the calling one included) with work stealing, but on_elem is
+		// always invoked from the calling thread and in depth-first
+		// order, with the entries of each directory (and in_dirs)
+		// sorted by name; i.e. paths are increasing as per path_cmp
+		// (see utils.h) unless in_dirs overlap.
+		// When idx_in is set, the files of the directories unchanged
+		// since it has been built (see scan_index) are taken from it
+		// instead of being lstat'ed; when idx_out is set, all the
+		// directories fully read are added to it.
+		void scan(char *in_dirs[], const int n, const on_elem_t& on_elem, const glob_set& excl, const int64_t sz_excl, const int n_threads, const scan_index* idx_in = 0, scan_index* idx_out = 0);
+	}
+}
+
+#endif //_FS_SCAN_H_
+
@@ -22,7 +22,19 @@
 #include "utils.h"
 #include "log.h"
 #include "zip_fs.h"
+#include "chunk_buffer.h"
 #include "crc32.h"
+#include "fs_scan.h"
+#include "glob_set.h"
+#include "bqueue.h"
+#include "deflate_raw.h"
+#include "patch_chain.h"
+#include "content_cache.h"
+#include "scan_index.h"
+#include "sha256.h"
+#include "dedup_index.h"
+#include "cdc_chunker.h"
+#include "ordered_pool.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -30,9 +42,14 @@
 #include <utime.h>
 #include <string.h>
 #include <memory>
-#include <sstream>
 #include <fstream>
-#include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <cmath>
+#include <fcntl.h>
 
 extern "C" {
 #include "bsdiff.h"
@@ -54,20 +71,30 @@ namespace {
 		}
 	};
 
-	typedef std::vector<std::regex>				regexvec_t;
-
 	typedef std::unique_ptr<zip_fs>				pzip_fs_t;
 
-	typedef std::unique_ptr<const zip_fs>			cpzip_fs_t;
-
-	typedef std::unordered_map<std::string, cpzip_fs_t>	zipfscache_t;
+	typedef std::shared_ptr<const zip_fs>			cpzip_fs_t;
 
 	typedef std::unique_ptr<log::progress>			pprogress_t;
 
-	typedef struct {
-		regexvec_t	r_excl;
-		int64_t		sz_excl;
-	} excl_t;
+	typedef std::pair<std::string, struct stat64>		scan_elem_t;
+
+	// max number of elements scanned but not
+	// yet processed
+	const size_t						SCAN_QUEUE_DEPTH = 4096;
+
+	// restored files are written by blocks of
+	// RESTORE_BLOCK_SIZE bytes, by RESTORE_WRITERS
+	// threads with at most RESTORE_QUEUE_DEPTH
+	// blocks waiting to be written
+	const size_t						RESTORE_BLOCK_SIZE = 1024*1024,
+								RESTORE_WRITERS = 4,
+								RESTORE_QUEUE_DEPTH = 64;
+
+	// thrown to stop the scan thread when
+	// the processing one gave up
+	struct scan_abort {
+	};
 
 	extern "C" {
 		int fsarc_bspatch_read(const struct bspatch_stream* stream, void* buffer, int length) {
@@ -81,20 +108,17 @@ namespace {
 		}
 
 		int fsarc_bsdiff_write(struct bsdiff_stream* stream, const void* buffer, int size) {
-			std::stringstream	*s = (std::stringstream*)stream->opaque;
-			s->write((const char*)buffer, size);
+			chunk_buffer	*b = (chunk_buffer*)stream->opaque;
+			// don't let exceptions go through C code
+			try {
+				b->append(buffer, size);
+			} catch(...) {
+				return -1;
+			}
 			return 0;
 		}
 	}
 
-	// utility to combine paths and cater for final /
-	// both need to be longer than 0
-	std::string combine_paths(const std::string& a, const std::string& b) {
-		if('/' == *(a.rbegin()))
-			return a + b;
-		return (!a.empty()) ? a + '/' + b : b;
-	}
-
 	void init_paths(const std::string& s, mode_t mode = 0755) {
 		if(settings::DRY_RUN)
 			return;
@@ -113,15 +137,6 @@ namespace {
 		}
 	}
 
-	void write_file(const std::string& f, const buffer_t& buf_file) {
-		if(settings::DRY_RUN)
-			return;
-
-		std::ofstream	ostr(f, std::ios_base::binary);
-		if((long int)buf_file.size() != ostr.write((const char*)buf_file.data(), buf_file.size()).tellp())
-			throw fsarchive::rt_error("Can't restore file ") << f << " on the disk";
-	}
-
 	void update_metadata(const std::string& f, const stat64_t& s) {
 		if(settings::DRY_RUN)
 			return;
@@ -145,6 +160,49 @@ namespace {
 			throw fsarchive::rt_error("Can't read binary file ") << f;
 	}
 
+	// samples a few blocks of file f (of size sz) and reports
+	// if its data looks random, i.e. already compressed or
+	// encrypted; the byte entropy of such data is very close
+	// to 8 bits, hence deflate would just waste CPU on it
+	bool is_incompressible(const std::string& f, const off64_t sz) {
+		const off64_t	MIN_SIZE = 64*1024;
+		const size_t	N_SAMPLES = 4,
+				SAMPLE_SIZE = 16*1024;
+		const double	MIN_ENTROPY = 7.9;
+
+		if(sz < MIN_SIZE)
+			return false;
+		const int	fd = open(f.c_str(), O_RDONLY|O_CLOEXEC);
+		if(-1 == fd)
+			return false;
+		uint8_t	buf[SAMPLE_SIZE];
+		double	entropy = 0.0;
+		for(size_t i = 0; i < N_SAMPLES; ++i) {
+			// evenly spaced, first and last blocks included
+			const off64_t	off = (sz - SAMPLE_SIZE)*i/(N_SAMPLES - 1);
+			const ssize_t	rd = pread64(fd, buf, SAMPLE_SIZE, off);
+			if(rd <= 0) {
+				close(fd);
+				return false;
+			}
+			size_t	hist[256] = {0};
+			for(ssize_t j = 0; j < rd; ++j)
+				++hist[buf[j]];
+			double	e = 0.0;
+			for(const auto& h : hist) {
+				if(!h)
+					continue;
+				const double	p = 1.0*h/rd;
+				e -= p*std::log2(p);
+			}
+			entropy += e;
+		}
+		close(fd);
+		entropy /= N_SAMPLES;
+		LOG_SPAM << "File '" << f << "' sampled entropy " << entropy << " bits/byte";
+		return entropy >= MIN_ENTROPY;
+	}
+
 	// check that a path is a valid directory
 	// and reports if contains fsarchive_main or not
 	void check_dir_fsarchives(const std::string& p, std::string& ar_next_path, filelist_t& ar_files) {
@@ -171,7 +229,9 @@ namespace {
 			   std::string("..") == de->d_name)
 				continue;
 			if(DT_REG == de->d_type) {
-				if(strstr(de->d_name, FS_ARCHIVE_BASE) == de->d_name)
+				// skip the sidecar files (i.e. the scan index)
+				const size_t	len = strlen(de->d_name);
+				if((strstr(de->d_name, FS_ARCHIVE_BASE) == de->d_name) && (len > 4) && !strcmp(de->d_name + len - 4, ".zip"))
 					ar_files.insert(de->d_name);
 			}
 		}
@@ -196,61 +256,769 @@ namespace {
 		return {.s = fs_t, .crc = 0};
 	}
 
-	template<typename fn_on_elem>
-	void r_fs_scan(const std::string& f, fn_on_elem&& on_elem, const excl_t& excls) {
-		// first check we are not a match anywhere in our
-		// exclusions regex
-		for(const auto& r : excls.r_excl) {
-			std::smatch	s;
-			if(std::regex_match(f, s, r)) {
-				LOG_INFO << "File " << f << " is excluded";
-				return;
+	// archives opened (read only) by all threads, so that an
+	// archive already open is opened again sharing its entries
+	// (see zip_fs) rather than having them read and kept once
+	// per thread; only weak references are kept, hence the
+	// entries are freed once no thread has the archive open
+	class zipfs_shared {
+		std::mutex							mtx_;
+		std::unordered_map<std::string, std::weak_ptr<const fileset_ext_t>>	map_;
+	public:
+		// archives are opened one at a time, so
+		// that each is only read once
+		cpzip_fs_t open(const std::string& f) {
+			std::lock_guard<std::mutex>		l(mtx_);
+			std::weak_ptr<const fileset_ext_t>&	w = map_[f];
+			if(const zip_fs::pcfileset_t entries = w.lock())
+				return std::make_shared<const zip_fs>(f, entries);
+			const cpzip_fs_t	z(std::make_shared<const zip_fs>(f, true));
+			w = z->get_shared_fileset();
+			return z;
+		}
+	};
+
+	zipfs_shared& get_zipfs_shared(void) {
+		static zipfs_shared	z_shared;
+		return z_shared;
+	}
+
+	// archives opened (read only) to rebuild files, evicted
+	// in LRU order once more than max_count are open or their
+	// estimated memory usage is above max_mem; archives are
+	// shared, hence an evicted one stays open as long as a
+	// reader still uses it.
+	// libzip handles can't be shared among threads, hence
+	// each thread has its own cache, the archives entries
+	// are shared though (see zipfs_shared)
+	class zipfs_cache {
+		typedef struct {
+			std::string	f;
+			cpzip_fs_t	z;
+			size_t		mem;
+		} entry_t;
+
+		typedef std::list<entry_t>	lru_t;
+
+		const size_t						max_count_,
+									max_mem_;
+		// most recently used first
+		lru_t							lru_;
+		std::unordered_map<std::string, lru_t::iterator>	map_;
+		size_t							mem_used_;
+
+		zipfs_cache(const zipfs_cache&);
+		zipfs_cache& operator=(const zipfs_cache&);
+	public:
+		zipfs_cache() : max_count_(settings::ZIP_CACHE_COUNT), max_mem_(settings::ZIP_CACHE_MEM), mem_used_(0) {
+		}
+
+		cpzip_fs_t get(const std::string& f) {
+			const auto	it_c = map_.find(f);
+			if(map_.end() != it_c) {
+				lru_.splice(lru_.begin(), lru_, it_c->second);
+				return it_c->second->z;
 			}
+			const cpzip_fs_t	z(get_zipfs_shared().open(f));
+			lru_.push_front({ .f = f, .z = z, .mem = z->mem_usage() });
+			map_[f] = lru_.begin();
+			mem_used_ += lru_.front().mem;
+			// never evict the archive just opened
+			while(lru_.size() > 1 && (lru_.size() > max_count_ || mem_used_ > max_mem_)) {
+				LOG_SPAM << "Archive " << lru_.back().f << " evicted from cache";
+				mem_used_ -= lru_.back().mem;
+				map_.erase(lru_.back().f);
+				lru_.pop_back();
+			}
+			return z;
 		}
-		struct stat64 s = {0};
-		if(lstat64(f.c_str(), &s))
-			throw fsarchive::rt_error("Invalid/unable to lstat64 file/directory: ") << f;
-		// exclusions for size
-		if((excls.sz_excl > 0) && (s.st_size > excls.sz_excl)) {
-			LOG_INFO << "File " << f << " is size excluded";
-			return;
+	};
+
+	// sequential reader of a version of a file
+	// stored in the archives
+	class version_reader {
+	public:
+		// returns the number of bytes read,
+		// 0 once the file is over
+		virtual size_t read(uint8_t *out, const size_t len) = 0;
+
+		virtual ~version_reader() {
 		}
-		if(!S_ISDIR(s.st_mode)) {
-			if(S_ISREG(s.st_mode)) {
-				on_elem(f, s);
+	};
+
+	typedef std::unique_ptr<version_reader>			pversion_reader_t;
+
+	// data of an archive entry, as is
+	class entry_reader : public version_reader {
+		// keeps the archive open
+		const cpzip_fs_t	z_;
+		const std::string	f_;
+		zip_fs::pzip_file_t	zf_;
+
+		static zip_fs::pzip_file_t open_file(const zip_fs& z, const std::string& f) {
+			stat64_t	z_s = {0};
+			return z.open_file(f, z_s);
+		}
+	public:
+		entry_reader(const cpzip_fs_t& z, const std::string& f) : z_(z), f_(f), zf_(open_file(*z_, f_)) {
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			const zip_int64_t	rd = zip_fread(zf_.get(), out, len);
+			if(rd < 0)
+				throw fsarchive::rt_error("Can't read file ") << f_ << " from archive";
+			return rd;
+		}
+	};
+
+	void read_all(version_reader& r, buffer_t& data) {
+		const size_t	BLOCK_SIZE = 1024*1024;
+		data.clear();
+		while(true) {
+			const size_t	cur = data.size();
+			data.resize(cur + BLOCK_SIZE);
+			const size_t	rd = r.read(data.data() + cur, BLOCK_SIZE);
+			data.resize(cur + rd);
+			if(!rd)
+				break;
+		}
+	}
+
+	// keeps in memory a range of a version, which can
+	// only move forward; used to get the previous data
+	// of the windows of a CMOD file
+	class window_buffer {
+		version_reader&	r_;
+		// the range starts at buf_[start_], what's before
+		// is reclaimed only when buf_ would have to grow
+		buffer_t	buf_;
+		size_t		start_;
+		// offset of buf_[start_] in the version
+		uint64_t	off_;
+		bool		eof_;
+	public:
+		window_buffer(version_reader& r) : r_(r), start_(0), off_(0), eof_(false) {
+		}
+
+		// returns the range [beg, end), shorter (or empty)
+		// when the version is over before end
+		void get(const uint64_t beg, const uint64_t end, const uint8_t*& p, size_t& sz) {
+			if(beg < off_)
+				throw fsarchive::rt_error("Invalid window range ") << beg << " (current offset " << off_ << ")";
+			// drop what isn't needed anymore...
+			const uint64_t	drop = std::min(beg - off_, (uint64_t)(buf_.size() - start_));
+			start_ += drop;
+			off_ += drop;
+			if(start_ == buf_.size()) {
+				buf_.clear();
+				start_ = 0;
 			}
-		} else {
-			on_elem(f, s);
-			std::unique_ptr<DIR, void (*)(DIR*)> p_dir(opendir(f.c_str()), [](DIR *d){ if(d) closedir(d);});
-			// this is the case when we try to opena  directory we don't have permissions on
-			if(!p_dir)
-				throw fsarchive::rt_error("Invalid/unable to opendir directory: ") << f;
-			struct dirent64	*de = 0;
-			while((de = readdir64(p_dir.get()))) {
-				if(std::string(".") == de->d_name ||
-				   std::string("..") == de->d_name)
+			// ... and skip what isn't needed at all
+			uint8_t	skip_buf[64*1024];
+			while(off_ < beg && !eof_) {
+				const size_t	rd = r_.read(skip_buf, std::min((uint64_t)sizeof(skip_buf), beg - off_));
+				off_ += rd;
+				eof_ = !rd;
+			}
+			while(off_ + (buf_.size() - start_) < end && !eof_) {
+				const size_t	n = end - off_ - (buf_.size() - start_);
+				if(start_ && (buf_.size() + n > buf_.capacity())) {
+					// leave room for the next range too, so
+					// that the data kept isn't moved each time
+					buf_.erase(buf_.begin(), buf_.begin() + start_);
+					start_ = 0;
+					buf_.reserve(2*(buf_.size() + n));
+				}
+				const size_t	cur = buf_.size();
+				buf_.resize(cur + n);
+				const size_t	rd = r_.read(buf_.data() + cur, n);
+				buf_.resize(cur + rd);
+				eof_ = !rd;
+			}
+			p = buf_.data() + start_;
+			sz = std::min(end - off_, (uint64_t)(buf_.size() - start_));
+		}
+	};
+
+	// CMOD entries are made of a cmod_header_t followed
+	// by a cmod_window_t for each window of win_sz bytes
+	// of the file, each followed by the bsdiff patch of
+	// such window against the previous version, range
+	// [i*win_sz - win_slack, (i + 1)*win_sz + win_slack);
+	// the patch is deflated on its own (bsdiff patches
+	// are as large as the window) unless comp_sz is the
+	// same as patch_sz, when it's stored as is; if comp_sz
+	// is 0 the window is just the same as the previous
+	// version at the very same offset
+	typedef struct {
+		char		magic[8];
+		uint64_t	win_sz,
+				win_slack;
+	} cmod_header_t;
+
+	typedef struct {
+		uint64_t	new_sz,
+				patch_sz,
+				comp_sz;
+	} cmod_window_t;
+
+	const char						CMOD_MAGIC[8] = { 'F', 'S', 'A', 'C', 'M', 'O', 'D', '1' };
+
+	void cmod_prev_range(const cmod_header_t& h, const uint64_t i, uint64_t& beg, uint64_t& end) {
+		beg = (i*h.win_sz > h.win_slack) ? i*h.win_sz - h.win_slack : 0;
+		end = (i + 1)*h.win_sz + h.win_slack;
+	}
+
+	// applies, one window at a time, the patches
+	// of a CMOD entry to the previous version
+	class cmod_reader : public version_reader {
+		const std::string	f_;
+		pversion_reader_t	prev_,
+					patch_;
+		window_buffer		prev_win_;
+		cmod_header_t		hdr_;
+		uint64_t		cur_win_;
+		buffer_t		out_;
+		size_t			out_off_;
+
+		// returns false if the patch is over
+		// before reading anything
+		bool read_patch(void *out, const size_t len) {
+			size_t	rd = 0;
+			while(rd < len) {
+				const size_t	cur = patch_->read((uint8_t*)out + rd, len - rd);
+				if(!cur)
+					break;
+				rd += cur;
+			}
+			if(rd && rd != len)
+				throw fsarchive::rt_error("Truncated windowed patch for file ") << f_;
+			return rd == len;
+		}
+
+		bool next_window(void) {
+			cmod_window_t	w;
+			if(!read_patch(&w, sizeof(w)))
+				return false;
+			uint64_t	beg = 0,
+					end = 0;
+			cmod_prev_range(hdr_, cur_win_, beg, end);
+			const uint8_t	*p_prev = 0;
+			size_t		prev_sz = 0;
+			prev_win_.get(beg, end, p_prev, prev_sz);
+			out_.resize(w.new_sz);
+			if(!w.comp_sz) {
+				const size_t	win_off = cur_win_*hdr_.win_sz - beg;
+				if(win_off + w.new_sz > prev_sz)
+					throw fsarchive::rt_error("Invalid unchanged window ") << cur_win_ << " for file " << f_;
+				memcpy(out_.data(), p_prev + win_off, w.new_sz);
+			} else {
+				buffer_t	patch(w.patch_sz);
+				if(w.comp_sz == w.patch_sz) {
+					if(!read_patch(patch.data(), patch.size()))
+						throw fsarchive::rt_error("Truncated windowed patch for file ") << f_;
+				} else {
+					buffer_t	comp(w.comp_sz);
+					if(!read_patch(comp.data(), comp.size()))
+						throw fsarchive::rt_error("Truncated windowed patch for file ") << f_;
+					inflate_raw(comp.data(), comp.size(), patch.data(), patch.size());
+				}
+				bspatch_s	bs_s(patch);
+				bspatch_stream_t bsp_s = {
+					.opaque = (void*)&bs_s,
+					.read = fsarc_bspatch_read,
+				};
+				if(bspatch(p_prev, prev_sz, out_.data(), out_.size(), &bsp_s))
+					throw fsarchive::rt_error("Couldn't patch window ") << cur_win_ << " of file " << f_ << " from archive";
+			}
+			out_off_ = 0;
+			++cur_win_;
+			return true;
+		}
+	public:
+		cmod_reader(const std::string& f, pversion_reader_t&& prev, pversion_reader_t&& patch) : f_(f), prev_(std::move(prev)), patch_(std::move(patch)), prev_win_(*prev_), cur_win_(0), out_off_(0) {
+			if(!read_patch(&hdr_, sizeof(hdr_)) || memcmp(hdr_.magic, CMOD_MAGIC, sizeof(CMOD_MAGIC)) || !hdr_.win_sz)
+				throw fsarchive::rt_error("Invalid windowed patch header for file ") << f_;
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			size_t	rv = 0;
+			while(rv < len) {
+				if(out_off_ == out_.size()) {
+					if(!next_window())
+						break;
 					continue;
-				if(DT_REG == de->d_type || DT_DIR == de->d_type)
-					r_fs_scan(combine_paths(f, de->d_name), on_elem, excls);
+				}
+				const size_t	n = std::min(len - rv, out_.size() - out_off_);
+				memcpy(out + rv, out_.data() + out_off_, n);
+				out_off_ += n;
+				rv += n;
 			}
+			return rv;
 		}
+	};
+
+	pversion_reader_t open_version(const cpzip_fs_t& c_fs, const std::string& f, zipfs_cache& zcache);
+
+	// CDC entries are made of a cdc_header_t followed by a
+	// cdc_chunk_t for each chunk (see cdc_chunker) of the file,
+	// in order; the chunks found in the previous version are
+	// taken from there, the others are followed by their data.
+	// Having the hashes of all the chunks, the next version
+	// doesn't need to rebuild this one to be chunked
+	typedef struct {
+		char		magic[8];
+		uint64_t	avg_sz;
+	} cdc_header_t;
+
+	typedef struct {
+		uint8_t		hash[16];
+		// offset in the previous version
+		uint64_t	prev_off;
+		uint32_t	sz,
+				type;
+	} cdc_chunk_t;
+
+	const char						CDC_MAGIC[8] = { 'F', 'S', 'A', 'C', 'D', 'C', '0', '1' };
+
+	const uint32_t						CDC_CHUNK_PREV = 0,
+								CDC_CHUNK_DATA = 1;
+
+	const size_t						CDC_AVG_SZ = 64*1024;
+
+	// reads exactly len bytes, returns false if r is
+	// over before reading anything
+	bool read_exact(version_reader& r, void *out, const size_t len, const std::string& f) {
+		size_t	rd = 0;
+		while(rd < len) {
+			const size_t	cur = r.read((uint8_t*)out + rd, len - rd);
+			if(!cur)
+				break;
+			rd += cur;
+		}
+		if(rd && rd != len)
+			throw fsarchive::rt_error("Truncated data for file ") << f;
+		return rd == len;
 	}
 
-	const zip_fs& get_from_cache(zipfscache_t& zcache, const std::string& f) {
-		const auto it_c = zcache.find(f);
-		if(zcache.end() != it_c)
-			return *it_c->second;
-		const auto rv = zcache.insert(zipfscache_t::value_type(f, std::make_unique<zip_fs>(f, true)));
-		if(!rv.second)
-			throw fsarchive::rt_error("Internal zip_fs cache corrupted, double entry for ") << f;
-		return *rv.first->second;
+	// rebuilds a CDC version, reading the previous one
+	// sequentially while chunks are taken in order; at the
+	// first chunk taken out of order, the previous version
+	// is written (once) to an unlinked temporary file and
+	// read from there at any offset, so that it's never
+	// rebuilt more than twice regardless of the chunks
+	class cdc_reader : public version_reader {
+	public:
+		typedef std::function<pversion_reader_t(void)>	open_prev_t;
+	private:
+		// the same chunks (i.e. zeroes) tend to be repeated,
+		// the last ones taken are kept to not go back
+		const size_t					MAX_RECENT = 16;
+		const std::string				f_;
+		const open_prev_t				open_prev_;
+		pversion_reader_t				prev_,
+								chunks_;
+		uint64_t					prev_off_,
+								tmp_sz_;
+		int						tmp_fd_;
+		std::deque<std::pair<uint64_t, buffer_t>>	recent_;
+		buffer_t					out_;
+		size_t						out_off_;
+
+		void write_tmp(const uint8_t *p, const size_t sz) {
+			size_t	done = 0;
+			while(done < sz) {
+				const ssize_t	w = ::write(tmp_fd_, p + done, sz - done);
+				if(w < 0) {
+					if(EINTR == errno)
+						continue;
+					throw fsarchive::rt_error("Can't write temporary file for file ") << f_ << " : " << strerror(errno);
+				}
+				done += w;
+			}
+		}
+
+		void open_tmp(void) {
+			const char	*tmp_dir = getenv("TMPDIR");
+			std::string	path = combine_paths((tmp_dir && *tmp_dir) ? tmp_dir : "/tmp", "fsarc_cdc_XXXXXX");
+			tmp_fd_ = mkostemp(&path[0], O_CLOEXEC);
+			if(-1 == tmp_fd_)
+				throw fsarchive::rt_error("Can't create temporary file ") << path << " for file " << f_ << " : " << strerror(errno);
+			unlink(path.c_str());
+			LOG_SPAM << "File '" << f_ << "' previous version written to a temporary file, chunks are out of order";
+			// the whole previous version, from the start
+			prev_ = open_prev_();
+			uint8_t	buf[64*1024];
+			while(const size_t rd = prev_->read(buf, sizeof(buf))) {
+				write_tmp(buf, rd);
+				tmp_sz_ += rd;
+			}
+			prev_.reset();
+		}
+
+		void read_tmp(const uint64_t off, const uint32_t sz) {
+			if(off + sz > tmp_sz_)
+				throw fsarchive::rt_error("Invalid chunk offset ") << off << " for file " << f_;
+			out_.resize(sz);
+			size_t	done = 0;
+			while(done < sz) {
+				const ssize_t	rd = pread64(tmp_fd_, out_.data() + done, sz - done, off + done);
+				if(rd <= 0) {
+					if((rd < 0) && (EINTR == errno))
+						continue;
+					throw fsarchive::rt_error("Can't read temporary file for file ") << f_;
+				}
+				done += rd;
+			}
+		}
+
+		void read_prev(const uint64_t off, const uint32_t sz) {
+			for(const auto& r : recent_) {
+				if(r.first == off && r.second.size() == sz) {
+					out_ = r.second;
+					return;
+				}
+			}
+			if((-1 == tmp_fd_) && prev_ && (off < prev_off_))
+				open_tmp();
+			if(-1 != tmp_fd_) {
+				read_tmp(off, sz);
+			} else {
+				if(!prev_)
+					prev_ = open_prev_();
+				uint8_t	skip_buf[64*1024];
+				while(prev_off_ < off) {
+					const size_t	rd = prev_->read(skip_buf, std::min((uint64_t)sizeof(skip_buf), off - prev_off_));
+					if(!rd)
+						throw fsarchive::rt_error("Invalid chunk offset ") << off << " for file " << f_;
+					prev_off_ += rd;
+				}
+				out_.resize(sz);
+				if(!read_exact(*prev_, out_.data(), sz, f_))
+					throw fsarchive::rt_error("Invalid chunk offset ") << off << " for file " << f_;
+				prev_off_ += sz;
+			}
+			recent_.push_back(std::make_pair(off, out_));
+			if(recent_.size() > MAX_RECENT)
+				recent_.pop_front();
+		}
+
+		bool next_chunk(void) {
+			cdc_chunk_t	c;
+			if(!read_exact(*chunks_, &c, sizeof(c), f_))
+				return false;
+			if(CDC_CHUNK_PREV == c.type) {
+				read_prev(c.prev_off, c.sz);
+			} else if(CDC_CHUNK_DATA == c.type) {
+				out_.resize(c.sz);
+				if(!read_exact(*chunks_, out_.data(), out_.size(), f_))
+					throw fsarchive::rt_error("Truncated chunk for file ") << f_;
+			} else {
+				throw fsarchive::rt_error("Invalid chunk type ") << c.type << " for file " << f_;
+			}
+			out_off_ = 0;
+			return true;
+		}
+	public:
+		cdc_reader(const std::string& f, const open_prev_t& open_prev, pversion_reader_t&& chunks) : f_(f), open_prev_(open_prev), chunks_(std::move(chunks)), prev_off_(0), tmp_sz_(0), tmp_fd_(-1), out_off_(0) {
+			cdc_header_t	h;
+			if(!read_exact(*chunks_, &h, sizeof(h), f_) || memcmp(h.magic, CDC_MAGIC, sizeof(CDC_MAGIC)))
+				throw fsarchive::rt_error("Invalid chunks header for file ") << f_;
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			size_t	rv = 0;
+			while(rv < len) {
+				if(out_off_ == out_.size()) {
+					if(!next_chunk())
+						break;
+					continue;
+				}
+				const size_t	n = std::min(len - rv, out_.size() - out_off_);
+				memcpy(out + rv, out_.data() + out_off_, n);
+				out_off_ += n;
+				rv += n;
+			}
+			return rv;
+		}
+
+		~cdc_reader() {
+			if(-1 != tmp_fd_)
+				close(tmp_fd_);
+		}
+	};
+
+	struct cdc_hash_hasher {
+		size_t operator()(const cdc_chunker::hash_t& h) const {
+			size_t	rv;
+			memcpy(&rv, h.data(), sizeof(rv));
+			return rv;
+		}
+	};
+
+	// produces the CDC entry of file f while the archive is
+	// being saved: the hashes of the chunks of the previous
+	// version are taken from its CDC entry or, if it isn't
+	// one, by reading it; then the file is read and chunked,
+	// hence memory usage doesn't depend on its size
+	class cdc_writer : public zip_fs::data_source {
+		typedef std::unordered_map<cdc_chunker::hash_t, std::pair<uint64_t, uint32_t>, cdc_hash_hasher>	sig_t;
+
+		const std::string		f_;
+		const cpzip_fs_t		latest_;
+		zipfs_cache&			zcache_;
+		sig_t				sig_;
+		int				fd_;
+		std::unique_ptr<cdc_chunker>	chunker_;
+		buffer_t			out_;
+		size_t				out_off_;
+		uint64_t			n_chunks_,
+						prev_sz_,
+						data_sz_;
+
+		void add_signature(const uint8_t *p, const size_t sz, uint64_t& off) {
+			sig_.emplace(cdc_chunker::hash(p, sz), std::make_pair(off, (uint32_t)sz));
+			off += sz;
+		}
+
+		void load_signature(void) {
+			// the entry with the data of the previous version
+			cpzip_fs_t	cur = latest_;
+			stat64_ext_t	fs_e;
+			while(true) {
+				if(!cur->get_fileset().find(f_, fs_e))
+					return;
+				if(FS_TYPE_FILE_UNC != fs_e.s.fs_type)
+					break;
+				cur = zcache_.get(combine_paths(settings::AR_DIR, fs_e.s.fs_prev));
+			}
+			uint64_t	off = 0;
+			if(FS_TYPE_FILE_CDC == fs_e.s.fs_type) {
+				entry_reader	r(cur, f_);
+				cdc_header_t	h;
+				if(!read_exact(r, &h, sizeof(h), f_) || memcmp(h.magic, CDC_MAGIC, sizeof(CDC_MAGIC)))
+					throw fsarchive::rt_error("Invalid chunks header for file ") << f_;
+				cdc_chunk_t	c;
+				uint8_t		skip_buf[64*1024];
+				while(read_exact(r, &c, sizeof(c), f_)) {
+					cdc_chunker::hash_t	h;
+					memcpy(h.data(), c.hash, h.size());
+					sig_.emplace(h, std::make_pair(off, c.sz));
+					off += c.sz;
+					for(size_t skip = (CDC_CHUNK_DATA == c.type) ? c.sz : 0; skip; ) {
+						const size_t	rd = r.read(skip_buf, std::min(sizeof(skip_buf), skip));
+						if(!rd)
+							throw fsarchive::rt_error("Truncated chunk for file ") << f_;
+						skip -= rd;
+					}
+				}
+			} else {
+				pversion_reader_t	r = open_version(latest_, f_, zcache_);
+				cdc_chunker		c([&r](uint8_t *out, const size_t len) -> size_t { return r->read(out, len); }, CDC_AVG_SZ);
+				const uint8_t		*p = 0;
+				size_t			sz = 0;
+				while(c.next(p, sz))
+					add_signature(p, sz, off);
+			}
+			LOG_INFO << "File '" << f_ << "' previous version has " << sig_.size() << " distinct chunks (" << off << " bytes)";
+		}
+
+		size_t read_file(uint8_t *out, const size_t len) {
+			while(true) {
+				const ssize_t	rd = ::read(fd_, out, len);
+				if(rd >= 0)
+					return rd;
+				if(EINTR != errno)
+					throw fsarchive::rt_error("Can't read file ") << f_ << " : " << strerror(errno);
+			}
+		}
+
+		bool next_record(void) {
+			if(!chunker_) {
+				load_signature();
+				fd_ = open(f_.c_str(), O_RDONLY|O_CLOEXEC);
+				if(-1 == fd_)
+					throw fsarchive::rt_error("Can't open file ") << f_ << " for reading";
+				posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+				chunker_ = std::make_unique<cdc_chunker>([this](uint8_t *out, const size_t len) -> size_t { return read_file(out, len); }, CDC_AVG_SZ);
+				cdc_header_t	h;
+				memcpy(h.magic, CDC_MAGIC, sizeof(CDC_MAGIC));
+				h.avg_sz = CDC_AVG_SZ;
+				out_.assign((const uint8_t*)&h, (const uint8_t*)&h + sizeof(h));
+				out_off_ = 0;
+				return true;
+			}
+			const uint8_t	*p = 0;
+			size_t		sz = 0;
+			if(!chunker_->next(p, sz)) {
+				LOG_INFO << "File '" << f_ << "' has been chunked (CDC): " << n_chunks_ << " chunks, " << prev_sz_ << " bytes from the previous version, " << data_sz_ << " bytes stored";
+				return false;
+			}
+			const cdc_chunker::hash_t	h = cdc_chunker::hash(p, sz);
+			const auto			it = sig_.find(h);
+			cdc_chunk_t			c;
+			memcpy(c.hash, h.data(), h.size());
+			c.sz = sz;
+			if((sig_.end() != it) && (it->second.second == sz)) {
+				c.prev_off = it->second.first;
+				c.type = CDC_CHUNK_PREV;
+				prev_sz_ += sz;
+			} else {
+				c.prev_off = 0;
+				c.type = CDC_CHUNK_DATA;
+				data_sz_ += sz;
+			}
+			out_.assign((const uint8_t*)&c, (const uint8_t*)&c + sizeof(c));
+			if(CDC_CHUNK_DATA == c.type)
+				out_.insert(out_.end(), p, p + sz);
+			out_off_ = 0;
+			++n_chunks_;
+			return true;
+		}
+	public:
+		cdc_writer(const std::string& f, const cpzip_fs_t& latest, zipfs_cache& zcache) : f_(f), latest_(latest), zcache_(zcache), fd_(-1), out_off_(0), n_chunks_(0), prev_sz_(0), data_sz_(0) {
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			size_t	rv = 0;
+			while(rv < len) {
+				if(out_off_ == out_.size()) {
+					if(!next_record())
+						break;
+					continue;
+				}
+				const size_t	n = std::min(len - rv, out_.size() - out_off_);
+				memcpy(out + rv, out_.data() + out_off_, n);
+				out_off_ += n;
+				rv += n;
+			}
+			return rv;
+		}
+
+		~cdc_writer() {
+			if(-1 != fd_)
+				close(fd_);
+		}
+	};
+
+	typedef std::unique_ptr<patch_chain>			ppatch_chain_t;
+
+	// a chain of MOD versions composed on its base
+	class chain_reader : public version_reader {
+		ppatch_chain_t	chain_;
+		uint64_t	off_;
+	public:
+		chain_reader(ppatch_chain_t&& chain) : chain_(std::move(chain)), off_(0) {
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			const size_t	rd = chain_->read(off_, out, len);
+			off_ += rd;
+			return rd;
+		}
+	};
+
+	// versions already rebuilt, shared by all threads
+	content_cache& get_content_cache(void) {
+		static content_cache	c_cache(settings::CACHE_MEM);
+		return c_cache;
 	}
 
-	void r_rebuild_file(const zip_fs& c_fs, const std::string& f, buffer_t& data, zipfscache_t& zcache) {
+	void log_content_cache_stats(void) {
+		const auto	st = get_content_cache().get_stats();
+		LOG_INFO << "Content cache: " << st.hits << " hit(s), " << st.misses << " miss(es), " << st.evictions << " eviction(s), " << st.mem_used << " bytes used";
+	}
+
+	// data of a version from the content cache
+	class cached_reader : public version_reader {
+		const content_cache::data_t	data_;
+		size_t				off_;
+	public:
+		cached_reader(const content_cache::data_t& data) : data_(data), off_(0) {
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			const size_t	n = std::min(len, data_->size() - off_);
+			memcpy(out, data_->data() + off_, n);
+			off_ += n;
+			return n;
+		}
+	};
+
+	// path of the file a FS_TYPE_FILE_DUP entry
+	// has the same content of
+	std::string dup_target(const cpzip_fs_t& c_fs, const std::string& f) {
+		buffer_t	data;
+		stat64_t	s = {0};
+		if(!c_fs->extract_file(f, data, s))
+			throw fsarchive::rt_error("Can't extract file ") << f << " from archive (file not present)";
+		return std::string(data.begin(), data.end());
+	}
+
+	// walks the MOD (and UNC) versions of f down to the first
+	// one which isn't a bsdiff patch (the base), then composes
+	// all the patches on top of it; rather than rebuilding each
+	// intermediate version, hence memory usage doesn't depend
+	// on the length of the chain
+	ppatch_chain_t open_chain(const cpzip_fs_t& c_fs, const std::string& f, zipfs_cache& zcache) {
+		// archives with the patches, latest first
+		std::vector<std::pair<cpzip_fs_t, uint64_t>>	patches;
+		cpzip_fs_t	cur = c_fs;
+		while(true) {
+			stat64_ext_t	fs_e;
+			if(!cur->get_fileset().find(f, fs_e))
+				throw fsarchive::rt_error("Can't extract file ") << f << " from archive (file not present)";
+			const stat64_t&	s = fs_e.s;
+			if(FS_TYPE_FILE_MOD == s.fs_type)
+				patches.push_back(std::make_pair(cur, s.fs_size));
+			else if(FS_TYPE_FILE_UNC != s.fs_type)
+				break;
+			cur = zcache.get(combine_paths(settings::AR_DIR, s.fs_prev));
+		}
+		buffer_t	base;
+		read_all(*open_version(cur, f, zcache), base);
+		ppatch_chain_t	rv(std::make_unique<patch_chain>(std::move(base)));
+		for(auto it = patches.rbegin(); it != patches.rend(); ++it) {
+			entry_reader	patch(it->first, f);
+			rv->apply([&patch](uint8_t *out, const size_t len) -> size_t { return patch.read(out, len); }, it->second);
+		}
+		LOG_INFO << "File '" << f << "' has been patched (MOD) with a chain of " << patches.size() << " patch(es)";
+		return rv;
+	}
+
+	// MOD versions are expensive to rebuild, hence the ones
+	// opened again, or to be kept anyway, are kept in the
+	// content cache when small enough; the others are read
+	// while composing the chain
+	pversion_reader_t open_mod(const cpzip_fs_t& c_fs, const std::string& f, zipfs_cache& zcache, const bool keep = false) {
+		content_cache&		c_cache = get_content_cache();
+		content_cache::data_t	data = c_cache.get(c_fs->get_name(), f);
+		if(data) {
+			LOG_INFO << "File '" << f << "' has been found in cache (MOD)";
+			return std::make_unique<cached_reader>(data);
+		}
+		ppatch_chain_t	chain = open_chain(c_fs, f, zcache);
+		const bool	again = c_cache.missed(c_fs->get_name(), f);
+		if((!keep && !again) || (chain->size() > (uint64_t)settings::CACHE_MEM))
+			return std::make_unique<chain_reader>(std::move(chain));
+		auto	n_data = std::make_shared<buffer_t>(chain->size());
+		chain->read(0, n_data->data(), n_data->size());
+		c_cache.put(c_fs->get_name(), f, n_data);
+		return std::make_unique<cached_reader>(n_data);
+	}
+
+	void r_rebuild_file(const cpzip_fs_t& c_fs, const std::string& f, buffer_t& data, zipfs_cache& zcache) {
 		using namespace fsarchive;
 
+		// patches are applied streaming, no
+		// need to load them in memory
+		stat64_ext_t	fs_e;
+		if(c_fs->get_fileset().find(f, fs_e) && ((FS_TYPE_FILE_MOD == fs_e.s.fs_type) || (FS_TYPE_FILE_CMOD == fs_e.s.fs_type) || (FS_TYPE_FILE_CDC == fs_e.s.fs_type))) {
+			read_all(*open_version(c_fs, f, zcache), data);
+			return;
+		}
 		stat64_t	s = {0};
-		if(!c_fs.extract_file(f, data, s))
+		if(!c_fs->extract_file(f, data, s))
 			throw fsarchive::rt_error("Can't extract file ") << f << " from archive (file not present)";
 		// then see if the file is full or not or unchanged
 		if(FS_TYPE_FILE_NEW == s.fs_type) {
@@ -260,103 +1028,868 @@ namespace {
 		} else if(FS_TYPE_FILE_UNC == s.fs_type) {
 			// if ile is unchanged, fetch it from the correct
 			// prev entry
-			const zip_fs&	p_fs = get_from_cache(zcache, combine_paths(settings::AR_DIR, s.fs_prev));
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, s.fs_prev));
 			r_rebuild_file(p_fs, f, data, zcache);
 			LOG_INFO << "File '" << f << "' has been forwarded as is (UNC) from " << s.fs_prev;
 			return;
-		} else if(FS_TYPE_FILE_MOD == s.fs_type) {
-			// if the file is modified, we first need to
-			// - get the original
-			buffer_t	p_data;
-			const zip_fs&	p_fs = get_from_cache(zcache, combine_paths(settings::AR_DIR, s.fs_prev));
-			r_rebuild_file(p_fs, f, p_data, zcache);
-			// - apply current patch
-			// s will contain the full size of the patched file
-			buffer_t	n_data(s.fs_size);
-			bspatch_s	bs_s(data);
-			bspatch_stream_t bsp_s = {
-				.opaque = (void*)&bs_s,
-				.read = fsarc_bspatch_read,
-			};
-			// finally patch it
-			if(bspatch(p_data.data(), p_data.size(), n_data.data(), n_data.size(), &bsp_s))
-				throw fsarchive::rt_error("Couldn't patch file ") << f << " from archive";
-			data.swap(n_data);
-			LOG_INFO << "File '" << f << "' has been patched (MOD) from " << s.fs_prev;
+		} else if(FS_TYPE_FILE_DUP == s.fs_type) {
+			// the data is the path of the file
+			// with the same content
+			const std::string	target(data.begin(), data.end());
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, s.fs_prev));
+			r_rebuild_file(p_fs, target, data, zcache);
+			LOG_INFO << "File '" << f << "' has been rebuilt as duplicate (DUP) of '" << target << "' from " << s.fs_prev;
 			return;
 		}
 		throw fsarchive::rt_error("Invalid metadata fs_type ") << s.fs_type;
 	}
 
-	bool r_crc_file(const zip_fs& c_fs, const std::string& f, zipfscache_t& zcache, uint32_t& crc) {
-		const auto& files = c_fs.get_fileset();
-		const auto it_f = files.find(f);
-		if(files.end() == it_f)
+	bool r_crc_file(const cpzip_fs_t& c_fs, const std::string& f, zipfs_cache& zcache, uint32_t& crc) {
+		stat64_ext_t	fs_e;
+		if(!c_fs->get_fileset().find(f, fs_e))
 			return false;
-		if(it_f->second.s.fs_type == FS_TYPE_FILE_NEW) {
-			crc = it_f->second.crc;
+		if(fs_e.s.fs_type == FS_TYPE_FILE_NEW) {
+			crc = fs_e.crc;
 			return true;
-		} else if(it_f->second.s.fs_type == FS_TYPE_FILE_UNC) {
-			const zip_fs&	p_fs = get_from_cache(zcache, combine_paths(settings::AR_DIR, it_f->second.s.fs_prev));
+		} else if(fs_e.s.fs_type == FS_TYPE_FILE_UNC) {
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, fs_e.s.fs_prev));
 			return r_crc_file(p_fs, f, zcache, crc);
+		} else if(fs_e.s.fs_type == FS_TYPE_FILE_DUP) {
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, fs_e.s.fs_prev));
+			return r_crc_file(p_fs, dup_target(c_fs, f), zcache, crc);
+		} else if((fs_e.s.fs_type == FS_TYPE_FILE_MOD) || (fs_e.s.fs_type == FS_TYPE_FILE_CMOD) || (fs_e.s.fs_type == FS_TYPE_FILE_CDC)) {
+			// patched versions have no CRC32 stored, these
+			// have to be rebuilt (once)
+			content_cache&	c_cache = get_content_cache();
+			if(c_cache.get_crc(c_fs->get_name(), f, crc))
+				return true;
+			pversion_reader_t	r = (FS_TYPE_FILE_MOD == fs_e.s.fs_type) ? open_mod(c_fs, f, zcache, true) : open_version(c_fs, f, zcache);
+			buffer_t		buf(1024*1024);
+			crc = 0;
+			while(const size_t rd = r->read(buf.data(), buf.size()))
+				crc = crc32::compute(buf.data(), rd, crc);
+			c_cache.put_crc(c_fs->get_name(), f, crc);
+			return true;
 		}
 		return false;
 	}
 
-	regexvec_t init_regex(const fsarchive::settings::excllist_t& f, const bool nocase = false) {
-		// used to sanitize input
-		const static std::regex	special_chars { R"([-[\]{}()*+?.,\^$|#\s])" };
-		regexvec_t	rv;
-		for(const auto& r : f) {
-			std::stringstream	cur_regex;
-			// find all occurences of '*'
-			const char	*p_cur = r.c_str(),
-					*p_next_c = 0;
-			while((p_next_c = strpbrk(p_cur, "*?"))) {
-				cur_regex << std::regex_replace(std::string(p_cur, p_next_c), special_chars, R"(\$&)");
-				switch(*p_next_c) {
-					case '*':
-						cur_regex << ".*";
-						break;
-					case '?':
-						cur_regex << "[^/]+";
+	// opens file f for sequential reading
+	pversion_reader_t open_version(const cpzip_fs_t& c_fs, const std::string& f, zipfs_cache& zcache) {
+		stat64_ext_t	fs_e;
+		if(!c_fs->get_fileset().find(f, fs_e))
+			throw fsarchive::rt_error("Can't extract file ") << f << " from archive (file not present)";
+		const stat64_t&	s = fs_e.s;
+		if(FS_TYPE_FILE_NEW == s.fs_type) {
+			LOG_INFO << "File '" << f << "' is being rebuilt as is (NEW)";
+			return std::make_unique<entry_reader>(c_fs, f);
+		} else if(FS_TYPE_FILE_UNC == s.fs_type) {
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, s.fs_prev));
+			LOG_INFO << "File '" << f << "' is being forwarded as is (UNC) from " << s.fs_prev;
+			return open_version(p_fs, f, zcache);
+		} else if(FS_TYPE_FILE_DUP == s.fs_type) {
+			const std::string	target = dup_target(c_fs, f);
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, s.fs_prev));
+			LOG_INFO << "File '" << f << "' is being rebuilt as duplicate (DUP) of '" << target << "' from " << s.fs_prev;
+			return open_version(p_fs, target, zcache);
+		} else if(FS_TYPE_FILE_MOD == s.fs_type) {
+			return open_mod(c_fs, f, zcache);
+		} else if(FS_TYPE_FILE_CDC == s.fs_type) {
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, s.fs_prev));
+			LOG_INFO << "File '" << f << "' is being rebuilt by chunks (CDC) from " << s.fs_prev;
+			return std::make_unique<cdc_reader>(f, [p_fs, f, &zcache]() -> pversion_reader_t { return open_version(p_fs, f, zcache); }, std::make_unique<entry_reader>(c_fs, f));
+		} else if(FS_TYPE_FILE_CMOD == s.fs_type) {
+			const cpzip_fs_t	p_fs = zcache.get(combine_paths(settings::AR_DIR, s.fs_prev));
+			pversion_reader_t	prev = open_version(p_fs, f, zcache);
+			LOG_INFO << "File '" << f << "' is being patched by windows (CMOD) from " << s.fs_prev;
+			return std::make_unique<cmod_reader>(f, std::move(prev), std::make_unique<entry_reader>(c_fs, f));
+		}
+		throw fsarchive::rt_error("Invalid metadata fs_type ") << s.fs_type;
+	}
+
+	// the rebuilt previous version, the new one, the
+	// 32 bits suffix array and the bsdiff buffers
+	size_t bsdiff_expected_mem(const uint64_t prev_sz, const uint64_t sz) {
+		return 6*prev_sz + 4*sz;
+	}
+
+	// produces the CMOD entry of file f while the archive is
+	// being saved: the file and its previous version are read
+	// one window at a time and the windows diffed by n_threads
+	// threads, no more than max_mem (as per bsdiff_expected_mem)
+	// or 2*n_threads being in flight; the windows are emitted
+	// in order, hence memory usage doesn't depend on the size
+	// of the file.
+	// The patches are deflated with comp_level (1 to 9, 0 for
+	// default) or stored as is if it's < 0
+	class cmod_writer : public zip_fs::data_source {
+		typedef struct {
+			uint64_t		idx;
+			// inputs, released once diffed
+			buffer_t		prev,
+						data;
+			// cmod_window_t and the patch
+			chunk_buffer		out;
+		} job_t;
+
+		const std::string			f_;
+		const cpzip_fs_t			latest_;
+		zipfs_cache&				zcache_;
+		const int				comp_level_;
+		const size_t				n_threads_,
+							max_jobs_;
+		cmod_header_t				hdr_;
+		pversion_reader_t			prev_;
+		std::unique_ptr<window_buffer>		prev_win_;
+		int					fd_;
+		uint64_t				next_win_,
+							n_diffed_,
+							n_same_;
+		bool					eof_,
+							started_;
+		// windows in order
+		std::unique_ptr<ordered_pool<job_t>>	pool_;
+		chunk_buffer::chunks_t			out_;
+		size_t					out_chunk_,
+							out_off_;
+
+		void diff_window(job_t& j) {
+			chunk_buffer	patch;
+			bsdiff_stream_t	bsd_s = {
+				.opaque = (void*)&patch,
+				.malloc = malloc,
+				.free = free,
+				.write = fsarc_bsdiff_write,
+			};
+			if(bsdiff(j.prev.data(), j.prev.size(), j.data.data(), j.data.size(), &bsd_s))
+				throw fsarchive::rt_error("Couldn't diff window ") << j.idx << " of file " << f_ << " from archive";
+			cmod_window_t	w = { .new_sz = j.data.size(), .patch_sz = patch.size(), .comp_sz = patch.size() };
+			buffer_t().swap(j.prev);
+			buffer_t().swap(j.data);
+			// deflate the chunks as a single stream,
+			// each one with the previous as dictionary
+			chunk_buffer	comp_patch;
+			if(comp_level_ >= 0) {
+				buffer_t	comp;
+				const auto&	chunks = patch.chunks();
+				for(size_t c = 0; c < chunks.size(); ++c) {
+					const size_t	dict_sz = (c) ? std::min(chunks[c - 1].size, (size_t)32*1024) : 0;
+					const uint8_t	*dict = (c) ? (const uint8_t*)chunks[c - 1].data + chunks[c - 1].size - dict_sz : 0;
+					deflate_raw(dict, dict_sz, (const uint8_t*)chunks[c].data, chunks[c].size, c + 1 == chunks.size(), comp_level_, comp);
+					comp_patch.append(comp.data(), comp.size());
+				}
+			}
+			// comp_sz == patch_sz means stored as is
+			const chunk_buffer&	data = ((comp_level_ >= 0) && (comp_patch.size() < patch.size())) ? comp_patch : patch;
+			w.comp_sz = data.size();
+			j.out.append(&w, sizeof(w));
+			for(const auto& c : data.chunks())
+				j.out.append(c.data, c.size);
+		}
+
+		size_t read_file(uint8_t *out, const size_t len) {
+			size_t	rv = 0;
+			while(rv < len) {
+				const ssize_t	rd = ::read(fd_, out + rv, len - rv);
+				if(rd < 0) {
+					if(EINTR == errno)
+						continue;
+					throw fsarchive::rt_error("Can't read file ") << f_ << " : " << strerror(errno);
+				}
+				if(!rd)
+					break;
+				rv += rd;
+			}
+			return rv;
+		}
+
+		// reads the next window and queues it, the ones
+		// the same as the previous version are not diffed
+		void add_window(void) {
+			std::unique_ptr<job_t>	j(std::make_unique<job_t>());
+			j->idx = next_win_++;
+			j->data.resize(hdr_.win_sz);
+			const size_t	n_rd = read_file(j->data.data(), j->data.size());
+			if(n_rd < hdr_.win_sz)
+				eof_ = true;
+			if(!n_rd)
+				return;
+			j->data.resize(n_rd);
+			uint64_t	beg = 0,
+					end = 0;
+			cmod_prev_range(hdr_, j->idx, beg, end);
+			const uint8_t	*p_prev = 0;
+			size_t		prev_sz = 0;
+			prev_win_->get(beg, end, p_prev, prev_sz);
+			// unchanged windows are common with large
+			// files (i.e. databases), don't diff them
+			const size_t	win_off = j->idx*hdr_.win_sz - beg;
+			if((win_off + n_rd <= prev_sz) && !memcmp(p_prev + win_off, j->data.data(), n_rd)) {
+				const cmod_window_t	w = { .new_sz = n_rd, .patch_sz = 0, .comp_sz = 0 };
+				j->out.append(&w, sizeof(w));
+				buffer_t().swap(j->data);
+				++n_same_;
+			} else {
+				j->prev.assign(p_prev, p_prev + prev_sz);
+				++n_diffed_;
+			}
+			pool_->add(std::move(j));
+		}
+
+		void start(void) {
+			prev_ = open_version(latest_, f_, zcache_);
+			prev_win_ = std::make_unique<window_buffer>(*prev_);
+			fd_ = open(f_.c_str(), O_RDONLY|O_CLOEXEC);
+			if(-1 == fd_)
+				throw fsarchive::rt_error("Can't open file ") << f_ << " for reading";
+			posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+			// unchanged windows have no data
+			pool_ = std::make_unique<ordered_pool<job_t>>(n_threads_, 0, [this](job_t& j, no_worker_state_t&) {
+				if(!j.data.empty())
+					diff_window(j);
+			});
+			chunk_buffer	h;
+			h.append(&hdr_, sizeof(hdr_));
+			out_ = h.release();
+			started_ = true;
+		}
+
+		void stop(void) {
+			pool_.reset();
+		}
+
+		void free_out(void) {
+			for(auto& c : out_)
+				free(c.data);
+			out_.clear();
+			out_chunk_ = out_off_ = 0;
+		}
+
+		bool next_record(void) {
+			free_out();
+			if(!started_) {
+				start();
+				return true;
+			}
+			// all the windows have been handed back
+			if(!pool_)
+				return false;
+			while(!eof_ && (pool_->size() < max_jobs_))
+				add_window();
+			if(!pool_->size()) {
+				stop();
+				LOG_INFO << "File '" << f_ << "' has been diffed by windows (CMOD): " << n_diffed_ << " window(s) diffed, " << n_same_ << " unchanged";
+				return false;
+			}
+			std::unique_ptr<job_t>	j(pool_->pop());
+			out_ = j->out.release();
+			return true;
+		}
+
+		cmod_writer();
+		cmod_writer(const cmod_writer&);
+		cmod_writer& operator=(const cmod_writer&);
+	public:
+		cmod_writer(const std::string& f, const cpzip_fs_t& latest, zipfs_cache& zcache, const uint64_t win_sz, const int comp_level, const size_t n_threads, const size_t max_mem) : f_(f), latest_(latest), zcache_(zcache), comp_level_(std::min(comp_level, 9)), n_threads_(n_threads), max_jobs_(std::max((size_t)1, std::min(2*n_threads, max_mem/bsdiff_expected_mem(win_sz + win_sz/2, win_sz)))), fd_(-1), next_win_(0), n_diffed_(0), n_same_(0), eof_(false), started_(false), out_chunk_(0), out_off_(0) {
+			memcpy(hdr_.magic, CMOD_MAGIC, sizeof(CMOD_MAGIC));
+			hdr_.win_sz = win_sz;
+			hdr_.win_slack = win_sz/4;
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			size_t	rv = 0;
+			while(rv < len) {
+				if(out_chunk_ == out_.size()) {
+					if(!next_record())
 						break;
-					default:
-						throw fsarchive::rt_error("Invalid break RegEx sequence: ") << *p_next_c;
+					continue;
+				}
+				const auto&	c = out_[out_chunk_];
+				const size_t	n = std::min(len - rv, c.size - out_off_);
+				memcpy(out + rv, c.data + out_off_, n);
+				out_off_ += n;
+				rv += n;
+				if(out_off_ == c.size) {
+					++out_chunk_;
+					out_off_ = 0;
 				}
-				p_cur = p_next_c+1;
 			}
-			cur_regex << std::regex_replace(std::string(p_cur), special_chars, R"(\$&)");
-			//
-			const auto regex_opt = (nocase) ? std::regex_constants::ECMAScript|std::regex_constants::icase : std::regex_constants::ECMAScript;
-			rv.push_back(std::regex(cur_regex.str(), regex_opt));
+			return rv;
 		}
 
-		return rv;
+		~cmod_writer() {
+			stop();
+			free_out();
+			if(-1 != fd_)
+				close(fd_);
+		}
+	};
+
+	// runs the bsdiff of modified files on multiple threads; each
+	// job is admitted (in order) only if its expected memory usage
+	// fits in max_mem together with the ones not handed back yet,
+	// a job larger than max_mem runs alone (see ordered_pool).
+	// Each patch is handed back to the data_source returned by add,
+	// which is read while the archive is being saved, hence the
+	// patches waiting to be written are bounded by max_mem too.
+	// Files to be diffed by windows (CMOD) don't go through it,
+	// see cmod_writer
+	class bsdiff_sched {
+		typedef struct {
+			std::string	f;
+			chunk_buffer	diff;
+		} job_t;
+
+		// libzip handles can't be shared
+		// among threads
+		typedef ordered_pool<job_t, zipfs_cache>	pool_t;
+
+		// patch of a file, taken from the
+		// pool once libzip reads it
+		class patch_source : public zip_fs::data_source {
+			pool_t&			pool_;
+			const job_t		*j_;
+			bool			taken_;
+			chunk_buffer::chunks_t	out_;
+			size_t			out_chunk_,
+						out_off_;
+
+			patch_source();
+			patch_source(const patch_source&);
+			patch_source& operator=(const patch_source&);
+		public:
+			patch_source(pool_t& pool, const job_t* j) : pool_(pool), j_(j), taken_(false), out_chunk_(0), out_off_(0) {
+			}
+
+			size_t read(uint8_t *out, const size_t len) override {
+				if(!taken_) {
+					taken_ = true;
+					out_ = pool_.take(j_)->diff.release();
+				}
+				size_t	rv = 0;
+				while((rv < len) && (out_chunk_ < out_.size())) {
+					const auto&	c = out_[out_chunk_];
+					const size_t	n = std::min(len - rv, c.size - out_off_);
+					memcpy(out + rv, c.data + out_off_, n);
+					out_off_ += n;
+					rv += n;
+					if(out_off_ == c.size) {
+						++out_chunk_;
+						out_off_ = 0;
+					}
+				}
+				return rv;
+			}
+
+			~patch_source() {
+				// i.e. the entry couldn't be added
+				if(!taken_)
+					pool_.cancel(j_);
+				for(auto& c : out_)
+					free(c.data);
+			}
+		};
+
+		const std::string				latest_path_;
+		pool_t						pool_;
+
+		void run_job(job_t& j, zipfs_cache& zcache) {
+			buffer_t	p_data;
+			r_rebuild_file(zcache.get(latest_path_), j.f, p_data, zcache);
+			buffer_t	n_data;
+			load_file(j.f, n_data);
+			bsdiff_stream_t	bsd_s = {
+				.opaque = (void*)&j.diff,
+				.malloc = malloc,
+				.free = free,
+				.write = fsarc_bsdiff_write,
+			};
+			if(bsdiff(p_data.data(), p_data.size(), n_data.data(), n_data.size(), &bsd_s))
+				throw fsarchive::rt_error("Couldn't diff file ") << j.f << " from archive";
+		}
+
+		bsdiff_sched();
+		bsdiff_sched(const bsdiff_sched&);
+		bsdiff_sched& operator=(const bsdiff_sched&);
+	public:
+		bsdiff_sched(const size_t n_threads, const size_t max_mem, const std::string& latest_path) : latest_path_(latest_path), pool_(n_threads, max_mem, [this](job_t& j, zipfs_cache& zcache) { run_job(j, zcache); }) {
+		}
+
+		// queues the diff of file f against its previous version
+		// (of size prev_sz), the patch is read from the returned
+		// data_source; this has to outlive it
+		zip_fs::pdata_source_t add(const std::string& f, const stat64_t& s, const off64_t prev_sz) {
+			std::unique_ptr<job_t>	j(std::make_unique<job_t>());
+			j->f = f;
+			return std::make_unique<patch_source>(pool_, pool_.add(std::move(j), bsdiff_expected_mem(prev_sz, s.fs_size)));
+		}
+	};
+
+	// checks the CRC32 of the files unchanged by size and mtime
+	// (see --crc32-check) on multiple threads: each job reads the
+	// file on disk and looks up (or rebuilds) the CRC32 of its
+	// version in the latest archive.
+	// The results are handed back in the same order the files
+	// have been added, to the thread invoking add and finish, and
+	// no more than max_todo files are in flight at any given time
+	class crc_sched {
+	public:
+		typedef struct {
+			std::string		f;
+			stat64_t		s;
+			// entry in the latest archive
+			stat64_ext_t		latest;
+			uint32_t		cur_crc,
+						arc_crc;
+			bool			arc_found;
+		} result_t;
+
+		typedef std::function<void(result_t&)>	on_done_t;
+	private:
+		const size_t					max_todo_;
+		const std::string				latest_path_;
+		// libzip handles can't be shared
+		// among threads
+		ordered_pool<result_t, zipfs_cache>		pool_;
+
+		void run_job(result_t& r, zipfs_cache& zcache) {
+			r.cur_crc = crc32::compute(r.f.c_str());
+			r.arc_found = r_crc_file(zcache.get(latest_path_), r.f, zcache, r.arc_crc);
+		}
+
+		crc_sched();
+		crc_sched(const crc_sched&);
+		crc_sched& operator=(const crc_sched&);
+	public:
+		crc_sched(const size_t n_threads, const std::string& latest_path) : max_todo_(4*n_threads), latest_path_(latest_path), pool_(n_threads, 0, [this](result_t& r, zipfs_cache& zcache) { run_job(r, zcache); }) {
+		}
+
+		// queues the CRC32 check of file f, whose entry in the
+		// latest archive is latest, in the meantime hands back
+		// the checks already done
+		void add(const std::string& f, const stat64_t& s, const stat64_ext_t& latest, const on_done_t& on_done) {
+			pool_.drain(on_done, max_todo_ - 1);
+			std::unique_ptr<result_t>	r(std::make_unique<result_t>());
+			r->f = f;
+			r->s = s;
+			r->latest = latest;
+			r->cur_crc = r->arc_crc = 0;
+			r->arc_found = false;
+			pool_.add(std::move(r));
+		}
+
+		// waits for all the queued checks
+		void finish(const on_done_t& on_done) {
+			pool_.drain(on_done, 0);
+		}
+	};
+
+	// file being restored, closed once all
+	// its blocks have been written
+	class out_file {
+		const std::string	path_;
+		int			fd_;
+
+		out_file();
+		out_file(const out_file&);
+		out_file& operator=(const out_file&);
+	public:
+		out_file(const std::string& path) : path_(path), fd_(-1) {
+			if(settings::DRY_RUN)
+				return;
+			fd_ = open(path_.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+			if(-1 == fd_)
+				throw fsarchive::rt_error("Can't restore file ") << path_ << " on the disk";
+		}
+
+		void write(const uint64_t off, const buffer_t& data) {
+			if(-1 == fd_)
+				return;
+			size_t	done = 0;
+			while(done < data.size()) {
+				const ssize_t	w = pwrite64(fd_, data.data() + done, data.size() - done, off + done);
+				if(w < 0) {
+					if(EINTR == errno)
+						continue;
+					throw fsarchive::rt_error("Can't restore file ") << path_ << " on the disk: " << strerror(errno);
+				}
+				done += w;
+			}
+		}
+
+		~out_file() {
+			if(-1 != fd_)
+				close(fd_);
+		}
+	};
+
+	// restores the files of an archive on multiple threads:
+	// each reader has its own zip_fs handles (libzip ones
+	// can't be shared among threads) and rebuilds whole files,
+	// whose blocks are then written by a pool of writers so
+	// that the disk always has some I/O queued
+	class restore_sched {
+		typedef std::pair<std::string, std::string>	file_t;
+
+		typedef struct {
+			std::shared_ptr<out_file>	f;
+			uint64_t			off;
+			buffer_t			data;
+		} block_t;
+
+		bqueue<file_t>			files_;
+		bqueue<block_t>			blocks_;
+		std::mutex			mtx_;
+		std::exception_ptr		err_;
+		std::vector<std::thread>	readers_,
+						writers_;
+
+		void set_error(std::exception_ptr err) {
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				if(!err_)
+					err_ = err;
+			}
+			files_.close();
+			blocks_.close();
+		}
+
+		void reader(void) {
+			try {
+				const cpzip_fs_t	z(get_zipfs_shared().open(settings::RE_FILE));
+				zipfs_cache		zcache;
+				file_t		f;
+				while(files_.pop(f)) {
+					pversion_reader_t		r = open_version(z, f.first, zcache);
+					std::shared_ptr<out_file>	o_f = std::make_shared<out_file>(f.second);
+					for(uint64_t off = 0; ; ) {
+						block_t	b = { .f = o_f, .off = off, .data = buffer_t(RESTORE_BLOCK_SIZE) };
+						const size_t	rd = r->read(b.data.data(), b.data.size());
+						if(!rd)
+							break;
+						b.data.resize(rd);
+						off += rd;
+						if(!blocks_.push(std::move(b)))
+							return;
+					}
+				}
+			} catch(...) {
+				set_error(std::current_exception());
+			}
+		}
+
+		void writer(void) {
+			try {
+				block_t	b;
+				while(blocks_.pop(b)) {
+					b.f->write(b.off, b.data);
+					// let the file be closed as soon
+					// as its last block is written
+					b = block_t();
+				}
+			} catch(...) {
+				set_error(std::current_exception());
+			}
+		}
+
+		void join(void) {
+			files_.close();
+			for(auto& t : readers_)
+				t.join();
+			readers_.clear();
+			blocks_.close();
+			for(auto& t : writers_)
+				t.join();
+			writers_.clear();
+		}
+
+		restore_sched();
+		restore_sched(const restore_sched&);
+		restore_sched& operator=(const restore_sched&);
+	public:
+		restore_sched(const size_t n_readers) : files_(n_readers), blocks_(RESTORE_QUEUE_DEPTH) {
+			for(size_t i = 0; i < n_readers; ++i)
+				readers_.push_back(std::thread(&restore_sched::reader, this));
+			for(size_t i = 0; i < RESTORE_WRITERS; ++i)
+				writers_.push_back(std::thread(&restore_sched::writer, this));
+		}
+
+		// queues archive file f to be restored as out_f; returns
+		// false if the restore has failed meanwhile
+		bool add(const std::string& f, const std::string& out_f) {
+			return files_.push(file_t(f, out_f));
+		}
+
+		// waits for all the files to be written, throws
+		// the first error found
+		void finish(void) {
+			join();
+			if(err_)
+				std::rethrow_exception(err_);
+		}
+
+		~restore_sched() {
+			// in case finish hasn't been invoked
+			// let the readers give up
+			blocks_.close();
+			join();
+		}
+	};
+
+	std::string dedup_index_path(void) {
+		return combine_paths(settings::AR_DIR, std::string(FS_ARCHIVE_BASE) + "dedup.idx");
+	}
+
+	// hashes (SHA-256) the files to be stored on multiple threads
+	// and, on the thread invoking add and finish, adds them to the
+	// archive either as duplicates (DUP) of the entries with the
+	// same content in the dedup index or as new ones, which are
+	// then added to the index
+	class dedup_sched {
+		typedef struct {
+			std::string		f;
+			stat64_t		s;
+			int			comp_level;
+			// for logging
+			const char		*kind;
+			sha256::digest_t	digest;
+		} job_t;
+
+		zip_fs					*z_;
+		const std::string			ar_name_;
+		const size_t				max_todo_;
+		dedup_index				idx_;
+		// to check the index entries are
+		// still in their archives
+		zipfs_cache				zcache_;
+		ordered_pool<job_t>			pool_;
+
+		bool is_valid(const dedup_index::entry_t& e) {
+			// added to the archive being written
+			if(e.archive == ar_name_)
+				return true;
+			try {
+				stat64_ext_t	fs_e;
+				return zcache_.get(combine_paths(settings::AR_DIR, e.archive))->get_fileset().find(e.path, fs_e) &&
+				       (FS_TYPE_FILE_NEW == fs_e.s.fs_type) && (fs_e.s.fs_size == e.size);
+			} catch(const std::exception& ex) {
+				LOG_WARNING << "Can't check file '" << e.path << "' in archive " << e.archive << ": " << ex.what();
+			}
+			return false;
+		}
+
+		void store_new(const std::string& f, const stat64_t& s, const int comp_level, const char* kind) {
+			if(z_)
+				z_->add_file_new(f, s, comp_level);
+			LOG_INFO << "File '" << f << "' has been added as new (" << kind << ")";
+		}
+
+		void store(const job_t& j) {
+			const dedup_index::entry_t	*e = idx_.find(j.digest, j.s.fs_size);
+			if(e && is_valid(*e)) {
+				if(z_)
+					z_->add_file_dup(j.f, j.s, e->archive.c_str(), e->path);
+				LOG_INFO << "File '" << j.f << "' has been added as duplicate (DUP) of '" << e->path << "' -> " << e->archive;
+				return;
+			}
+			store_new(j.f, j.s, j.comp_level, j.kind);
+			idx_.add(j.digest, j.s.fs_size, ar_name_, j.f);
+		}
+
+		dedup_sched();
+		dedup_sched(const dedup_sched&);
+		dedup_sched& operator=(const dedup_sched&);
+	public:
+		// when ar_files is null (new base archive) the
+		// index is started from scratch, so that the
+		// new archive doesn't depend on the others
+		dedup_sched(const size_t n_threads, zip_fs* z, const std::string& ar_path, const filelist_t* ar_files) : z_(z), ar_name_(ar_path.substr(ar_path.find_last_of('/') + 1)), max_todo_(4*n_threads), pool_(n_threads, 0, [](job_t& j, no_worker_state_t&) { j.digest = sha256::compute(j.f.c_str()); }) {
+			if(ar_files) {
+				if(idx_.load(dedup_index_path(), *ar_files))
+					LOG_INFO << "Dedup index " << dedup_index_path() << " loaded with " << idx_.size() << " entries";
+				else
+					LOG_INFO << "Dedup index " << dedup_index_path() << " not available, starting a new one";
+			}
+		}
+
+		// queues file f to be hashed, in the meantime
+		// stores the files already hashed
+		void add(const std::string& f, const stat64_t& s, const int comp_level, const char* kind = "NEW") {
+			if(s.fs_size < settings::AR_DEDUP_MIN_SIZE) {
+				store_new(f, s, comp_level, kind);
+				return;
+			}
+			pool_.drain([this](job_t& j) { store(j); }, max_todo_ - 1);
+			std::unique_ptr<job_t>	j(std::make_unique<job_t>());
+			j->f = f;
+			j->s = s;
+			j->comp_level = comp_level;
+			j->kind = kind;
+			pool_.add(std::move(j));
+		}
+
+		// waits for all the queued files to be stored
+		void finish(void) {
+			pool_.drain([this](job_t& j) { store(j); }, 0);
+		}
+
+		// to be called once the archive has been saved
+		void save(void) const {
+			if(settings::DRY_RUN)
+				return;
+			idx_.save(dedup_index_path());
+			LOG_INFO << "Dedup index " << dedup_index_path() << " saved with " << idx_.size() << " entries";
+		}
+	};
+
+	std::string scan_index_path(void) {
+		return combine_paths(settings::AR_DIR, std::string(FS_ARCHIVE_BASE) + "scan.idx");
+	}
+
+	// the scan index can only be used when the
+	// same elements would be scanned
+	uint64_t scan_index_cfg(void) {
+		uint64_t	h = scan_index::hash(&settings::AR_SZ_FILTER, sizeof(settings::AR_SZ_FILTER));
+		for(const auto& x : settings::AR_EXCLUSIONS)
+			h = scan_index::hash(x.c_str(), x.size() + 1, h);
+		return h;
+	}
+
+	void save_scan_index(const scan_index& idx, const std::string& ar_path) {
+		if(settings::DRY_RUN)
+			return;
+		const auto	it_l_slash = ar_path.find_last_of('/');
+		idx.save(scan_index_path(), (it_l_slash != std::string::npos) ? ar_path.substr(it_l_slash+1) : ar_path, scan_index_cfg());
+		LOG_INFO << "Scan index " << scan_index_path() << " saved with " << idx.size() << " directories";
+	}
+
+	// scans in_dirs on a separate thread and invokes on_elem on the
+	// calling one, so that the directories are being walked while
+	// the elements already found are processed (and their files
+	// read ahead by zip_fs)
+	void pipe_scan(char *in_dirs[], const int n, const fs_scan::on_elem_t& on_elem, const glob_set& excl, const scan_index* idx_in = 0, scan_index* idx_out = 0) {
+		bqueue<scan_elem_t>	q(SCAN_QUEUE_DEPTH);
+		std::thread		th_scan([&]() -> void {
+			try {
+				auto fn_push = [&q](const std::string& f, const struct stat64& s) -> void {
+					if(!q.push(scan_elem_t(f, s)))
+						throw scan_abort();
+				};
+				fs_scan::scan(in_dirs, n, fn_push, excl, settings::AR_SZ_FILTER, settings::AR_SCAN_THREADS, idx_in, idx_out);
+				q.close();
+			} catch(const scan_abort&) {
+			} catch(...) {
+				q.close(std::current_exception());
+			}
+		});
+		try {
+			scan_elem_t	e;
+			while(q.pop(e))
+				on_elem(e.first, e.second);
+		} catch(...) {
+			q.close();
+			th_scan.join();
+			throw;
+		}
+		th_scan.join();
 	}
+
+	// finds the scanned files in the (sorted) fileset of
+	// an archive by walking both in order, as a merge join;
+	// should the paths not come in order (overlapping input
+	// directories) it falls back to hash lookups
+	class merge_lookup {
+		const fileset_ext_t&	fs_;
+		size_t			cur_;
+		std::string		last_;
+		bool			merge_;
+	public:
+		merge_lookup(const fileset_ext_t& fs) : fs_(fs), cur_(0), merge_(true) {
+		}
+
+		bool find(const std::string& f, stat64_ext_t& s) {
+			if(merge_ && !last_.empty() && (path_cmp(last_, f) >= 0)) {
+				LOG_INFO << "File '" << f << "' has been scanned out of order, merge join disabled";
+				merge_ = false;
+			}
+			if(!merge_)
+				return fs_.find(f, s);
+			last_ = f;
+			while((cur_ < fs_.size()) && (fs_.compare(cur_, f) < 0))
+				++cur_;
+			if((cur_ == fs_.size()) || fs_.compare(cur_, f))
+				return false;
+			fs_.get(cur_++, s);
+			return true;
+		}
+	};
+
+	// follows the UNC and DUP entries of f down to the
+	// one actually holding its data, c_fs and f are then
+	// its archive and path
+	void resolve_entry(cpzip_fs_t& c_fs, std::string& f, stat64_ext_t& fs_e, zipfs_cache& zcache) {
+		while(true) {
+			if(!c_fs->get_fileset().find(f, fs_e))
+				throw fsarchive::rt_error("Can't extract file ") << f << " from archive " << c_fs->get_name() << " (file not present)";
+			if(FS_TYPE_FILE_UNC == fs_e.s.fs_type) {
+				c_fs = zcache.get(combine_paths(settings::AR_DIR, fs_e.s.fs_prev));
+			} else if(FS_TYPE_FILE_DUP == fs_e.s.fs_type) {
+				f = dup_target(c_fs, f);
+				c_fs = zcache.get(combine_paths(settings::AR_DIR, fs_e.s.fs_prev));
+			} else {
+				return;
+			}
+		}
+	}
+
+	// a version of a file rebuilt (once) while the archive
+	// is being saved; the reader is released as soon as it's
+	// over, libzip only freeing the sources when closing
+	class version_source : public zip_fs::data_source {
+		const cpzip_fs_t	z_;
+		const std::string	f_;
+		zipfs_cache&		zcache_;
+		pversion_reader_t	r_;
+		bool			eof_;
+	public:
+		version_source(const cpzip_fs_t& z, const std::string& f, zipfs_cache& zcache) : z_(z), f_(f), zcache_(zcache), eof_(false) {
+		}
+
+		size_t read(uint8_t *out, const size_t len) override {
+			if(eof_)
+				return 0;
+			if(!r_)
+				r_ = open_version(z_, f_, zcache_);
+			const size_t	rd = r_->read(out, len);
+			if(!rd) {
+				r_.reset();
+				eof_ = true;
+			}
+			return rd;
+		}
+	};
 }
 
 void fsarchive::init_update_archive(char *in_dirs[], const int n) {
 	using namespace fsarchive;
 
-	// init exclusions regex
-	excl_t	excl = {
-		.r_excl = init_regex(settings::AR_EXCLUSIONS),
-		.sz_excl = settings::AR_SZ_FILTER,
-	};
-	const regexvec_t	ar_comp_filter = init_regex(settings::AR_COMP_FILTER, true);
-	auto 			fn_comp_filter	= [&ar_comp_filter](const std::string& f) -> int {
+	// init exclusions
+	const glob_set		ar_excl(settings::AR_EXCLUSIONS);
+	const glob_set		ar_comp_filter(settings::AR_COMP_FILTER, true);
+	auto 			fn_comp_filter	= [&ar_comp_filter](const std::string& f, const off64_t sz) -> int {
 		// if we don't need to compress
 		// just short circuit
 		if(!settings::AR_COMPRESS)
 			return -1;
 		// otherwise try to filter - exclusions
-		for(const auto& r : ar_comp_filter) {
-			std::smatch	s;
-			if(std::regex_match(f, s, r)) {
-				LOG_INFO << "File " << f << " won't be compressed";
-				return -1;
-			}
+		if(ar_comp_filter.match(f)) {
+			LOG_INFO << "File " << f << " won't be compressed";
+			return -1;
+		}
+		// and then the data itself
+		if(settings::AR_AUTO_NOCOMP && is_incompressible(f, sz)) {
+			LOG_INFO << "File " << f << " won't be compressed (incompressible data)";
+			return -1;
 		}
 		// if we have specified a blanket
                 // compression level, just use it
@@ -373,11 +1906,16 @@ void fsarchive::init_update_archive(char *in_dirs[], const int n) {
 	// then write from scratch
 	if(ar_files.empty() || settings::AR_FORCE_NEW) {
 		LOG_INFO << "Building an archive from scratch: " << ar_next_path;
-		pzip_fs_t	z(settings::DRY_RUN ? 0 : std::make_unique<zip_fs>(ar_next_path.c_str(), false));
-		auto fn_on_elem = [&z, &fn_comp_filter](const std::string& f, const struct stat64& s) -> void {
+		pzip_fs_t	z(settings::DRY_RUN ? 0 : std::make_unique<zip_fs>(ar_next_path.c_str(), false, settings::AR_CODEC, settings::AR_PIPE_THREADS, settings::AR_PIPE_MEM, settings::AR_CATALOG));
+		std::unique_ptr<dedup_sched>	p_dedup(settings::AR_DEDUP ? std::make_unique<dedup_sched>(settings::AR_DEDUP_THREADS, z.get(), ar_next_path, nullptr) : 0);
+		auto fn_on_elem = [&z, &p_dedup, &fn_comp_filter](const std::string& f, const struct stat64& s) -> void {
 			if(S_ISREG(s.st_mode)) {
+				if(p_dedup) {
+					p_dedup->add(f, fsarc_stat64_from_stat64(s).s, fn_comp_filter(f, s.st_size));
+					return;
+				}
 				if(z)
-					z->add_file_new(f, fsarc_stat64_from_stat64(s).s, fn_comp_filter(f));
+					z->add_file_new(f, fsarc_stat64_from_stat64(s).s, fn_comp_filter(f, s.st_size));
 				LOG_INFO << "File '" << f << "' has been added as new (NEW)";
 			} else if (S_ISDIR(s.st_mode)) {
 				if(z)
@@ -385,120 +1923,157 @@ void fsarchive::init_update_archive(char *in_dirs[], const int n) {
 				LOG_INFO << "Directory '" << f << "' has been added";
 			}
 		};
-		for(int i=0; i < n; ++i)
-			r_fs_scan(in_dirs[i], fn_on_elem, excl);
+		std::unique_ptr<scan_index>	idx_out(settings::AR_SCAN_INDEX ? std::make_unique<scan_index>() : 0);
+		pipe_scan(in_dirs, n, fn_on_elem, ar_excl, 0, idx_out.get());
+		if(p_dedup)
+			p_dedup->finish();
 		// unforutnately due to the way libzip
 		// works we can't have a proper RAII
 		// container, hence had to call this
 		// separately from the destructor
 		if(z)
 			z->save_and_close();
+		if(idx_out)
+			save_scan_index(*idx_out, ar_next_path);
+		if(p_dedup)
+			p_dedup->save();
 	} else {
 		// otherwise load the latest archive
 		LOG_INFO << "Building a delta archive: " << ar_next_path << " -> " << *ar_files.rbegin();
 		const auto&	z_latest_name = *ar_files.rbegin();
-		const zip_fs	z_latest(combine_paths(settings::AR_DIR, z_latest_name), true);
+		zipfs_cache			zcache;
+		const cpzip_fs_t		z_latest(zcache.get(combine_paths(settings::AR_DIR, z_latest_name)));
+		// the MOD entries read their patches from it
+		// while the archive is saved, hence has to
+		// outlive z_next
+		std::unique_ptr<bsdiff_sched>	p_bsdiff((settings::AR_USE_BSDIFF && !settings::DRY_RUN) ? std::make_unique<bsdiff_sched>(settings::AR_BSDIFF_THREADS, settings::AR_BSDIFF_MEM, combine_paths(settings::AR_DIR, z_latest_name)) : 0);
 		// we need to generate a new 'delta' archive
-		pzip_fs_t	z_next(settings::DRY_RUN ? 0 : std::make_unique<zip_fs>(ar_next_path.c_str(), false));
-		// then we need to get all the files
-		fileset_ext_t	all_files;
-		{
-			auto fn_fileadd = [&all_files](const std::string& f, const struct stat64& s) -> void {
-				if(S_ISREG(s.st_mode) || S_ISDIR(s.st_mode))
-					all_files[f] = fsarc_stat64_from_stat64(s);
-			};
-			for(int i=0; i < n; ++i)
-				r_fs_scan(in_dirs[i], fn_fileadd, excl);
-		}
-		// then we should have 3 logical 'sets'
-		// * new files
-		// * mod(ified) files
-		// * unc(changed) files
-		// and we should manage accordingly
-		fsarchive::log::progress	p_delta("Delta zip creation");
-		size_t				p_num = 0;
-		const auto&			latest_fileset = z_latest.get_fileset();
-		zipfscache_t			zcache;
-		for(const auto& f : all_files) {
-			p_delta.update_completion(1.0*(p_num++)/all_files.size());
+		pzip_fs_t	z_next(settings::DRY_RUN ? 0 : std::make_unique<zip_fs>(ar_next_path.c_str(), false, settings::AR_CODEC, settings::AR_PIPE_THREADS, settings::AR_PIPE_MEM, settings::AR_CATALOG));
+		// then each file found is classified as
+		// * new file
+		// * mod(ified) file
+		// * unc(hanged) file
+		// while the scan carries on
+		size_t				n_elems = 0;
+		merge_lookup			latest_lookup(z_latest->get_fileset());
+		std::unique_ptr<dedup_sched>	p_dedup(settings::AR_DEDUP ? std::make_unique<dedup_sched>(settings::AR_DEDUP_THREADS, z_next.get(), ar_next_path, &ar_files) : 0);
+		auto fn_add_new = [&z_next, &p_dedup](const std::string& f_path, const stat64_t& f_s, const int comp_level, const char* kind) -> void {
+			if(p_dedup) {
+				p_dedup->add(f_path, f_s, comp_level, kind);
+				return;
+			}
+			if(z_next)
+				z_next->add_file_new(f_path, f_s, comp_level);
+			LOG_INFO << "File '" << f_path << "' has been added as new (" << kind << ")";
+		};
+		auto fn_add_unc = [&z_next, &z_latest_name, &fn_comp_filter, &fn_add_new](const std::string& f_path, const stat64_t& f_s, const stat64_ext_t& latest, const bool add_unc) -> void {
+			// optimization - if the file is unchanged in z_latest as well,
+			// then use its prev!
+			if(add_unc) {
+				const char *prev_unc = (FS_TYPE_FILE_UNC == latest.s.fs_type) ? latest.s.fs_prev : z_latest_name.c_str();
+				if(z_next)
+					z_next->add_file_unchanged(f_path, f_s, prev_unc);
+				LOG_INFO << "File '" << f_path << "' has been added as unchanged (UNC) -> " << prev_unc;
+			} else {
+				// brand new file
+				fn_add_new(f_path, f_s, fn_comp_filter(f_path, f_s.fs_size), "NEW");
+			}
+		};
+		auto fn_on_crc = [&fn_add_unc](crc_sched::result_t& r) -> void {
+			const bool	crc_ok = r.arc_found && (r.arc_crc == r.cur_crc);
+			if(!crc_ok)
+				LOG_WARNING << "File '" << r.f << "' couldn't have its CRC32 found and/or was different (" << r.cur_crc << " != " << r.arc_crc << "). Adding as changed";
+			fn_add_unc(r.f, r.s, r.latest, crc_ok);
+		};
+		std::unique_ptr<crc_sched>	p_crc(settings::CRC32_CHECK ? std::make_unique<crc_sched>(settings::CRC32_THREADS, combine_paths(settings::AR_DIR, z_latest_name)) : 0);
+		auto fn_on_elem = [&](const std::string& f_path, const struct stat64& f_s) -> void {
+			if(!S_ISREG(f_s.st_mode) && !S_ISDIR(f_s.st_mode))
+				return;
+			++n_elems;
+			const auto	f_stat = fsarc_stat64_from_stat64(f_s);
 			// if f is a directory, just add it to the new archive
-			if(S_ISDIR(f.second.s.fs_mode)) {
+			if(S_ISDIR(f_stat.s.fs_mode)) {
 				if(z_next)
-					z_next->add_directory(f.first, f.second.s);
-				LOG_INFO << "Directory '" << f.first << "' has been added";
-				continue;
+					z_next->add_directory(f_path, f_stat.s);
+				LOG_INFO << "Directory '" << f_path << "' has been added";
+				return;
 			}
 			// otherwise carry on...
-			const auto	it_latest = latest_fileset.find(f.first);
-			if(it_latest == latest_fileset.end()) {
+			stat64_ext_t	latest;
+			if(!latest_lookup.find(f_path, latest)) {
 				// brand new file
-				if(z_next)
-					z_next->add_file_new(f.first, f.second.s, fn_comp_filter(f.first));
-				LOG_INFO << "File '" << f.first << "' has been added as new (NEW)";
-			} else if((f.second.s.fs_mtime != it_latest->second.s.fs_mtime) ||
-				  (f.second.s.fs_size != it_latest->second.s.fs_size)) {
+				fn_add_new(f_path, f_stat.s, fn_comp_filter(f_path, f_stat.s.fs_size), "NEW");
+			} else if((f_stat.s.fs_mtime != latest.s.fs_mtime) ||
+				  (f_stat.s.fs_size != latest.s.fs_size)) {
 				// in case we don't want any bsdiff
 				// or current file is marked to be comp excluded
-				const int	is_comp_excl = fn_comp_filter(f.first);
-				if(!settings::AR_USE_BSDIFF) {
+				const int	is_comp_excl = fn_comp_filter(f_path, f_stat.s.fs_size);
+				// large files are chunked while saving
+				if(settings::AR_CDC && (f_stat.s.fs_size >= settings::AR_CDC_MIN_SIZE)) {
 					if(z_next)
-						z_next->add_file_new(f.first, f.second.s, is_comp_excl);
-					LOG_INFO << "File '" << f.first << "' has been added as new (NEW - no bsdiff)";
-					continue;
+						z_next->add_file_cdc(f_path, f_stat.s, std::make_unique<cdc_writer>(f_path, z_latest, zcache), z_latest_name.c_str(), is_comp_excl);
+					LOG_INFO << "File '" << f_path << "' has been added as changed by chunks (CDC) -> " << z_latest_name;
+					return;
 				}
-				// changed file
-				// first rebuild the file
-				buffer_t	p_data;
-				r_rebuild_file(z_latest, f.first, p_data, zcache);
-				// create a bsdiff patch
-				std::stringstream	s_diff;
-				bsdiff_stream_t	bsd_s = {
-					.opaque = (void*)&s_diff,
-					.malloc = malloc,
-					.free = free,
-					.write = fsarc_bsdiff_write,
-				};
-				buffer_t	n_data;
-				load_file(f.first, n_data);
-				if(bsdiff(p_data.data(), p_data.size(), n_data.data(), n_data.size(), &bsd_s))
-					throw fsarchive::rt_error("Couldn't diff file ") << f.first << " from archive";
-				// and finally add it
+				if(!settings::AR_USE_BSDIFF || (settings::AR_COMPRESS && (is_comp_excl < 0))) {
+					fn_add_new(f_path, f_stat.s, is_comp_excl, "NEW - no bsdiff");
+					return;
+				}
+				// large files are diffed by windows while saving
+				if((uint64_t)std::max(latest.s.fs_size, f_stat.s.fs_size) > (uint64_t)settings::AR_BSDIFF_WINDOW) {
+					// windows are deflated by the threads diffing
+					// them, with other codecs the entry is compressed
+					const bool	win_comp = (settings::C_DEFLATE == settings::AR_CODEC);
+					if(z_next)
+						z_next->add_file_cbsdiff(f_path, f_stat.s, std::make_unique<cmod_writer>(f_path, z_latest, zcache, settings::AR_BSDIFF_WINDOW, (win_comp) ? is_comp_excl : -1, settings::AR_BSDIFF_THREADS, settings::AR_BSDIFF_MEM), z_latest_name.c_str(), (win_comp) ? -1 : is_comp_excl);
+					LOG_INFO << "File '" << f_path << "' has been added as changed by windows (CMOD) -> " << z_latest_name;
+					return;
+				}
+				// changed file, diffed by the scheduler
 				if(z_next)
-					z_next->add_file_bsdiff(f.first, f.second.s, s_diff.str(), z_latest_name.c_str(), is_comp_excl);
-				LOG_INFO << "File '" << f.first << "' has been added as changed (MOD) -> " << z_latest_name;
+					z_next->add_file_bsdiff(f_path, f_stat.s, p_bsdiff->add(f_path, f_stat.s, latest.s.fs_size), z_latest_name.c_str(), is_comp_excl);
+				LOG_INFO << "File '" << f_path << "' has been added as changed (MOD) -> " << z_latest_name;
+			} else if(p_crc) {
+				// unchanged file, unless the CRC32 check says otherwise
+				p_crc->add(f_path, f_stat.s, latest, fn_on_crc);
 			} else {
 				// unchanged file
-				bool	add_unc = true;
-				// let's do the crc32 check
-				if(settings::CRC32_CHECK) {
-					const uint32_t	cur_crc = crc32::compute(f.first.c_str());
-					uint32_t	arc_crc = 0;
-					if(!r_crc_file(z_latest, f.first, zcache, arc_crc) || (arc_crc != cur_crc)) {
-						LOG_WARNING << "File '" << f.first << "' couldn't have its CRC32 found and/or was different (" << cur_crc << " != " << arc_crc << "). Adding as changed";
-						add_unc = false;
-					}
-				}
-				// optimization - if the file is unchanged in z_latest as well,
-				// then use its prev!
-				if(add_unc) {
-					const char *prev_unc = (FS_TYPE_FILE_UNC == it_latest->second.s.fs_type) ? it_latest->second.s.fs_prev : z_latest_name.c_str();
-					if(z_next)
-						z_next->add_file_unchanged(f.first, f.second.s, prev_unc);
-					LOG_INFO << "File '" << f.first << "' has been added as unchanged (UNC) -> " << prev_unc;
+				fn_add_unc(f_path, f_stat.s, latest, true);
+			}
+		};
+		// directories unchanged since the latest archive
+		// don't have their files lstat'ed again
+		std::unique_ptr<scan_index>	idx_in,
+						idx_out;
+		if(settings::AR_SCAN_INDEX) {
+			idx_out = std::make_unique<scan_index>();
+			if(!settings::AR_FULL_RESCAN) {
+				idx_in = std::make_unique<scan_index>();
+				if(idx_in->load(scan_index_path(), z_latest_name, scan_index_cfg())) {
+					LOG_INFO << "Scan index " << scan_index_path() << " loaded with " << idx_in->size() << " directories";
 				} else {
-					// brand new file
-					if(z_next)
-						z_next->add_file_new(f.first, f.second.s, fn_comp_filter(f.first));
-					LOG_INFO << "File '" << f.first << "' has been added as new (NEW)";
+					LOG_INFO << "Scan index " << scan_index_path() << " not available, full scan";
+					idx_in.reset();
 				}
 			}
 		}
-		p_delta.reset_completion(1.0);
+		pipe_scan(in_dirs, n, fn_on_elem, ar_excl, idx_in.get(), idx_out.get());
+		idx_in.reset();
+		if(p_crc)
+			p_crc->finish(fn_on_crc);
+		if(p_dedup)
+			p_dedup->finish();
+		LOG_INFO << "Delta archive has " << n_elems << " files/directories";
+		log_content_cache_stats();
 		// finalize the archive and save it. similarly as
 		// per above, couldn't just leave this in the
 		// destructor
 		if(z_next)
 			z_next->save_and_close();
+		if(idx_out)
+			save_scan_index(*idx_out, ar_next_path);
+		if(p_dedup)
+			p_dedup->save();
 	}
 }
 
@@ -509,11 +2084,12 @@ void fsarchive::restore_archive(void) {
 	if(settings::RE_FILE.empty() || lstat64(settings::RE_FILE.c_str(), &s) || !S_ISREG(s.st_mode))
 		throw fsarchive::rt_error("Archive to restore is empty and/or file doesn't exist/is not accessible ") << settings::RE_FILE;
 
-	const zip_fs	z(settings::RE_FILE, true);
+	// shared with the restore threads
+	const cpzip_fs_t	z(get_zipfs_shared().open(settings::RE_FILE));
 
 	pprogress_t	p_restore(std::make_unique<log::progress>("Restoring zip data"));
 	size_t		p_num = 0;
-	const auto&	re_fs = z.get_fileset();
+	const auto&	re_fs = z->get_fileset();
 	auto fn_out_file = [](const std::string& f) -> std::string {
 		if(f[0] == '/') {
 			if(!settings::RE_DIR.empty())
@@ -527,7 +2103,7 @@ void fsarchive::restore_archive(void) {
 				return f;
 		}
 	};
-	zipfscache_t	zcache;
+	restore_sched	re_sched(settings::RE_THREADS);
 	for(const auto& f : re_fs) {
 		p_restore->update_completion(1.0*(p_num++)/re_fs.size());
 		const std::string	out_file = fn_out_file(f.first);
@@ -540,10 +2116,11 @@ void fsarchive::restore_archive(void) {
 		const auto		it_l_slash = out_file.find_last_of('/');
 		if(it_l_slash != std::string::npos)
 			init_paths(out_file.substr(0, it_l_slash+1));
-		buffer_t	buf_file;
-		r_rebuild_file(z, f.first, buf_file, zcache);
-		write_file(out_file, buf_file);
+		if(!re_sched.add(f.first, out_file))
+			break;
 	}
+	re_sched.finish();
+	log_content_cache_stats();
 	p_restore->update_completion(1.0);
 	p_restore.reset();
 	// update metadata if so - default
@@ -560,3 +2137,121 @@ void fsarchive::restore_archive(void) {
 	}
 }
 
+void fsarchive::consolidate_archive(void) {
+	using namespace fsarchive;
+
+	std::string		ar_next_path;
+	filelist_t		ar_files;
+	check_dir_fsarchives(settings::AR_DIR, ar_next_path, ar_files);
+	if(ar_files.empty())
+		throw fsarchive::rt_error("No archive to consolidate in ") << settings::AR_DIR;
+	const auto&	z_latest_name = *ar_files.rbegin();
+	const auto	it_l_slash = ar_next_path.find_last_of('/');
+	const std::string	ar_next_name = (it_l_slash != std::string::npos) ? ar_next_path.substr(it_l_slash+1) : ar_next_path;
+	LOG_INFO << "Consolidating archive " << z_latest_name << " into " << ar_next_path;
+	// the files are not available, only the
+	// path based filters can be applied
+	const glob_set		ar_comp_filter(settings::AR_COMP_FILTER, true);
+	auto 			fn_comp_filter	= [&ar_comp_filter](const std::string& f) -> int {
+		if(!settings::AR_COMPRESS || ar_comp_filter.match(f))
+			return -1;
+		return settings::AR_COMP_LEVEL;
+	};
+	zipfs_cache		zcache;
+	const cpzip_fs_t	z_latest(zcache.get(combine_paths(settings::AR_DIR, z_latest_name)));
+	pzip_fs_t		z_next(settings::DRY_RUN ? 0 : std::make_unique<zip_fs>(ar_next_path.c_str(), false, settings::AR_CODEC, 0, 0, settings::AR_CATALOG));
+	// the archives whose entries are copied have to
+	// stay open until the new one is saved
+	std::set<cpzip_fs_t>	z_copied;
+	// files stored as duplicates of another
+	// one in the new archive
+	std::unordered_map<std::string, std::string>	dup_of;
+	size_t			n_copy = 0,
+				n_dup = 0,
+				n_rebuild = 0;
+	const auto&		latest_fs = z_latest->get_fileset();
+	for(const auto& f : latest_fs) {
+		const stat64_t&	s = f.second.s;
+		if(S_ISDIR(s.fs_mode)) {
+			if(z_next)
+				z_next->add_directory(f.first, s);
+			LOG_INFO << "Directory '" << f.first << "' has been added";
+			continue;
+		}
+		cpzip_fs_t	c_fs = z_latest;
+		std::string	c_f = f.first;
+		stat64_ext_t	c_e;
+		resolve_entry(c_fs, c_f, c_e, zcache);
+		if(c_f != f.first) {
+			// a duplicate, which can still refer to the
+			// new archive if its target is the same file
+			stat64_ext_t	t_e;
+			if(latest_fs.find(c_f, t_e) && S_ISREG(t_e.s.fs_mode)) {
+				cpzip_fs_t	t_fs = z_latest;
+				std::string	t_f = c_f;
+				resolve_entry(t_fs, t_f, t_e, zcache);
+				if((t_fs->get_name() == c_fs->get_name()) && (t_f == c_f)) {
+					if(z_next)
+						z_next->add_file_dup(f.first, s, ar_next_name.c_str(), c_f);
+					dup_of[f.first] = c_f;
+					LOG_INFO << "File '" << f.first << "' has been added as duplicate (DUP) of '" << c_f << "'";
+					++n_dup;
+					continue;
+				}
+			}
+		}
+		if(FS_TYPE_FILE_NEW == c_e.s.fs_type) {
+			if(z_next)
+				z_next->add_file_copy(f.first, s, *c_fs, c_f);
+			z_copied.insert(c_fs);
+			LOG_INFO << "File '" << f.first << "' has been copied as new (NEW) from " << c_fs->get_name();
+			++n_copy;
+		} else if((FS_TYPE_FILE_MOD == c_e.s.fs_type) || (FS_TYPE_FILE_CMOD == c_e.s.fs_type) || (FS_TYPE_FILE_CDC == c_e.s.fs_type)) {
+			if(z_next)
+				z_next->add_file_data(f.first, s, std::make_unique<version_source>(c_fs, c_f, zcache), fn_comp_filter(f.first));
+			LOG_INFO << "File '" << f.first << "' has been added as new (NEW), rebuilt from " << c_fs->get_name();
+			++n_rebuild;
+		} else {
+			throw fsarchive::rt_error("Invalid metadata fs_type ") << c_e.s.fs_type << " for file " << c_f;
+		}
+	}
+	LOG_INFO << "Consolidated archive has " << latest_fs.size() << " files/directories, " << n_copy << " file(s) copied, " << n_rebuild << " rebuilt and " << n_dup << " duplicate(s)";
+	// the files are rebuilt while saving
+	if(!z_next)
+		return;
+	z_next->save_and_close();
+	log_content_cache_stats();
+	// the dedup index entries with the same content of a file
+	// of the new archive now refer to it, the others are
+	// dropped as per a new base archive
+	dedup_index	d_idx;
+	if(!d_idx.load(dedup_index_path(), ar_files))
+		return;
+	const size_t	n_entries = d_idx.size();
+	d_idx.update([&](dedup_index::entry_t& e) -> bool {
+		stat64_ext_t	l_e;
+		if(!latest_fs.find(e.path, l_e) || !S_ISREG(l_e.s.fs_mode))
+			return false;
+		try {
+			cpzip_fs_t	e_fs = zcache.get(combine_paths(settings::AR_DIR, e.archive)),
+					l_fs = z_latest;
+			std::string	e_f = e.path,
+					l_f = e.path;
+			stat64_ext_t	r_e;
+			resolve_entry(e_fs, e_f, r_e, zcache);
+			resolve_entry(l_fs, l_f, r_e, zcache);
+			if((e_fs->get_name() != l_fs->get_name()) || (e_f != l_f))
+				return false;
+		} catch(const std::exception& ex) {
+			LOG_WARNING << "Dedup index entry '" << e.path << "' of " << e.archive << " can't be checked: " << ex.what();
+			return false;
+		}
+		const auto	it_d = dup_of.find(e.path);
+		e.archive = ar_next_name;
+		if(it_d != dup_of.end())
+			e.path = it_d->second;
+		return true;
+	});
+	d_idx.save(dedup_index_path());
+	LOG_INFO << "Dedup index " << dedup_index_path() << " updated with " << d_idx.size() << " of " << n_entries << " entries";
+}
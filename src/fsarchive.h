@@ -23,6 +23,9 @@
 namespace fsarchive {
 	void	init_update_archive(char *in_dirs[], const int n);
 	void	restore_archive(void);
+	// writes a new archive with all the files of the latest
+	// one stored in full, not depending on any other archive
+	void	consolidate_archive(void);
 }
 
 #endif //_FSARCHIVE_H_
@@ -0,0 +1,221 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "glob_set.h"
+#include "utils.h"
+#include "log.h"
+#include <map>
+#include <deque>
+#include <algorithm>
+
+namespace {
+	// way above what any reasonable set of
+	// exclusions generates
+	const size_t	MAX_DFA_STATES = 1 << 16;
+
+	enum TOK_TYPE {
+		T_LIT = 0,
+		// first character of '?'
+		T_ONE_NOSLASH,
+		// following characters of '?'
+		T_STAR_NOSLASH,
+		// '*'
+		T_STAR_ANY,
+		// end of a pattern
+		T_ACCEPT
+	};
+
+	typedef struct {
+		TOK_TYPE	type;
+		uint8_t		c;
+	} token_t;
+
+	typedef std::vector<token_t>	tokvec_t;
+
+	// sorted list of positions in tokvec_t, i.e. a set
+	// of states of the equivalent NFA
+	typedef std::vector<uint32_t>	nfa_set_t;
+
+	uint8_t to_lower(const uint8_t c) {
+		return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+	}
+
+	void add_closure(const tokvec_t& toks, uint32_t pos, nfa_set_t& out) {
+		while(true) {
+			out.push_back(pos);
+			// '*' and the tail of '?' can match nothing
+			if(T_STAR_NOSLASH != toks[pos].type && T_STAR_ANY != toks[pos].type)
+				break;
+			++pos;
+		}
+	}
+
+	void normalize(const tokvec_t& toks, nfa_set_t& s) {
+		std::sort(s.begin(), s.end());
+		s.erase(std::unique(s.begin(), s.end()), s.end());
+		// if a pattern is on its trailing '*' then
+		// whatever follows will match, hence we
+		// don't need to keep track of any other
+		// pattern; this keeps the DFA small with
+		// many expressions like "/abc/*"
+		for(const auto& i : s) {
+			if(T_STAR_ANY == toks[i].type && T_ACCEPT == toks[i+1].type) {
+				s = { i, i+1 };
+				break;
+			}
+		}
+	}
+}
+
+fsarchive::glob_set::glob_set(const settings::excllist_t& globs, const bool nocase) : n_cls_(0), start_(0) {
+	// first build the list of tokens, all patterns
+	// one after the other
+	tokvec_t	toks;
+	nfa_set_t	start_set;
+	bool		is_lit[256] = {false};
+	for(const auto& g : globs) {
+		start_set.push_back(toks.size());
+		for(const char *p = g.c_str(); *p; ++p) {
+			switch(*p) {
+				case '*':
+					toks.push_back({ .type = T_STAR_ANY, .c = 0 });
+					break;
+				case '?':
+					toks.push_back({ .type = T_ONE_NOSLASH, .c = 0 });
+					toks.push_back({ .type = T_STAR_NOSLASH, .c = 0 });
+					break;
+				default: {
+					const uint8_t	c = (nocase) ? to_lower(*p) : *p;
+					toks.push_back({ .type = T_LIT, .c = c });
+					is_lit[c] = true;
+				} break;
+			}
+		}
+		toks.push_back({ .type = T_ACCEPT, .c = 0 });
+	}
+	// now compute the start set closure
+	{
+		nfa_set_t	tmp;
+		for(const auto& i : start_set)
+			add_closure(toks, i, tmp);
+		normalize(toks, tmp);
+		start_set.swap(tmp);
+	}
+	// build the character classes
+	// 0 is for all the characters which are
+	// not '/' and are not part of any literal
+	uint8_t	rep[256] = {0};
+	{
+		int	lit_cls[256];
+		std::fill(lit_cls, lit_cls+256, -1);
+		n_cls_ = 1;
+		for(int i = 0; i < 256; ++i) {
+			const uint8_t	c = (nocase) ? to_lower(i) : i;
+			if(is_lit[c] || '/' == c) {
+				if(-1 == lit_cls[c]) {
+					lit_cls[c] = n_cls_;
+					rep[n_cls_++] = c;
+				}
+				cls_[i] = lit_cls[c];
+			} else {
+				cls_[i] = 0;
+				rep[0] = c;
+			}
+		}
+	}
+	// then run the subset construction, state 0
+	// is the dead one
+	typedef std::pair<const nfa_set_t*, uint32_t>	todo_t;
+	std::map<nfa_set_t, uint32_t>	states;
+	std::deque<todo_t>		todo;
+	auto fn_get_state = [&](const nfa_set_t& s) -> uint32_t {
+		const auto	it = states.find(s);
+		if(states.end() != it)
+			return it->second;
+		if(states.size() >= MAX_DFA_STATES)
+			throw fsarchive::rt_error("Glob expressions are too complex, can't compile them with more than ") << MAX_DFA_STATES << " states";
+		const uint32_t	id = states.size();
+		const auto	rv = states.insert(std::make_pair(s, id));
+		trans_.resize(trans_.size() + n_cls_, 0);
+		bool	acc = false;
+		for(const auto& i : s)
+			acc |= (T_ACCEPT == toks[i].type);
+		accept_.push_back(acc);
+		todo.push_back(todo_t(&rv.first->first, id));
+		return id;
+	};
+	fn_get_state(nfa_set_t());
+	start_ = fn_get_state(start_set);
+	while(!todo.empty()) {
+		const nfa_set_t&	cur = *todo.front().first;
+		const uint32_t		cur_id = todo.front().second;
+		todo.pop_front();
+		// the dead state only goes to itself
+		if(cur.empty())
+			continue;
+		for(uint32_t cl = 0; cl < n_cls_; ++cl) {
+			const uint8_t	c = rep[cl];
+			nfa_set_t	next;
+			for(const auto& i : cur) {
+				const auto&	t = toks[i];
+				switch(t.type) {
+					case T_LIT:
+						if(t.c == c)
+							add_closure(toks, i+1, next);
+						break;
+					case T_ONE_NOSLASH:
+						if('/' != c)
+							add_closure(toks, i+1, next);
+						break;
+					case T_STAR_NOSLASH:
+						if('/' != c)
+							add_closure(toks, i, next);
+						break;
+					case T_STAR_ANY:
+						add_closure(toks, i, next);
+						break;
+					default:
+						break;
+				}
+			}
+			normalize(toks, next);
+			const uint32_t	next_id = fn_get_state(next);
+			trans_[cur_id*n_cls_ + cl] = next_id;
+		}
+	}
+	// finally find which states can only lead to
+	// matches, starting from all the accepting ones
+	// and removing those with non accepting next
+	univ_ = accept_;
+	for(bool changed = true; changed; ) {
+		changed = false;
+		for(uint32_t st = 0; st < univ_.size(); ++st) {
+			if(!univ_[st])
+				continue;
+			for(uint32_t cl = 0; cl < n_cls_; ++cl) {
+				if(!univ_[trans_[st*n_cls_ + cl]]) {
+					univ_[st] = false;
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+	LOG_SPAM << "Compiled " << globs.size() << " glob expression(s) into " << accept_.size() << " states and " << n_cls_ << " character classes";
+}
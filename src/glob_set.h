@@ -0,0 +1,93 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GLOB_SET_H_
+#define _GLOB_SET_H_
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include "settings.h"
+
+namespace fsarchive {
+	// Set of glob expressions (see -x option) compiled into
+	// a single DFA, so that a path is matched against all of
+	// them in one pass:
+	// * matches any sequence of characters (even empty)
+	// ? matches one or more characters, excluding '/'
+	// everything else is a literal character
+	// Once built is read only, hence can be used by
+	// multiple threads at the same time
+	class glob_set {
+		// the DFA works on classes of characters, each
+		// literal in the patterns and '/' have their own
+		uint8_t			cls_[256];
+		uint32_t		n_cls_;
+		// n_states * n_cls_ transitions, state 0 is the
+		// 'dead' one (can't match anymore)
+		std::vector<uint32_t>	trans_;
+		std::vector<uint8_t>	accept_;
+		// states from which whatever follows
+		// will always match
+		std::vector<uint8_t>	univ_;
+		uint32_t		start_;
+
+		glob_set();
+	public:
+		typedef uint32_t	state_t;
+
+		glob_set(const settings::excllist_t& globs, const bool nocase = false);
+
+		bool empty(void) const {
+			return 0 == start_;
+		}
+
+		state_t start(void) const {
+			return start_;
+		}
+
+		state_t step(state_t s, const char *p, size_t len) const {
+			for(; len && s; --len, ++p)
+				s = trans_[s*n_cls_ + cls_[(uint8_t)*p]];
+			return s;
+		}
+
+		bool is_match(const state_t s) const {
+			return accept_[s];
+		}
+
+		// true when appending any (non empty) sequence
+		// of characters to what led to s would match; i.e.
+		// if s is the state for "/abc/" then everything
+		// inside /abc is a match
+		bool is_match_all_next(const state_t s) const {
+			for(uint32_t cl = 0; cl < n_cls_; ++cl)
+				if(!univ_[trans_[s*n_cls_ + cl]])
+					return false;
+			return true;
+		}
+
+		bool match(const std::string& f) const {
+			return is_match(step(start_, f.c_str(), f.size()));
+		}
+	};
+}
+
+#endif //_GLOB_SET_H_
+
@@ -23,6 +23,7 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <mutex>
 
 namespace {
 	struct winsize term_size = {0};
@@ -53,9 +54,14 @@ namespace {
 		std::strftime(out, sizeof(char)*32, tm_fmt, &res);
 	}
 
+	// log lines can be written by multiple threads, cur_prg
+	// and its completion are only accessed with print_mtx held
+	std::mutex			print_mtx;
+
 	fsarchive::log::progress	*cur_prg = 0;
 
-	void do_print(const std::string& log_line, const bool progress_only) {
+	// print_mtx has to be held
+	void print_locked(const std::string& log_line, const bool progress_only) {
 		if(!is_term) {
 			if(!progress_only)
 				printf("%s\n", log_line.c_str());
@@ -70,6 +76,11 @@ namespace {
 		}
 		fflush(stdout);
 	}
+
+	void do_print(const std::string& log_line, const bool progress_only) {
+		std::lock_guard<std::mutex>	l(print_mtx);
+		print_locked(log_line, progress_only);
+	}
 }
 
 int fsarchive::log::level = fsarchive::log::L_INFO;
@@ -97,6 +108,7 @@ fsarchive::log::message::~message() {
 }
 
 fsarchive::log::progress::progress(const std::string& label) : label_(label), completion_(.0) {
+	std::lock_guard<std::mutex>	l(print_mtx);
 	if(!cur_prg)
 		cur_prg = this;
 	else
@@ -104,15 +116,18 @@ fsarchive::log::progress::progress(const std::string& label) : label_(label), co
 }
 
 void fsarchive::log::progress::update_completion(const double c) {
+	std::lock_guard<std::mutex>	l(print_mtx);
 	completion_ = c;
-	do_print("", true);
+	print_locked("", true);
 }
 
 void fsarchive::log::progress::reset_completion(const double c) {
+	std::lock_guard<std::mutex>	l(print_mtx);
 	completion_ = c;
-	do_print("", true);
-	cur_prg = 0;
-	do_print("", false);
+	print_locked("", true);
+	if(cur_prg == this)
+		cur_prg = 0;
+	print_locked("", false);
 	completion_ = .0;
 }
 
@@ -120,13 +135,15 @@ const std::string& fsarchive::log::progress::get_label(void) const {
 	return label_;
 }
 
+// to be invoked with print_mtx held
 const double fsarchive::log::progress::get_completion(void) const {
 	return completion_;
 }
 
 fsarchive::log::progress::~progress() {
-	cur_prg = 0;
+	std::lock_guard<std::mutex>	l(print_mtx);
+	if(cur_prg == this)
+		cur_prg = 0;
 	if(completion_ != .0)
-		do_print("", false);
+		print_locked("", false);
 }
-
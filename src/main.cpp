@@ -41,8 +41,12 @@ int main(int argc, char *argv[]) {
 				fsarchive::restore_archive();
 				LOG_INFO << "Restore action completed";
 				break;
+			case fsarchive::settings::ACTION::A_CONSOLIDATE:
+				fsarchive::consolidate_archive();
+				LOG_INFO << "Consolidate action completed";
+				break;
 			default:
-				throw fsarchive::rt_error("Invalid action ") << fsarchive::settings::AR_ACTION << " need to specify -a or -r";
+				throw fsarchive::rt_error("Invalid action ") << fsarchive::settings::AR_ACTION << " need to specify -a, -r or --consolidate";
 		}
 	} catch(const std::exception& e) {
 		LOG_ERROR << "Exception: " << e.what();
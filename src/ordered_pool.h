@@ -0,0 +1,212 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _ORDERED_POOL_H_
+#define _ORDERED_POOL_H_
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace fsarchive {
+	// state of the workers of a pool not needing any
+	typedef struct {
+	} no_worker_state_t;
+
+	// Runs jobs (J) on n_threads threads, each one with its own
+	// state (W, i.e. a cache which can't be shared among threads).
+	// Jobs are dispatched in the same order they have been added,
+	// and only if their cost (i.e. expected memory usage) fits in
+	// max_cost together with the jobs not handed back yet; a job
+	// costing more than max_cost is dispatched alone.
+	// Jobs are handed back either in the same order they have been
+	// added (see pop and drain) or one at a time (see take),
+	// rethrowing what run threw
+	template<typename J, typename W = no_worker_state_t>
+	class ordered_pool {
+	public:
+		typedef std::function<void(J&, W&)>	run_t;
+
+		typedef std::function<void(J&)>		on_done_t;
+	private:
+		typedef struct {
+			std::unique_ptr<J>	j;
+			size_t			cost;
+			bool			ready;
+			std::exception_ptr	err;
+		} job_t;
+
+		const run_t				run_;
+		const size_t				max_cost_;
+		std::mutex				mtx_;
+		std::condition_variable			cv_work_,
+							cv_done_;
+		// jobs in the same order as added, the
+		// first next_ ones have been dispatched
+		std::deque<std::unique_ptr<job_t>>	jobs_;
+		size_t					next_,
+							cost_used_;
+		bool					quit_;
+		std::vector<std::thread>		workers_;
+
+		void worker(void) {
+			W	w;
+			while(true) {
+				job_t	*j = 0;
+				{
+					std::unique_lock<std::mutex>	l(mtx_);
+					cv_work_.wait(l, [this](){ return quit_ || ((next_ < jobs_.size()) && (!next_ || (cost_used_ + jobs_[next_]->cost <= max_cost_))); });
+					if(quit_)
+						return;
+					j = jobs_[next_++].get();
+					cost_used_ += j->cost;
+				}
+				try {
+					run_(*j->j, w);
+				} catch(...) {
+					j->err = std::current_exception();
+				}
+				{
+					std::lock_guard<std::mutex>	l(mtx_);
+					j->ready = true;
+				}
+				cv_done_.notify_all();
+			}
+		}
+
+		// to be called with mtx_ locked
+		size_t find(const J* j) const {
+			size_t	i = 0;
+			while(jobs_[i]->j.get() != j)
+				++i;
+			return i;
+		}
+
+		// removes job i, which has to be either done or not
+		// dispatched yet; to be called with mtx_ locked
+		std::unique_ptr<job_t> remove(const size_t i) {
+			std::unique_ptr<job_t>	j(std::move(jobs_[i]));
+			jobs_.erase(jobs_.begin() + i);
+			if(i < next_) {
+				--next_;
+				cost_used_ -= j->cost;
+			}
+			return j;
+		}
+
+		// removes job i, which has to be done, and hands
+		// it back; to be called with l locked, returns
+		// with l unlocked
+		std::unique_ptr<J> hand_back(std::unique_lock<std::mutex>& l, const size_t i) {
+			std::unique_ptr<job_t>	j(remove(i));
+			l.unlock();
+			cv_work_.notify_all();
+			if(j->err)
+				std::rethrow_exception(j->err);
+			return std::move(j->j);
+		}
+
+		ordered_pool();
+		ordered_pool(const ordered_pool&);
+		ordered_pool& operator=(const ordered_pool&);
+	public:
+		ordered_pool(const size_t n_threads, const size_t max_cost, const run_t& run) : run_(run), max_cost_(max_cost), next_(0), cost_used_(0), quit_(false) {
+			for(size_t i = 0; i < n_threads; ++i)
+				workers_.push_back(std::thread(&ordered_pool::worker, this));
+		}
+
+		// returns the job, owned by the
+		// pool until handed back
+		J* add(std::unique_ptr<J>&& j, const size_t cost = 0) {
+			J	*rv = j.get();
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				jobs_.push_back(std::make_unique<job_t>());
+				jobs_.back()->j = std::move(j);
+				jobs_.back()->cost = cost;
+				jobs_.back()->ready = false;
+			}
+			cv_work_.notify_one();
+			return rv;
+		}
+
+		// jobs added and not handed back yet
+		size_t size(void) {
+			std::lock_guard<std::mutex>	l(mtx_);
+			return jobs_.size();
+		}
+
+		// waits for the first job (there has
+		// to be one) and hands it back
+		std::unique_ptr<J> pop(void) {
+			std::unique_lock<std::mutex>	l(mtx_);
+			cv_done_.wait(l, [this](){ return jobs_.front()->ready; });
+			return hand_back(l, 0);
+		}
+
+		// waits for job j and hands it back
+		std::unique_ptr<J> take(const J* j) {
+			std::unique_lock<std::mutex>	l(mtx_);
+			size_t	i = 0;
+			cv_done_.wait(l, [this, j, &i](){ i = find(j); return jobs_[i]->ready; });
+			return hand_back(l, i);
+		}
+
+		// drops job j, waiting for it if running
+		void cancel(const J* j) {
+			std::unique_lock<std::mutex>	l(mtx_);
+			size_t	i = 0;
+			cv_done_.wait(l, [this, j, &i](){ i = find(j); return (i >= next_) || jobs_[i]->ready; });
+			remove(i);
+			l.unlock();
+			cv_work_.notify_all();
+		}
+
+		// hands back the jobs done at the front to on_done,
+		// waiting until no more than max_left are queued
+		void drain(const on_done_t& on_done, const size_t max_left) {
+			std::unique_lock<std::mutex>	l(mtx_);
+			while(true) {
+				cv_done_.wait(l, [this, max_left](){ return (!jobs_.empty() && jobs_.front()->ready) || (jobs_.size() <= max_left); });
+				if(jobs_.empty() || !jobs_.front()->ready)
+					return;
+				std::unique_ptr<J>	j(hand_back(l, 0));
+				on_done(*j);
+				l.lock();
+			}
+		}
+
+		~ordered_pool() {
+			{
+				std::lock_guard<std::mutex>	l(mtx_);
+				quit_ = true;
+			}
+			cv_work_.notify_all();
+			for(auto& t : workers_)
+				t.join();
+		}
+	};
+}
+
+#endif //_ORDERED_POOL_H_
+
@@ -0,0 +1,176 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "patch_chain.h"
+#include "utils.h"
+#include <climits>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+	// patches are read by blocks of this size
+	const size_t	BLOCK_SIZE = 1024*1024;
+
+	// same encoding as bsdiff/bspatch
+	int64_t offtin(const uint8_t *buf) {
+		int64_t	y = buf[7]&0x7F;
+		for(int i = 6; i >= 0; --i)
+			y = y*256 + buf[i];
+		return (buf[7]&0x80) ? -y : y;
+	}
+
+	void read_exact(const fsarchive::patch_chain::reader_t& rd, uint8_t *out, size_t len) {
+		while(len) {
+			const size_t	cur = rd(out, len);
+			if(!cur)
+				throw fsarchive::rt_error("Truncated bsdiff patch");
+			out += cur;
+			len -= cur;
+		}
+	}
+
+	bool all_zeros(const uint8_t *p, const size_t len) {
+		return std::all_of(p, p + len, [](const uint8_t c){ return !c; });
+	}
+}
+
+size_t fsarchive::patch_chain::find_seg(const uint64_t off, const size_t hint) const {
+	// most of the times the data is
+	// accessed sequentially
+	for(size_t i = hint; i < segs_.size() && i < hint + 2; ++i)
+		if(segs_[i].off <= off && off < segs_[i].off + segs_[i].len)
+			return i;
+	const auto	it = std::upper_bound(segs_.begin(), segs_.end(), off, [](const uint64_t o, const seg_t& s){ return o < s.off; });
+	if(segs_.begin() == it)
+		throw fsarchive::rt_error("Invalid patch_chain offset ") << off;
+	return (it - segs_.begin()) - 1;
+}
+
+void fsarchive::patch_chain::push_seg(segs_t& segs, const seg_t& s) {
+	if(!s.len)
+		return;
+	if(!segs.empty()) {
+		seg_t&	l = segs.back();
+		const bool	data_cont = (l.data_off < 0 && s.data_off < 0) || (l.data_off >= 0 && s.data_off >= 0 && (l.data_off + (int64_t)l.len == s.data_off)),
+				base_cont = (l.base_off < 0 && s.base_off < 0) || (l.base_off >= 0 && s.base_off >= 0 && (l.base_off + (int64_t)l.len == s.base_off));
+		if(data_cont && base_cont) {
+			l.len += s.len;
+			return;
+		}
+	}
+	segs.push_back(s);
+}
+
+fsarchive::patch_chain::patch_chain(std::vector<uint8_t>&& base) : base_(std::move(base)), size_(base_.size()) {
+	push_seg(segs_, { .off = 0, .len = size_, .base_off = 0, .data_off = -1 });
+}
+
+void fsarchive::patch_chain::apply(const reader_t& rd, const uint64_t new_sz) {
+	segs_t			n_segs;
+	std::vector<uint8_t>	n_data,
+				buf(std::min((uint64_t)BLOCK_SIZE, new_sz));
+	uint64_t		newpos = 0;
+	int64_t			oldpos = 0;
+	size_t			hint = 0;
+	// appends n bytes being a + d (a can be null)
+	auto fn_push_data = [&](const int64_t base_off, const uint8_t *a, const uint8_t *d, const size_t n) -> void {
+		const size_t	cur = n_data.size();
+		n_data.resize(cur + n);
+		for(size_t i = 0; i < n; ++i)
+			n_data[cur + i] = ((a) ? a[i] : 0) + d[i];
+		push_seg(n_segs, { .off = newpos, .len = n, .base_off = base_off, .data_off = (int64_t)cur });
+		newpos += n;
+	};
+	while(newpos < new_sz) {
+		uint8_t	ctrl_buf[24];
+		read_exact(rd, ctrl_buf, sizeof(ctrl_buf));
+		const int64_t	ctrl[3] = { offtin(ctrl_buf), offtin(ctrl_buf + 8), offtin(ctrl_buf + 16) };
+		if(ctrl[0] < 0 || ctrl[0] > INT_MAX || ctrl[1] < 0 || ctrl[1] > INT_MAX || newpos + ctrl[0] > new_sz)
+			throw fsarchive::rt_error("Invalid bsdiff patch control data");
+		// the diff bytes are added to the previous
+		// version, which is made of segments
+		for(int64_t left = ctrl[0]; left; ) {
+			const size_t	b = std::min((int64_t)buf.size(), left);
+			read_exact(rd, buf.data(), b);
+			for(size_t i = 0; i < b; ) {
+				const int64_t	op = oldpos + i;
+				size_t		n = 0;
+				if(op < 0 || (uint64_t)op >= size_) {
+					// outside of the previous version
+					n = (op < 0) ? std::min((uint64_t)(b - i), (uint64_t)-op) : b - i;
+					fn_push_data(-1, 0, buf.data() + i, n);
+				} else {
+					hint = find_seg(op, hint);
+					const seg_t&	s = segs_[hint];
+					const uint64_t	rel = op - s.off;
+					n = std::min((uint64_t)(b - i), s.len - rel);
+					const uint8_t	*a = (s.data_off < 0) ? 0 : data_.data() + s.data_off + rel;
+					if(s.base_off >= 0 && !a && all_zeros(buf.data() + i, n)) {
+						push_seg(n_segs, { .off = newpos, .len = n, .base_off = s.base_off + (int64_t)rel, .data_off = -1 });
+						newpos += n;
+					} else {
+						fn_push_data((s.base_off < 0) ? -1 : s.base_off + rel, a, buf.data() + i, n);
+					}
+				}
+				i += n;
+			}
+			oldpos += b;
+			left -= b;
+		}
+		if(newpos + ctrl[1] > new_sz)
+			throw fsarchive::rt_error("Invalid bsdiff patch control data");
+		// the extra bytes are literals
+		for(int64_t left = ctrl[1]; left; ) {
+			const size_t	b = std::min((int64_t)buf.size(), left);
+			read_exact(rd, buf.data(), b);
+			fn_push_data(-1, 0, buf.data(), b);
+			left -= b;
+		}
+		oldpos += ctrl[2];
+	}
+	n_data.shrink_to_fit();
+	segs_.swap(n_segs);
+	data_.swap(n_data);
+	size_ = new_sz;
+}
+
+size_t fsarchive::patch_chain::read(const uint64_t off, uint8_t *out, const size_t len) const {
+	if(off >= size_)
+		return 0;
+	const size_t	rv = std::min((uint64_t)len, size_ - off);
+	size_t		idx = find_seg(off, 0),
+			done = 0;
+	for(; done < rv; ++idx) {
+		const seg_t&	s = segs_[idx];
+		const uint64_t	rel = off + done - s.off;
+		const size_t	n = std::min((uint64_t)(rv - done), s.len - rel);
+		if(s.base_off < 0) {
+			memcpy(out + done, data_.data() + s.data_off + rel, n);
+		} else {
+			memcpy(out + done, base_.data() + s.base_off + rel, n);
+			if(s.data_off >= 0) {
+				const uint8_t	*a = data_.data() + s.data_off + rel;
+				for(size_t i = 0; i < n; ++i)
+					out[done + i] += a[i];
+			}
+		}
+		done += n;
+	}
+	return rv;
+}
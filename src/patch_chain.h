@@ -0,0 +1,94 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PATCH_CHAIN_H_
+#define _PATCH_CHAIN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <functional>
+
+namespace fsarchive {
+	// Composes a chain of bsdiff patches on top of a base
+	// version of a file, without rebuilding the intermediate
+	// versions: each version is kept as a list of segments,
+	// either literal bytes or ranges of the base with the
+	// bytes to be added to them (when not all zeros), and
+	// applying a patch maps its control stream onto the
+	// segments of the previous version.
+	// Hence memory usage depends on the size of the versions
+	// (base plus two lists of segments) and not on the length
+	// of the chain, and the final version is produced in a
+	// single pass over the base
+	class patch_chain {
+	public:
+		// reads up to len bytes of a patch, returns
+		// the bytes read, 0 once it is over
+		typedef std::function<size_t(uint8_t*, size_t)>	reader_t;
+	private:
+		typedef struct {
+			// offset in the version
+			uint64_t	off,
+					len;
+			// offset in the base, -1 for literal bytes
+			int64_t		base_off;
+			// offset of the literal/added bytes in
+			// data_, -1 when there are none
+			int64_t		data_off;
+		} seg_t;
+
+		typedef std::vector<seg_t>	segs_t;
+
+		const std::vector<uint8_t>	base_;
+		segs_t				segs_;
+		std::vector<uint8_t>		data_;
+		uint64_t			size_;
+
+		patch_chain();
+		patch_chain(const patch_chain&);
+		patch_chain& operator=(const patch_chain&);
+
+		// returns the index of the segment holding
+		// offset off, starting the search from hint
+		size_t find_seg(const uint64_t off, const size_t hint) const;
+
+		// appends s to segs, merging it with the last
+		// segment when contiguous
+		static void push_seg(segs_t& segs, const seg_t& s);
+	public:
+		patch_chain(std::vector<uint8_t>&& base);
+
+		// applies the bsdiff patch read through rd to the
+		// current version, producing one of new_sz bytes
+		// throws if the patch is invalid
+		void apply(const reader_t& rd, const uint64_t new_sz);
+
+		uint64_t size(void) const {
+			return size_;
+		}
+
+		// copies up to len bytes of the current version
+		// from offset off, returns the bytes copied
+		size_t read(const uint64_t off, uint8_t *out, const size_t len) const;
+	};
+}
+
+#endif //_PATCH_CHAIN_H_
+
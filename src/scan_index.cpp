@@ -0,0 +1,242 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "scan_index.h"
+#include "utils.h"
+#include "log.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace {
+	const char	SCAN_INDEX_MAGIC[8] = { 'F', 'S', 'A', 'S', 'I', 'D', 'X', '1' };
+
+	typedef struct {
+		char		magic[8];
+		uint64_t	cfg,
+				n_dirs;
+		uint32_t	archive_sz;
+	} __attribute__((packed)) header_t;
+
+	typedef struct {
+		fsarchive::scan_index::meta_t	m;
+		uint64_t			fp,
+						n_entries;
+		uint32_t			path_sz;
+		uint8_t				trusted;
+	} __attribute__((packed)) dir_header_t;
+
+	void write_data(std::ofstream& ostr, const void* data, const size_t sz) {
+		ostr.write((const char*)data, sz);
+	}
+
+	void read_data(std::ifstream& istr, void* data, const size_t sz) {
+		istr.read((char*)data, sz);
+		if((size_t)istr.gcount() != sz)
+			throw fsarchive::rt_error("Truncated scan index");
+	}
+
+	void read_string(std::ifstream& istr, std::string& s, const size_t sz) {
+		if(sz > 64*1024)
+			throw fsarchive::rt_error("Invalid scan index string size ") << sz;
+		s.resize(sz);
+		read_data(istr, &s[0], sz);
+	}
+}
+
+fsarchive::scan_index::scan_index() {
+}
+
+fsarchive::scan_index::meta_t fsarchive::scan_index::to_meta(const struct stat64& s) {
+	meta_t	m = {0};
+	m.ino = s.st_ino;
+	m.size = s.st_size;
+	m.atime_s = s.st_atim.tv_sec;
+	m.mtime_s = s.st_mtim.tv_sec;
+	m.ctime_s = s.st_ctim.tv_sec;
+	m.atime_ns = s.st_atim.tv_nsec;
+	m.mtime_ns = s.st_mtim.tv_nsec;
+	m.ctime_ns = s.st_ctim.tv_nsec;
+	m.mode = s.st_mode;
+	m.uid = s.st_uid;
+	m.gid = s.st_gid;
+	return m;
+}
+
+void fsarchive::scan_index::from_meta(const meta_t& m, struct stat64& s) {
+	memset(&s, 0, sizeof(s));
+	s.st_ino = m.ino;
+	s.st_size = m.size;
+	s.st_atim.tv_sec = m.atime_s;
+	s.st_mtim.tv_sec = m.mtime_s;
+	s.st_ctim.tv_sec = m.ctime_s;
+	s.st_atim.tv_nsec = m.atime_ns;
+	s.st_mtim.tv_nsec = m.mtime_ns;
+	s.st_ctim.tv_nsec = m.ctime_ns;
+	s.st_mode = m.mode;
+	s.st_uid = m.uid;
+	s.st_gid = m.gid;
+}
+
+uint64_t fsarchive::scan_index::hash(const void* data, const size_t sz, uint64_t h) {
+	const uint8_t	*p = (const uint8_t*)data;
+	for(size_t i = 0; i < sz; ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+uint64_t fsarchive::scan_index::fingerprint(const std::string& path, const dir_t& d) const {
+	uint64_t	h = hash(&d.m, sizeof(d.m));
+	for(const auto& e : d.entries) {
+		h = hash(e.name.c_str(), e.name.size() + 1, h);
+		h = hash(&e.m, sizeof(e.m), h);
+		if(!S_ISDIR(e.m.mode))
+			continue;
+		// subdirectories have been added already, unless
+		// these couldn't be read (or were excluded)
+		const auto	it = idx_.find(combine_paths(path, e.name));
+		const uint64_t	fp = (idx_.end() != it) ? dirs_[it->second].second.fp : 0;
+		h = hash(&fp, sizeof(fp), h);
+	}
+	return h;
+}
+
+const fsarchive::scan_index::dir_t* fsarchive::scan_index::find(const std::string& path, const struct stat64& s) const {
+	const auto	it = idx_.find(path);
+	if(idx_.end() == it)
+		return 0;
+	const dir_t&	d = dirs_[it->second].second;
+	if(!d.trusted || (d.m.ino != (uint64_t)s.st_ino) ||
+	   (d.m.mtime_s != s.st_mtim.tv_sec) || (d.m.mtime_ns != (uint32_t)s.st_mtim.tv_nsec) ||
+	   (d.m.ctime_s != s.st_ctim.tv_sec) || (d.m.ctime_ns != (uint32_t)s.st_ctim.tv_nsec))
+		return 0;
+	return &d;
+}
+
+void fsarchive::scan_index::add(const std::string& path, const struct stat64& s, std::vector<entry_t>&& entries, const time_t scan_start) {
+	dir_t	d;
+	d.m = to_meta(s);
+	// only the fields of the directory which tell us
+	// whether its entries have changed
+	d.m.size = d.m.atime_s = d.m.atime_ns = 0;
+	d.trusted = (d.m.mtime_s < scan_start) && (d.m.ctime_s < scan_start);
+	d.entries.swap(entries);
+	for(auto& e : d.entries) {
+		if(S_ISDIR(e.m.mode)) {
+			const uint32_t	mode = e.m.mode;
+			e.m = meta_t{0};
+			e.m.mode = mode;
+		} else if(e.m.ctime_s >= scan_start) {
+			// may have been changed after being lstat'ed
+			d.trusted = false;
+		}
+	}
+	d.fp = fingerprint(path, d);
+	idx_[path] = dirs_.size();
+	dirs_.push_back(std::make_pair(path, std::move(d)));
+}
+
+bool fsarchive::scan_index::load(const std::string& path, const std::string& archive, const uint64_t cfg) {
+	dirs_.clear();
+	idx_.clear();
+	std::ifstream	istr(path, std::ios_base::binary);
+	if(!istr)
+		return false;
+	try {
+		header_t	h;
+		read_data(istr, &h, sizeof(h));
+		if(memcmp(h.magic, SCAN_INDEX_MAGIC, sizeof(SCAN_INDEX_MAGIC)))
+			throw fsarchive::rt_error("Invalid scan index magic");
+		std::string	ar;
+		read_string(istr, ar, h.archive_sz);
+		if((ar != archive) || (h.cfg != cfg)) {
+			LOG_INFO << "Scan index " << path << " has been built for " << ar << " or with different exclusions, ignored";
+			return false;
+		}
+		size_t	n_untrusted = 0;
+		dirs_.reserve(h.n_dirs);
+		for(uint64_t i = 0; i < h.n_dirs; ++i) {
+			dir_header_t	dh;
+			read_data(istr, &dh, sizeof(dh));
+			std::string	d_path;
+			read_string(istr, d_path, dh.path_sz);
+			dir_t	d;
+			d.m = dh.m;
+			d.fp = dh.fp;
+			d.trusted = dh.trusted;
+			d.entries.resize(dh.n_entries);
+			for(auto& e : d.entries) {
+				uint32_t	name_sz = 0;
+				read_data(istr, &name_sz, sizeof(name_sz));
+				read_string(istr, e.name, name_sz);
+				read_data(istr, &e.m, sizeof(e.m));
+			}
+			// don't trust what has been corrupted
+			if(d.trusted && (d.fp != fingerprint(d_path, d))) {
+				d.trusted = false;
+				++n_untrusted;
+			}
+			idx_[d_path] = dirs_.size();
+			dirs_.push_back(std::make_pair(std::move(d_path), std::move(d)));
+		}
+		if(n_untrusted)
+			LOG_WARNING << "Scan index " << path << " has " << n_untrusted << " directories not matching their fingerprint, these will be rescanned";
+	} catch(const std::exception& e) {
+		LOG_WARNING << "Can't load scan index " << path << ": " << e.what();
+		dirs_.clear();
+		idx_.clear();
+		return false;
+	}
+	return true;
+}
+
+void fsarchive::scan_index::save(const std::string& path, const std::string& archive, const uint64_t cfg) const {
+	const std::string	tmp_path = path + ".tmp";
+	{
+		std::ofstream	ostr(tmp_path, std::ios_base::binary|std::ios_base::trunc);
+		if(!ostr)
+			throw fsarchive::rt_error("Can't open scan index ") << tmp_path << " for writing";
+		header_t	h;
+		memcpy(h.magic, SCAN_INDEX_MAGIC, sizeof(SCAN_INDEX_MAGIC));
+		h.cfg = cfg;
+		h.n_dirs = dirs_.size();
+		h.archive_sz = archive.size();
+		write_data(ostr, &h, sizeof(h));
+		write_data(ostr, archive.c_str(), archive.size());
+		for(const auto& d : dirs_) {
+			const dir_header_t	dh = { .m = d.second.m, .fp = d.second.fp, .n_entries = d.second.entries.size(), .path_sz = (uint32_t)d.first.size(), .trusted = d.second.trusted };
+			write_data(ostr, &dh, sizeof(dh));
+			write_data(ostr, d.first.c_str(), d.first.size());
+			for(const auto& e : d.second.entries) {
+				const uint32_t	name_sz = e.name.size();
+				write_data(ostr, &name_sz, sizeof(name_sz));
+				write_data(ostr, e.name.c_str(), e.name.size());
+				write_data(ostr, &e.m, sizeof(e.m));
+			}
+		}
+		ostr.flush();
+		if(!ostr)
+			throw fsarchive::rt_error("Can't write scan index ") << tmp_path;
+	}
+	if(rename(tmp_path.c_str(), path.c_str()))
+		throw fsarchive::rt_error("Can't rename scan index ") << tmp_path << " to " << path;
+}
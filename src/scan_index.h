@@ -0,0 +1,121 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _SCAN_INDEX_H_
+#define _SCAN_INDEX_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace fsarchive {
+	// Sidecar index (see --scan-index) of the directories found
+	// while building an archive: for each directory its inode,
+	// mtime and ctime, its regular files (with their metadata)
+	// and subdirectories, and a fingerprint rolled up from the
+	// metadata of the whole subtree.
+	// A directory whose inode, mtime and ctime haven't changed
+	// since the index of the latest archive has had no entries
+	// added, removed or renamed, hence its files can be taken
+	// from the index rather than being lstat'ed again. Note that
+	// writing a file in place doesn't change the mtime of its
+	// directory, hence such changes are missed (see --full-rescan).
+	// Once loaded, find can be used by multiple threads
+	class scan_index {
+	public:
+		typedef struct {
+			uint64_t	ino;
+			int64_t		size,
+					atime_s,
+					mtime_s,
+					ctime_s;
+			uint32_t	atime_ns,
+					mtime_ns,
+					ctime_ns,
+					mode,
+					uid,
+					gid;
+		} meta_t;
+
+		typedef struct {
+			std::string	name;
+			// only the mode is set for directories,
+			// these are lstat'ed anyway
+			meta_t		m;
+		} entry_t;
+
+		typedef struct {
+			meta_t			m;
+			// of the entries and the subdirectories'
+			uint64_t		fp;
+			// false when the directory could have been
+			// changed while being scanned, or when the
+			// fingerprint doesn't match upon load
+			bool			trusted;
+			std::vector<entry_t>	entries;
+		} dir_t;
+	private:
+		// in the order added, subdirectories first
+		std::vector<std::pair<std::string, dir_t>>	dirs_;
+		std::unordered_map<std::string, size_t>		idx_;
+
+		scan_index(const scan_index&);
+		scan_index& operator=(const scan_index&);
+
+		uint64_t fingerprint(const std::string& path, const dir_t& d) const;
+	public:
+		scan_index();
+
+		static meta_t to_meta(const struct stat64& s);
+
+		static void from_meta(const meta_t& m, struct stat64& s);
+
+		// FNV-1a
+		static uint64_t hash(const void* data, const size_t sz, uint64_t h = 0xcbf29ce484222325ULL);
+
+		// returns the directory at path if it can be
+		// trusted and s matches its inode, mtime and
+		// ctime, null otherwise
+		const dir_t* find(const std::string& path, const struct stat64& s) const;
+
+		// adds the directory at path (with metadata s), to be
+		// called after all its subdirectories have been added;
+		// directories changed from scan_start on can't be trusted
+		void add(const std::string& path, const struct stat64& s, std::vector<entry_t>&& entries, const time_t scan_start);
+
+		size_t size(void) const {
+			return dirs_.size();
+		}
+
+		// loads the index at path, returns false if it doesn't
+		// exist, is invalid or hasn't been built for archive
+		// with the same configuration (cfg) of the scan
+		bool load(const std::string& path, const std::string& archive, const uint64_t cfg);
+
+		// atomically replaces the index at path
+		void save(const std::string& path, const std::string& archive, const uint64_t cfg) const;
+	};
+}
+
+#endif //_SCAN_INDEX_H_
+
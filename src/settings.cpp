@@ -21,6 +21,8 @@
 #include <getopt.h>
 #include <cstring>
 #include <stdexcept>
+#include <thread>
+#include <unistd.h>
 #include "settings.h"
 #include "utils.h"
 #include "log.h"
@@ -47,6 +49,34 @@ namespace {
 		"*.rar"
 	};
 
+	int64_t half_phys_mem(void) {
+		const int64_t	rv = (int64_t)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE)/2;
+		return (rv > 0) ? rv : 1024*1024*1024;
+	}
+
+	// parses a positive size in bytes with optional
+	// k, m or g suffixes, returns -1 if invalid
+	int64_t parse_size(const char *arg) {
+		char	*ptrend = 0;
+		int64_t	rv = strtol(arg, &ptrend, 10);
+		if(*ptrend) {
+			const char	unit = tolower(*ptrend);
+			switch(unit) {
+				case 'g':
+					rv *= 1024;
+				case 'm':
+					rv *= 1024;
+				case 'k':
+					rv *= 1024;
+					break;
+				default:
+					rv = -1;
+					break;
+			}
+		}
+		return (rv <= 0) ? -1 : rv;
+	}
+
 	// settings/options management
 	void print_help(const char *prog, const char *version) {
 		using namespace fsarchive::settings;
@@ -56,8 +86,11 @@ namespace {
 				"-a, --archive (dir)     Archives all input files (dir1, dir2, ...) and directories inside\n"
 				"                        (dir)/fsarchive_<timestamp>.zip and/or updates existing archives generating a new\n"
 			        "                        and/or delta (dir)/fsarchive_<timestamp>.zip\n"
-				"    --comp-level (l)    Sets the compression level to (l) (from 1 to 9) where 1 is fastest and 9 is best.\n"
-				"                        0 is default\n"
+				"    --comp-level (l)    Sets the compression level to (l) (from 1 to 9, 19 for zstd) where 1 is fastest and\n"
+				"                        9 (19) is best. 0 is default\n"
+				"    --codec (c)[:(l)]   Sets the compression method (c) to be used, optionally with level (l); currently\n"
+				"                        supported are 'deflate' (default) and 'zstd' (requires libzip to be built with it)\n"
+				"                        Archives are restored with whatever method they have been created\n"
 				"-f, --comp-filter (f)   Excludes files from being compresses; this option follows same format as -x option\n"
 				"                        and can be repeated multiple times; files matching such expressions won't be compressed\n"
 				"                        Files that are excluded from compression are also excluded from bsdiff deltas\n"
@@ -65,11 +98,27 @@ namespace {
 		for(const auto& x : builtin_nocomp) {
 			std::cerr << "                        " << x << "\n";
 		}
-		std::cerr <<	"    --no-comp           Flag to create zip files without any compression - default off\n"
+		std::cerr <<	"    --auto-nocomp       Flag to sample the data of each file and not compress the ones which look already\n"
+				"                        compressed or encrypted; as per -f option, these are also excluded from bsdiff deltas\n"
+				"    --no-comp           Flag to create zip files without any compression - default off\n"
 				"    --force-new-arc     Flag to force the creation of a new archive (-a option) even if a previous already\n"
 				"                        exists (i.e. no delta archive would be created)\n"
 				"-b, --use-bsdiff        When creating delta archives do store file differences as bsdiff/bspatch data\n"
 				"                        Please note this may be rather slow and memory hungry\n"
+				"    --bsdiff-threads (n) Sets the number of threads (n) computing bsdiff deltas at the same time; 0 uses\n"
+				"                        all the available cores, which is the default\n"
+				"    --bsdiff-mem (sz)   Sets the maximum amount of memory (sz) the bsdiff deltas being computed, or waiting\n"
+				"                        to be written to the archive, can use (estimated from the file sizes); can have\n"
+				"                        suffixes such as k, m and g, default is half of the physical memory\n"
+				"    --bsdiff-window (sz) Files larger than (sz) are diffed by windows of (sz) bytes, each against the same\n"
+				"                        range of the previous version (plus a quarter of (sz) on each side), so that very\n"
+				"                        large files can be diffed in bounded memory; can have suffixes such as k, m and g,\n"
+				"                        default is 64m\n"
+				"    --cdc               When creating delta archives, store the modified files larger than --cdc-min-size\n"
+				"                        as chunks with content defined boundaries (CDC), only the chunks not found in the\n"
+				"                        previous version being stored; this is used in place of bsdiff for such files\n"
+				"    --cdc-min-size (sz) With --cdc, minimum size (sz) of the files to be chunked; can have suffixes such\n"
+				"                        as k, m and g, default is 64m\n"
 				"-x, --exclude (str)     Excludes from archiving all the files/directories which match (str); if you want\n"
 				"                        to have a 'contain' search, do specify the \"*(str)*\" pattern (i.e. -x \"*abc*\"\n"
 				"                        will exclude all the files/dirs which contain the sequence 'abc').\n"
@@ -89,14 +138,59 @@ namespace {
 		std::cerr <<	"    --crc32-check       When creating delta archives, use CRC32 to establish if a file has changed, otherwise\n"
 				"                        only size and last modified timestamp will be used; the latter (no CRC32 check) is\n"
 				"                        default behaviour\n"
+				"    --crc32-threads (n) Sets the number of threads (n) reading the files to CRC32 check at the same time; 0\n"
+				"                        uses all the available cores, which is the default\n"
+				"    --scan-threads (n)  Sets the number of threads (n) used to scan the input directories; directories are\n"
+				"                        read in parallel but files are still processed in the same order. 0 uses all\n"
+				"                        the available cores, default is 1\n"
+				"    --scan-index        Keeps an index of the scanned directories next to the archives (fsarc_scan.idx)\n"
+				"                        and, when building a delta archive, takes the files of the directories\n"
+				"                        whose inode, mtime and ctime haven't changed from it rather than lstat'ing\n"
+				"                        them; note that files written in place don't change the mtime of their\n"
+				"                        directory, hence aren't spotted until --full-rescan is used\n"
+				"    --full-rescan       With --scan-index, lstat all the files regardless of the index, which is\n"
+				"                        then rebuilt\n"
+				"    --catalog           Adds to the archives a last entry (.fsarc_catalog) with the metadata of all the\n"
+				"                        others, so that opening them doesn't read every entry; note that versions of\n"
+				"                        fsarchive without the catalog can't read such archives\n"
+				"    --dedup             Keeps the SHA-256 of the files stored next to the archives (fsarc_dedup.idx) and\n"
+				"                        stores new files with the same content of one already archived as a reference to\n"
+				"                        it (DUP); note that new files are read once more to be hashed\n"
+				"    --dedup-min-size (sz) With --dedup, files smaller than (sz) are always stored; can have suffixes\n"
+				"                        such as k, m and g, default is 64k\n"
+				"    --dedup-threads (n) Sets the number of threads (n) hashing the files at the same time; 0 uses all\n"
+				"                        the available cores, which is the default\n"
+				"    --pipe-threads (n)  Sets the number of threads (n) reading ahead and compressing the files to be archived\n"
+				"                        while the archive is being written; 0 disables it and lets libzip read and compress\n"
+				"                        on a single thread, default is the number of available cores\n"
+				"    --pipe-mem (sz)     Sets the maximum amount of memory (sz) used to hold the files read ahead; can\n"
+				"                        have suffixes such as k, m and g, default is 256m\n"
 				"\nRestore options\n\n"
 				"-r, --restore (arc)     Restores files from archive (arc) into current dir or ablsolute path if stored so\n"
 				"                        Specify -d to allow another directory to be the target destination for the restore\n"
 				"-d, --restore-dir (dir) Sets the restore directory to this location\n"
 				"    --no-metadata       Do not restore metadata (file/dir ownership, permission and times)\n"
+				"    --restore-threads (n) Sets the number of threads (n) rebuilding files at the same time, each with its own\n"
+				"                        archive handles; the data is written to disk by a separate pool of threads. 0 uses\n"
+				"                        all the available cores, which is the default\n"
+				"\nConsolidate options\n\n"
+				"    --consolidate (dir) Writes a new archive (dir)/fsarchive_<timestamp>.zip with all the files of the latest\n"
+				"                        archive in (dir) stored in full, so that it doesn't depend on any previous archive\n"
+				"                        and the following delta archives are based on it; the files stored in full\n"
+				"                        already are copied as they are (not recompressed), the others rebuilt once.\n"
+				"                        The archived directories are not read\n"
 				"\nGeneric options\n\n"
 				"-v, --verbose           Set log to maximum level\n"
 				"    --dry-run           Flag to execute the command as indicated without writing/amending any file/metadata\n"
+				"    --cache-mem (sz)    Sets the maximum amount of memory (sz) used to cache the files rebuilt from bsdiff\n"
+				"                        patches which are needed again (i.e. CRC32 checks), the others are streamed; can\n"
+				"                        have suffixes such as k, m and g, default is 256m\n"
+				"    --zip-cache (n)     Sets the maximum number of previous archives (n) kept open by each thread to rebuild\n"
+				"                        files, the least recently used ones are closed first; default is 64\n"
+				"    --zip-cache-mem (sz) Sets the maximum amount of memory (sz), estimated from their number of entries, the\n"
+				"                        previous archives kept open by each thread can use; the entries of an archive open\n"
+				"                        in multiple threads are kept once, counted by the first thread opening it; can\n"
+				"                        have suffixes such as k, m and g, default is 512m\n"
 				"    --help              Prints this help and exit\n\n"
 		<< std::flush;
 	}
@@ -107,17 +201,38 @@ namespace fsarchive {
 		int		AR_ACTION = A_NONE;
 		std::string	AR_DIR = "";
 		int		AR_COMP_LEVEL = 0;
+		int		AR_CODEC = C_DEFLATE;
 		bool		AR_FORCE_NEW = false;
 		excllist_t	AR_EXCLUSIONS;
 		int64_t		AR_SZ_FILTER = -1;
 		bool		AR_USE_BSDIFF = false;
+		int		AR_BSDIFF_THREADS = std::thread::hardware_concurrency();
+		int64_t		AR_BSDIFF_MEM = half_phys_mem();
+		int64_t		AR_BSDIFF_WINDOW = 64*1024*1024;
 		bool		AR_COMPRESS = true;
 		excllist_t	AR_COMP_FILTER;
+		bool		AR_AUTO_NOCOMP = false;
 		std::string	RE_FILE = "";
 		std::string	RE_DIR = "";
 		bool		RE_METADATA = true;
+		int		RE_THREADS = std::thread::hardware_concurrency();
 		bool		DRY_RUN = false;
 		bool		CRC32_CHECK = false;
+		int		CRC32_THREADS = std::thread::hardware_concurrency();
+		int64_t		CACHE_MEM = 256*1024*1024;
+		int		ZIP_CACHE_COUNT = 64;
+		int64_t		ZIP_CACHE_MEM = 512*1024*1024;
+		int		AR_SCAN_THREADS = 1;
+		bool		AR_SCAN_INDEX = false;
+		bool		AR_FULL_RESCAN = false;
+		bool		AR_CATALOG = false;
+		bool		AR_DEDUP = false;
+		int64_t		AR_DEDUP_MIN_SIZE = 64*1024;
+		int		AR_DEDUP_THREADS = std::thread::hardware_concurrency();
+		bool		AR_CDC = false;
+		int64_t		AR_CDC_MIN_SIZE = 64*1024*1024;
+		int		AR_PIPE_THREADS = std::thread::hardware_concurrency();
+		int64_t		AR_PIPE_MEM = 256*1024*1024;
 	}
 }
 
@@ -130,7 +245,13 @@ int fsarchive::parse_args(int argc, char *argv[], const char *prog, const char *
 		{"archive",	required_argument, 0,	'a'},
 		{"restore",	required_argument, 0,	'r'},
 		{"restore-dir",	required_argument, 0,	'd'},
+		{"consolidate",	required_argument, 0,	0},
+		{"restore-threads", required_argument, 0, 0},
+		{"cache-mem",	required_argument, 0,	0},
+		{"zip-cache",	required_argument, 0,	0},
+		{"zip-cache-mem", required_argument, 0,	0},
 		{"comp-level",	required_argument, 0,	0},
+		{"codec",	required_argument, 0,	0},
 		{"force-new-arc",no_argument,	   0,	0},
 		{"exclude",	required_argument, 0,	'x'},
 		{"size-filter",	required_argument, 0,	0},
@@ -138,11 +259,27 @@ int fsarchive::parse_args(int argc, char *argv[], const char *prog, const char *
 		{"no-metadata",	no_argument,	   0,	0},
 		{"dry-run",	no_argument,	   0,	0},
 		{"use-bsdiff",	no_argument,	   0,	'b'},
+		{"bsdiff-threads", required_argument, 0, 0},
+		{"bsdiff-mem",	required_argument, 0,	0},
+		{"bsdiff-window", required_argument, 0,	0},
 		{"verbose",	no_argument,	   0,	'v'},
 		{"no-comp", 	no_argument,	   0,	0},
 		{"comp-filter", required_argument, 0,	'f'},
 		{"builtin-nocomp", no_argument,	   0,	'F'},
+		{"auto-nocomp", no_argument,	   0,	0},
 		{"crc32-check", no_argument,	   0,	0},
+		{"crc32-threads", required_argument, 0,	0},
+		{"scan-threads", required_argument, 0,	0},
+		{"scan-index",	no_argument,	   0,	0},
+		{"full-rescan",	no_argument,	   0,	0},
+		{"catalog",	no_argument,	   0,	0},
+		{"dedup",	no_argument,	   0,	0},
+		{"dedup-min-size", required_argument, 0, 0},
+		{"dedup-threads", required_argument, 0,	0},
+		{"cdc",		no_argument,	   0,	0},
+		{"cdc-min-size", required_argument, 0,	0},
+		{"pipe-threads", required_argument, 0,	0},
+		{"pipe-mem",	required_argument, 0,	0},
 		{0, 0, 0, 0}
 	};
 	
@@ -161,31 +298,28 @@ int fsarchive::parse_args(int argc, char *argv[], const char *prog, const char *
 			if(!std::strcmp("help", long_options[option_index].name)) {
 				print_help(prog, version);
 				std::exit(0);
+			} else if(!std::strcmp("consolidate", long_options[option_index].name)) {
+				AR_DIR = optarg;
+				if(AR_ACTION != A_NONE)
+					throw fsarchive::rt_error("Invalid combination of --consolidate and -a/-r options");
+				AR_ACTION = A_CONSOLIDATE;
 			} else if(!std::strcmp("comp-level", long_options[option_index].name)) {
 				AR_COMP_LEVEL = std::atoi(optarg);
-				if(AR_COMP_LEVEL < 0 || AR_COMP_LEVEL > 9)
-					AR_COMP_LEVEL = 0;
+			} else if(!std::strcmp("codec", long_options[option_index].name)) {
+				const char	*p_level = std::strchr(optarg, ':');
+				const std::string	codec(optarg, (p_level) ? p_level - optarg : std::strlen(optarg));
+				if(codec == "deflate")
+					AR_CODEC = C_DEFLATE;
+				else if(codec == "zstd")
+					AR_CODEC = C_ZSTD;
+				else
+					throw fsarchive::rt_error("Invalid codec provided: ") << optarg;
+				if(p_level)
+					AR_COMP_LEVEL = std::atoi(p_level + 1);
 			} else if(!std::strcmp("force-new-arc", long_options[option_index].name)) {
 				AR_FORCE_NEW = true;
 			} else if(!std::strcmp("size-filter", long_options[option_index].name)) {
-				char	*ptrend = 0;
-				AR_SZ_FILTER = strtol(optarg, &ptrend, 10);
-				if(*ptrend) {
-					const char	unit = tolower(*ptrend);
-					switch(unit) {
-						case 'g':
-							AR_SZ_FILTER *= 1024;
-						case 'm':
-							AR_SZ_FILTER *= 1024;
-						case 'k':
-							AR_SZ_FILTER *= 1024;
-							break;
-						default:
-							// fall through and throw exception
-							AR_SZ_FILTER = -1;
-							break;
-					}
-				}
+				AR_SZ_FILTER = parse_size(optarg);
 				if(AR_SZ_FILTER <= 0)
 					throw fsarchive::rt_error("Invalid size filter provided: ") << optarg;
 			} else if(!std::strcmp("no-metadata", long_options[option_index].name)) {
@@ -194,8 +328,78 @@ int fsarchive::parse_args(int argc, char *argv[], const char *prog, const char *
 				DRY_RUN = true;
 			} else if(!std::strcmp("no-comp", long_options[option_index].name)) {
 				AR_COMPRESS = false;
+			} else if(!std::strcmp("auto-nocomp", long_options[option_index].name)) {
+				AR_AUTO_NOCOMP = true;
 			} else if(!std::strcmp("crc32-check", long_options[option_index].name)) {
 				CRC32_CHECK = true;
+			} else if(!std::strcmp("crc32-threads", long_options[option_index].name)) {
+				CRC32_THREADS = std::atoi(optarg);
+				if(CRC32_THREADS <= 0)
+					CRC32_THREADS = std::thread::hardware_concurrency();
+			} else if(!std::strcmp("scan-index", long_options[option_index].name)) {
+				AR_SCAN_INDEX = true;
+			} else if(!std::strcmp("full-rescan", long_options[option_index].name)) {
+				AR_FULL_RESCAN = true;
+			} else if(!std::strcmp("catalog", long_options[option_index].name)) {
+				AR_CATALOG = true;
+			} else if(!std::strcmp("dedup", long_options[option_index].name)) {
+				AR_DEDUP = true;
+			} else if(!std::strcmp("dedup-min-size", long_options[option_index].name)) {
+				AR_DEDUP_MIN_SIZE = parse_size(optarg);
+				if(AR_DEDUP_MIN_SIZE <= 0)
+					throw fsarchive::rt_error("Invalid dedup minimum size provided: ") << optarg;
+			} else if(!std::strcmp("dedup-threads", long_options[option_index].name)) {
+				AR_DEDUP_THREADS = std::atoi(optarg);
+				if(AR_DEDUP_THREADS <= 0)
+					AR_DEDUP_THREADS = std::thread::hardware_concurrency();
+			} else if(!std::strcmp("cdc", long_options[option_index].name)) {
+				AR_CDC = true;
+			} else if(!std::strcmp("cdc-min-size", long_options[option_index].name)) {
+				AR_CDC_MIN_SIZE = parse_size(optarg);
+				if(AR_CDC_MIN_SIZE <= 0)
+					throw fsarchive::rt_error("Invalid CDC minimum size provided: ") << optarg;
+			} else if(!std::strcmp("scan-threads", long_options[option_index].name)) {
+				AR_SCAN_THREADS = std::atoi(optarg);
+				if(AR_SCAN_THREADS <= 0)
+					AR_SCAN_THREADS = std::thread::hardware_concurrency();
+				if(AR_SCAN_THREADS <= 0)
+					AR_SCAN_THREADS = 1;
+			} else if(!std::strcmp("pipe-threads", long_options[option_index].name)) {
+				AR_PIPE_THREADS = std::atoi(optarg);
+				if(AR_PIPE_THREADS < 0)
+					AR_PIPE_THREADS = 0;
+			} else if(!std::strcmp("bsdiff-threads", long_options[option_index].name)) {
+				AR_BSDIFF_THREADS = std::atoi(optarg);
+				if(AR_BSDIFF_THREADS <= 0)
+					AR_BSDIFF_THREADS = std::thread::hardware_concurrency();
+			} else if(!std::strcmp("bsdiff-mem", long_options[option_index].name)) {
+				AR_BSDIFF_MEM = parse_size(optarg);
+				if(AR_BSDIFF_MEM <= 0)
+					throw fsarchive::rt_error("Invalid bsdiff memory provided: ") << optarg;
+			} else if(!std::strcmp("bsdiff-window", long_options[option_index].name)) {
+				AR_BSDIFF_WINDOW = parse_size(optarg);
+				if(AR_BSDIFF_WINDOW <= 0)
+					throw fsarchive::rt_error("Invalid bsdiff window size provided: ") << optarg;
+			} else if(!std::strcmp("restore-threads", long_options[option_index].name)) {
+				RE_THREADS = std::atoi(optarg);
+				if(RE_THREADS <= 0)
+					RE_THREADS = std::thread::hardware_concurrency();
+			} else if(!std::strcmp("cache-mem", long_options[option_index].name)) {
+				CACHE_MEM = parse_size(optarg);
+				if(CACHE_MEM <= 0)
+					throw fsarchive::rt_error("Invalid cache memory provided: ") << optarg;
+			} else if(!std::strcmp("zip-cache", long_options[option_index].name)) {
+				ZIP_CACHE_COUNT = std::atoi(optarg);
+				if(ZIP_CACHE_COUNT <= 0)
+					throw fsarchive::rt_error("Invalid zip cache size provided: ") << optarg;
+			} else if(!std::strcmp("zip-cache-mem", long_options[option_index].name)) {
+				ZIP_CACHE_MEM = parse_size(optarg);
+				if(ZIP_CACHE_MEM <= 0)
+					throw fsarchive::rt_error("Invalid zip cache memory provided: ") << optarg;
+			} else if(!std::strcmp("pipe-mem", long_options[option_index].name)) {
+				AR_PIPE_MEM = parse_size(optarg);
+				if(AR_PIPE_MEM <= 0)
+					throw fsarchive::rt_error("Invalid pipe memory provided: ") << optarg;
 			}
 		} break;
 
@@ -257,6 +461,17 @@ int fsarchive::parse_args(int argc, char *argv[], const char *prog, const char *
 		break;
              	}
 	}
+	if(AR_BSDIFF_THREADS <= 0)
+		AR_BSDIFF_THREADS = 1;
+	if(RE_THREADS <= 0)
+		RE_THREADS = 1;
+	if(CRC32_THREADS <= 0)
+		CRC32_THREADS = 1;
+	if(AR_DEDUP_THREADS <= 0)
+		AR_DEDUP_THREADS = 1;
+	// invalid levels fall back to default
+	if(AR_COMP_LEVEL < 0 || AR_COMP_LEVEL > ((C_ZSTD == AR_CODEC) ? 19 : 9))
+		AR_COMP_LEVEL = 0;
 
 	return optind;
 }
@@ -29,25 +29,53 @@ namespace fsarchive {
 		enum ACTION {
 			A_ARCHIVE = 1,
 			A_RESTORE = 2,
+			A_CONSOLIDATE = 3,
 			A_NONE = -1
 		};
 
+		// values are the zip compression method ids
+		enum CODEC {
+			C_DEFLATE = 8,
+			C_ZSTD = 93
+		};
+
 		typedef std::set<std::string>	excllist_t;
 
 		extern int		AR_ACTION;
 		extern std::string	AR_DIR;
 		extern int		AR_COMP_LEVEL;
+		extern int		AR_CODEC;
 		extern bool		AR_FORCE_NEW;
 		extern excllist_t	AR_EXCLUSIONS;
 		extern int64_t		AR_SZ_FILTER;
 		extern bool		AR_USE_BSDIFF;
+		extern int		AR_BSDIFF_THREADS;
+		extern int64_t		AR_BSDIFF_MEM;
+		extern int64_t		AR_BSDIFF_WINDOW;
 		extern bool		AR_COMPRESS;
 		extern excllist_t	AR_COMP_FILTER;
+		extern bool		AR_AUTO_NOCOMP;
 		extern std::string	RE_FILE;
 		extern std::string	RE_DIR;
 		extern bool		RE_METADATA;
+		extern int		RE_THREADS;
 		extern bool		DRY_RUN;
 		extern bool		CRC32_CHECK;
+		extern int		CRC32_THREADS;
+		extern int64_t		CACHE_MEM;
+		extern int		ZIP_CACHE_COUNT;
+		extern int64_t		ZIP_CACHE_MEM;
+		extern int		AR_SCAN_THREADS;
+		extern bool		AR_SCAN_INDEX;
+		extern bool		AR_FULL_RESCAN;
+		extern bool		AR_CATALOG;
+		extern bool		AR_DEDUP;
+		extern int64_t		AR_DEDUP_MIN_SIZE;
+		extern int		AR_DEDUP_THREADS;
+		extern bool		AR_CDC;
+		extern int64_t		AR_CDC_MIN_SIZE;
+		extern int		AR_PIPE_THREADS;
+		extern int64_t		AR_PIPE_MEM;
 	}
 
 	int parse_args(int argc, char *argv[], const char *prog, const char *version);
@@ -0,0 +1,170 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "sha256.h"
+#include "utils.h"
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace {
+	const uint32_t	K[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+	inline uint32_t rotr(const uint32_t x, const int n) {
+		return (x >> n) | (x << (32 - n));
+	}
+}
+
+sha256::ctx::ctx() : buf_len_(0), len_(0) {
+	const uint32_t	H0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(h_, H0, sizeof(h_));
+}
+
+void sha256::ctx::block(const uint8_t* p) {
+	uint32_t	w[64];
+	for(int i = 0; i < 16; ++i)
+		w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) | ((uint32_t)p[4*i+2] << 8) | p[4*i+3];
+	for(int i = 16; i < 64; ++i) {
+		const uint32_t	s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3),
+				s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	uint32_t	a = h_[0], b = h_[1], c = h_[2], d = h_[3],
+			e = h_[4], f = h_[5], g = h_[6], h = h_[7];
+	for(int i = 0; i < 64; ++i) {
+		const uint32_t	t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i],
+				t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h_[0] += a;
+	h_[1] += b;
+	h_[2] += c;
+	h_[3] += d;
+	h_[4] += e;
+	h_[5] += f;
+	h_[6] += g;
+	h_[7] += h;
+}
+
+void sha256::ctx::update(const void* data, const size_t n_bytes) {
+	const uint8_t	*p = (const uint8_t*)data;
+	size_t		n = n_bytes;
+	len_ += n_bytes;
+	if(buf_len_) {
+		const size_t	cp = std::min(n, sizeof(buf_) - buf_len_);
+		memcpy(buf_ + buf_len_, p, cp);
+		buf_len_ += cp;
+		p += cp;
+		n -= cp;
+		if(buf_len_ < sizeof(buf_))
+			return;
+		block(buf_);
+		buf_len_ = 0;
+	}
+	for(; n >= sizeof(buf_); p += sizeof(buf_), n -= sizeof(buf_))
+		block(p);
+	memcpy(buf_, p, n);
+	buf_len_ = n;
+}
+
+sha256::digest_t sha256::ctx::final(void) {
+	const uint64_t	bits = len_*8;
+	const uint8_t	pad = 0x80,
+			zero[64] = {0};
+	update(&pad, 1);
+	update(zero, (buf_len_ <= 56) ? 56 - buf_len_ : 64 + 56 - buf_len_);
+	uint8_t		be_bits[8];
+	for(int i = 0; i < 8; ++i)
+		be_bits[i] = bits >> (56 - 8*i);
+	update(be_bits, sizeof(be_bits));
+	digest_t	rv;
+	for(int i = 0; i < 8; ++i) {
+		rv[4*i] = h_[i] >> 24;
+		rv[4*i+1] = h_[i] >> 16;
+		rv[4*i+2] = h_[i] >> 8;
+		rv[4*i+3] = h_[i];
+	}
+	return rv;
+}
+
+sha256::digest_t sha256::compute(const void* data, const size_t n_bytes) {
+	ctx	c;
+	c.update(data, n_bytes);
+	return c.final();
+}
+
+sha256::digest_t sha256::compute(const char* fname) {
+	const size_t			BUF_SZ = 1024*1024;
+	thread_local std::unique_ptr<uint8_t, void (*)(void*)>	buf((uint8_t*)aligned_alloc(4096, BUF_SZ), free);
+	if(!buf)
+		throw fsarchive::rt_error("Couldn't allocate buffer to SHA-256 the file ") << fname;
+	const int	fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if(-1 == fd)
+		throw fsarchive::rt_error("Couldn't open file ") << fname << " to SHA-256 it";
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	ctx	c;
+	while(true) {
+		const ssize_t	rd = read(fd, buf.get(), BUF_SZ);
+		if(rd < 0) {
+			if(EINTR == errno)
+				continue;
+			close(fd);
+			throw fsarchive::rt_error("Couldn't SHA-256 the file ") << fname << " : " << strerror(errno);
+		}
+		if(!rd)
+			break;
+		c.update(buf.get(), rd);
+	}
+	// unlike crc32::compute the pages are left in the
+	// cache, the file is likely to be archived next
+	close(fd);
+	return c.final();
+}
+
+std::string sha256::to_hex(const digest_t& d) {
+	const char	HEX[] = "0123456789abcdef";
+	std::string	rv;
+	rv.reserve(2*d.size());
+	for(const auto b : d) {
+		rv += HEX[b >> 4];
+		rv += HEX[b & 0x0f];
+	}
+	return rv;
+}
@@ -0,0 +1,60 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <string>
+
+// SHA-256 (FIPS 180-4), used to find files with
+// the same content (see --dedup)
+namespace sha256 {
+	typedef std::array<uint8_t, 32>	digest_t;
+
+	// data can be hashed in pieces
+	class ctx {
+		uint32_t	h_[8];
+		uint8_t		buf_[64];
+		size_t		buf_len_;
+		uint64_t	len_;
+
+		void block(const uint8_t* p);
+	public:
+		ctx();
+
+		void update(const void* data, const size_t n_bytes);
+
+		// the ctx can't be updated anymore
+		digest_t final(void);
+	};
+
+	digest_t compute(const void* data, const size_t n_bytes);
+
+	// throws if fname can't be read
+	digest_t compute(const char* fname);
+
+	std::string to_hex(const digest_t& d);
+}
+
+#endif //_SHA256_H_
+
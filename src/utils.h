@@ -21,7 +21,10 @@
 #define _UTILS_H_
 
 #include <exception>
+#include <algorithm>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <sys/time.h>
 
@@ -67,6 +70,31 @@ public:
 	inline double tv_to_sec(const timeval& tv) {
 		return 1.0*tv.tv_sec + (1.0/1000000.0)*tv.tv_usec;
 	}
+
+	// utility to combine paths and cater for final /
+	// both need to be longer than 0
+	inline std::string combine_paths(const std::string& a, const std::string& b) {
+		if('/' == *(a.rbegin()))
+			return a + b;
+		return (!a.empty()) ? a + '/' + b : b;
+	}
+
+	// orders paths as a depth first walk with the entries of
+	// each directory sorted by name would: it's a plain byte
+	// comparison, but with '/' before any other character
+	inline int path_cmp(const std::string_view& a, const std::string_view& b) {
+		const size_t	n = std::min(a.size(), b.size());
+		for(size_t i = 0; i < n; ++i) {
+			if(a[i] == b[i])
+				continue;
+			if('/' == a[i])
+				return -1;
+			if('/' == b[i])
+				return 1;
+			return ((uint8_t)a[i] < (uint8_t)b[i]) ? -1 : 1;
+		}
+		return (a.size() < b.size()) ? -1 : ((a.size() > b.size()) ? 1 : 0);
+	}
 }
 
 #endif //_UTILS_H_
@@ -22,34 +22,258 @@
 #include "utils.h"
 #include <string.h>
 #include <memory>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 
 namespace {
+	// can't be the name of a file or directory scanned,
+	// these always have a '/' (the roots must end with it)
+	const char	CATALOG_NAME[] = ".fsarc_catalog";
+
+	const char	CATALOG_MAGIC[8] = { 'F', 'S', 'A', 'C', 'A', 'T', '0', '1' };
+
+	typedef struct {
+		char		magic[8];
+		uint64_t	n_entries;
+	} catalog_header_t;
+
+	// followed by the names, in the same order
+	typedef struct {
+		fsarchive::stat64_t	s;
+		uint64_t		z_idx,
+					name_off;
+		uint32_t		name_len,
+					pad;
+	} catalog_entry_t;
+
+	static_assert(sizeof(catalog_entry_t) == (80 + 24), "sizeof(catalog_entry_t) is not 80 + 24 bytes");
+
 	extern "C" void progress_cb(zip_t *arc, double p, void* usr_ptr) {
 		fsarchive::log::progress	*l_p = (fsarchive::log::progress*)usr_ptr;
 		l_p->update_completion(p);
 	}
 
-	std::string create_write_tmp_file(const std::string& data) {
-		char	tmpfname[64] = "/tmp/fsarc-bsdiff-XXXXXX";
-		int	fd = mkstemp(tmpfname);
-		if(-1 == fd)
-			throw fsarchive::rt_error("Can't create tmp file: ") << tmpfname;
-		if((ssize_t)data.size() != write(fd, data.data(), data.size())) {
-			close(fd);
-			unlink(tmpfname);
-			throw fsarchive::rt_error("Can't write tmp file: ") << tmpfname;
-		} else {
-			close(fd);
+	typedef struct {
+		fsarchive::file_pipe		*pipe;
+		fsarchive::file_pipe::id_t	id;
+		zip_uint64_t			size;
+		time_t				mtime;
+		// data is already deflated
+		bool				comp;
+		// all data has been read
+		bool				eof;
+		uint32_t			crc;
+		zip_error_t			err;
+	} pipe_src_t;
+
+	// zip_source serving the data of a file
+	// read through a file_pipe; when the data is
+	// deflated by the pipe, it's reported as such so
+	// that libzip copies it as is, and only once read
+	// the CRC32 (and actual size) are available
+	extern "C" zip_int64_t pipe_src_cb(void *usr_ptr, void *data, zip_uint64_t len, zip_source_cmd_t cmd) {
+		pipe_src_t	*p_s = (pipe_src_t*)usr_ptr;
+		switch(cmd) {
+			case ZIP_SOURCE_OPEN:
+				return 0;
+			case ZIP_SOURCE_READ:
+				try {
+					const zip_int64_t	rv = p_s->pipe->read(p_s->id, data, len);
+					if(!rv && !p_s->eof) {
+						uint64_t	sz = 0;
+						p_s->pipe->get_crc_size(p_s->id, p_s->crc, sz);
+						p_s->size = sz;
+						p_s->eof = true;
+					}
+					return rv;
+				} catch(const std::exception& e) {
+					LOG_ERROR << e.what();
+					zip_error_set(&p_s->err, ZIP_ER_READ, 0);
+				}
+				return -1;
+			case ZIP_SOURCE_CLOSE:
+				p_s->pipe->close(p_s->id);
+				return 0;
+			case ZIP_SOURCE_STAT: {
+				zip_stat_t	*st = (zip_stat_t*)data;
+				zip_stat_init(st);
+				st->size = p_s->size;
+				st->mtime = p_s->mtime;
+				st->valid = ZIP_STAT_SIZE|ZIP_STAT_MTIME;
+				if(p_s->comp) {
+					st->comp_method = ZIP_CM_DEFLATE;
+					st->valid |= ZIP_STAT_COMP_METHOD;
+				}
+				if(p_s->eof) {
+					st->crc = p_s->crc;
+					st->valid |= ZIP_STAT_CRC;
+				}
+				return sizeof(*st);
+			}
+			case ZIP_SOURCE_ERROR:
+				return zip_error_to_data(&p_s->err, data, len);
+			case ZIP_SOURCE_FREE:
+				// the file may have never been read
+				p_s->pipe->close(p_s->id);
+				zip_error_fini(&p_s->err);
+				delete p_s;
+				return 0;
+			case ZIP_SOURCE_SUPPORTS:
+				return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT, ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE, -1);
+			default:
+				zip_error_set(&p_s->err, ZIP_ER_OPNOTSUPP, 0);
+				return -1;
+		}
+	}
+
+	typedef struct {
+		fsarchive::zip_fs::pdata_source_t	src;
+		time_t					mtime;
+		zip_error_t				err;
+	} data_src_t;
+
+	// zip_source serving the data of a data_source,
+	// whose size is only known once it's over
+	extern "C" zip_int64_t data_src_cb(void *usr_ptr, void *data, zip_uint64_t len, zip_source_cmd_t cmd) {
+		data_src_t	*p_s = (data_src_t*)usr_ptr;
+		switch(cmd) {
+			case ZIP_SOURCE_OPEN:
+				return 0;
+			case ZIP_SOURCE_READ:
+				try {
+					return p_s->src->read((uint8_t*)data, len);
+				} catch(const std::exception& e) {
+					LOG_ERROR << e.what();
+					zip_error_set(&p_s->err, ZIP_ER_READ, 0);
+				}
+				return -1;
+			case ZIP_SOURCE_CLOSE:
+				return 0;
+			case ZIP_SOURCE_STAT: {
+				zip_stat_t	*st = (zip_stat_t*)data;
+				zip_stat_init(st);
+				st->mtime = p_s->mtime;
+				st->valid = ZIP_STAT_MTIME;
+				return sizeof(*st);
+			}
+			case ZIP_SOURCE_ERROR:
+				return zip_error_to_data(&p_s->err, data, len);
+			case ZIP_SOURCE_FREE:
+				zip_error_fini(&p_s->err);
+				delete p_s;
+				return 0;
+			case ZIP_SOURCE_SUPPORTS:
+				return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT, ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE, -1);
+			default:
+				zip_error_set(&p_s->err, ZIP_ER_OPNOTSUPP, 0);
+				return -1;
+		}
+	}
+}
+
+void fsarchive::zip_fs::add_catalog(void) {
+	if(f_map_->contains(CATALOG_NAME)) {
+		LOG_WARNING << "Can't add the catalog to archive " << z_ << ", its name is already in use";
+		return;
+	}
+	// paths and entry indices
+	std::vector<std::pair<std::string, size_t>>	entries;
+	entries.reserve(f_map_->size());
+	for(size_t i = 0; i < f_map_->size(); ++i)
+		entries.push_back(std::make_pair(f_map_->path(i), i));
+	// in the same order fs_scan emits them
+	std::sort(entries.begin(), entries.end(), [](const std::pair<std::string, size_t>& a, const std::pair<std::string, size_t>& b) { return path_cmp(a.first, b.first) < 0; });
+	const size_t	names_sz = f_map_->paths_size();
+	const size_t	sz = sizeof(catalog_header_t) + entries.size()*sizeof(catalog_entry_t) + names_sz;
+	uint8_t		*data = (uint8_t*)malloc(sz);
+	if(!data)
+		throw fsarchive::rt_error("Can't allocate catalog of ") << sz << " bytes";
+	catalog_header_t	*h = (catalog_header_t*)data;
+	memcpy(h->magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+	h->n_entries = entries.size();
+	catalog_entry_t	*c_e = (catalog_entry_t*)(data + sizeof(catalog_header_t));
+	char		*names = (char*)(c_e + entries.size());
+	uint64_t	name_off = 0;
+	for(const auto& e : entries) {
+		const zip_int64_t	z_idx = zip_name_locate(z_, e.first.c_str(), 0);
+		if(-1 == z_idx) {
+			free(data);
+			throw fsarchive::rt_error("Can't locate file ") << e.first << " in archive";
 		}
-		return tmpfname;
+		stat64_ext_t	fs_e;
+		f_map_->get(e.second, fs_e);
+		*c_e++ = { .s = fs_e.s, .z_idx = (uint64_t)z_idx, .name_off = name_off, .name_len = (uint32_t)e.first.size(), .pad = 0 };
+		memcpy(names + name_off, e.first.c_str(), e.first.size());
+		name_off += e.first.size();
+	}
+	zip_source_t	*p_zf = zip_source_buffer(z_, data, sz, 1);
+	if(!p_zf) {
+		free(data);
+		throw fsarchive::rt_error("Can't create buffer for catalog for zip ") << fname_;
+	}
+	const zip_int64_t idx = zip_file_add(z_, CATALOG_NAME, p_zf, ZIP_FL_ENC_GUESS);
+	if(-1 == idx) {
+		zip_source_free(p_zf);
+		throw fsarchive::rt_error("Can't add catalog to the archive");
 	}
+	stat64_t	fs_t = {0};
+	fs_t.fs_type = FS_TYPE_CATALOG;
+	fs_t.fs_size = sz;
+	// stored, could then be accessed in place
+	if(zip_set_file_compression(z_, idx, ZIP_CM_STORE, 0) ||
+	   zip_file_extra_field_set(z_, idx, FS_ZIP_EXTRA_FIELD_ID, 0, (const zip_uint8_t*)&fs_t, sizeof(fs_t), ZIP_FL_LOCAL))
+		throw fsarchive::rt_error("Can't set catalog properties in the archive");
+	LOG_SPAM << "Catalog with " << entries.size() << " entries added to archive " << z_;
 }
 
-bool fsarchive::zip_fs::add_data(zip_source_t *p_zf, const std::string& f, const fsarchive::stat64_t& fs, const char *prev, const uint32_t type, const int comp_level) {
-	if(f_map_.find(f) != f_map_.end()) {
+bool fsarchive::zip_fs::load_catalog(void) {
+	const zip_int64_t	c_idx = zip_name_locate(z_, CATALOG_NAME, 0);
+	if(-1 == c_idx)
+		return false;
+	try {
+		const zip_int64_t	n_entries = zip_get_num_entries(z_, 0);
+		zip_stat_t		st = {0};
+		if(zip_stat_index(z_, c_idx, 0, &st))
+			throw fsarchive::rt_error("can't stat it");
+		buffer_t		data(st.size);
+		{
+			pzip_file_t	z_file(zip_fopen_index(z_, c_idx, 0), zip_fclose);
+			if(!z_file || (zip_fread(z_file.get(), data.data(), data.size()) != (zip_int64_t)data.size()))
+				throw fsarchive::rt_error("can't read it");
+		}
+		const catalog_header_t	*h = (const catalog_header_t*)data.data();
+		if((data.size() < sizeof(catalog_header_t)) || memcmp(h->magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)))
+			throw fsarchive::rt_error("invalid header");
+		if((h->n_entries + 1 != (uint64_t)n_entries) || ((data.size() - sizeof(catalog_header_t))/sizeof(catalog_entry_t) < h->n_entries))
+			throw fsarchive::rt_error("invalid number of entries ") << h->n_entries;
+		const catalog_entry_t	*c_e = (const catalog_entry_t*)(data.data() + sizeof(catalog_header_t));
+		const char		*names = (const char*)(c_e + h->n_entries);
+		const size_t		names_sz = data.size() - sizeof(catalog_header_t) - h->n_entries*sizeof(catalog_entry_t);
+		f_map_->reserve(h->n_entries);
+		for(uint64_t i = 0; i < h->n_entries; ++i, ++c_e) {
+			if((c_e->name_off + c_e->name_len > names_sz) || (c_e->z_idx >= (uint64_t)n_entries))
+				throw fsarchive::rt_error("invalid entry ") << i;
+			// the central directory is in memory already,
+			// hence this is cheap and gives us the CRC32
+			zip_stat_t	e_st = {0};
+			if(zip_stat_index(z_, c_e->z_idx, 0, &e_st) || (strlen(e_st.name) != c_e->name_len) || memcmp(e_st.name, names + c_e->name_off, c_e->name_len))
+				throw fsarchive::rt_error("entry ") << i << " doesn't match the archive";
+			if(!f_map_->insert(e_st.name, {.s = c_e->s, .crc = (e_st.valid & ZIP_STAT_CRC) ? e_st.crc : 0 }))
+				throw fsarchive::rt_error("duplicate entry ") << i;
+		}
+	} catch(const std::exception& e) {
+		LOG_WARNING << "Invalid catalog in zip '" << fname_ << "' (" << e.what() << "), reading all the entries";
+		f_map_->clear();
+		return false;
+	}
+	return true;
+}
+
+bool fsarchive::zip_fs::add_data(zip_source_t *p_zf, const std::string& f, const fsarchive::stat64_t& fs, const char *prev, const uint32_t type, const int comp_level, const zip_int32_t comp_method) {
+	if(f_map_->contains(f)) {
 		LOG_WARNING << "Couldn't add file '" << f << "' to archive " << z_ << "; already existing";
+		zip_source_free(p_zf);
 		return false;
 	}
 	const zip_int64_t idx = zip_file_add(z_, f.c_str(), p_zf, ZIP_FL_ENC_GUESS);
@@ -58,7 +282,12 @@ bool fsarchive::zip_fs::add_data(zip_source_t *p_zf, const std::string& f, const
 		throw fsarchive::rt_error("Can't add file/data ") << f << " (type " << type << ") to the archive";
 	}
 	const bool	do_comp = (comp_level >= 0);
-	if(zip_set_file_compression(z_, idx, (do_comp) ? ZIP_CM_DEFLATE : ZIP_CM_STORE, (zip_uint32_t) (do_comp) ? comp_level : 0))
+	// libzip only copies compressed data as is
+	// when the entry keeps the same method
+	if(ZIP_CM_DEFAULT != comp_method) {
+		if(zip_set_file_compression(z_, idx, comp_method, 0))
+			throw fsarchive::rt_error("Can't set compression method for file/data ") << f << " (type " << type << ") to the archive";
+	} else if(zip_set_file_compression(z_, idx, (do_comp) ? codec_ : ZIP_CM_STORE, (zip_uint32_t) (do_comp) ? comp_level : 0))
 		throw fsarchive::rt_error("Can't set compression level for file/data ") << f << " (type " << type << ") to the archive";
 	// https://libzip.org/documentation/zip_file_extra_field_set.html
 	// we can't use the info libzip stamps because the mtime is off
@@ -73,16 +302,24 @@ bool fsarchive::zip_fs::add_data(zip_source_t *p_zf, const std::string& f, const
 	fs_t.fs_type = type;
 	if(zip_file_extra_field_set(z_, idx, FS_ZIP_EXTRA_FIELD_ID, 0, (const zip_uint8_t*)&fs_t, sizeof(fs_t), ZIP_FL_LOCAL))
 		throw fsarchive::rt_error("Can't set extra field FS_ZIP_EXTRA_FIELD_ID for file ") << f;
-	f_map_[f] = {.s = fs_t, .crc = 0};
+	f_map_->insert(f, {.s = fs_t, .crc = 0});
 	LOG_SPAM << "File/data '" << f << "' (type " << type << ") added to archive " << z_;
 	return true;
 }
 
-fsarchive::zip_fs::zip_fs(const std::string& fname, const bool ro) : z_(zip_open(fname.c_str(), (ro) ? ZIP_RDONLY : (ZIP_CREATE | ZIP_EXCL), 0)), ro_(ro) {
+fsarchive::zip_fs::zip_fs(const std::string& fname, const bool ro, const zip_int32_t codec, const size_t pipe_threads, const size_t pipe_mem, const bool catalog) : fname_(fname), z_(0), ro_(ro), codec_(codec), f_map_(std::make_shared<fileset_ext_t>()), shared_(false), catalog_(catalog) {
+	if(!ro && !zip_compression_method_supported(codec, 1))
+		throw fsarchive::rt_error("Compression method ") << codec << " not supported by libzip";
+	z_ = zip_open(fname.c_str(), (ro) ? ZIP_RDONLY : (ZIP_CREATE | ZIP_EXCL), 0);
 	if(!z_)
 		throw fsarchive::rt_error("Can't open/create zip archive ") << fname;
-	// populate the entries
-	const zip_int64_t	n_entries = zip_get_num_entries(z_, 0);
+	if(!ro && pipe_threads)
+		pipe_ = std::make_unique<file_pipe>(pipe_threads, pipe_mem);
+	// populate the entries, archives written by
+	// older versions don't have the catalog
+	const bool		has_catalog = load_catalog();
+	const zip_int64_t	n_entries = (has_catalog) ? 0 : zip_get_num_entries(z_, 0);
+	f_map_->reserve(n_entries);
 	for(zip_int64_t i = 0; i < n_entries; ++i) {
 		zip_stat_t	st = {0};
 		if(-1 == zip_stat_index(z_, i, 0, &st)) {
@@ -92,29 +329,82 @@ fsarchive::zip_fs::zip_fs(const std::string& fname, const bool ro) : z_(zip_open
 		zip_uint16_t	len = 0;
 		const auto *pf = zip_file_extra_field_get_by_id(z_, i, FS_ZIP_EXTRA_FIELD_ID, 0, &len, ZIP_FL_LOCAL);
 		if(pf) {
-			f_map_[st.name] = {.s = *(stat64_t*)pf, .crc = (st.valid & ZIP_STAT_CRC) ? st.crc : 0 };
+			// a catalog which couldn't be loaded
+			if(FS_TYPE_CATALOG == ((const stat64_t*)pf)->fs_type)
+				continue;
+			f_map_->insert(st.name, {.s = *(stat64_t*)pf, .crc = (st.valid & ZIP_STAT_CRC) ? st.crc : 0 });
 		} else {
 			zip_close(z_);
 			throw fsarchive::rt_error("Couldn't find FS_ZIP_EXTRA_FIELD_ID for file ") << st.name;
 		}
 	}
-	LOG_INFO << "Opened zip '" <<  fname << "' with " << f_map_.size() << " entries, id " << z_ << ((ro) ? " (R/O)" : " (W/O)");
+	// nothing else is going to be added; archives
+	// without a catalog need to be sorted
+	if(ro) {
+		f_map_->sort();
+		f_map_->shrink();
+	}
+	LOG_INFO << "Opened zip '" <<  fname << "' with " << f_map_->size() << " entries" << ((has_catalog) ? " (catalog)" : "") << ", id " << z_ << ((ro) ? " (R/O)" : " (W/O)");
+}
+
+// the entries are never modified, being R/O
+fsarchive::zip_fs::zip_fs(const std::string& fname, const pcfileset_t& entries) : fname_(fname), z_(0), ro_(true), codec_(ZIP_CM_DEFLATE), f_map_(std::const_pointer_cast<fileset_ext_t>(entries)), shared_(true), catalog_(false) {
+	z_ = zip_open(fname.c_str(), ZIP_RDONLY, 0);
+	if(!z_)
+		throw fsarchive::rt_error("Can't open zip archive ") << fname;
+	LOG_INFO << "Opened zip '" <<  fname << "' with " << f_map_->size() << " entries (shared), id " << z_ << " (R/O)";
 }
 
 bool fsarchive::zip_fs::add_file_new(const std::string& f, const fsarchive::stat64_t& fs, const int comp_level) {
+	if(pipe_) {
+		if(f_map_->contains(f)) {
+			LOG_WARNING << "Couldn't add file '" << f << "' to archive " << z_ << "; already existing";
+			return false;
+		}
+		pipe_src_t	*p_s = new pipe_src_t();
+		p_s->pipe = pipe_.get();
+		p_s->size = fs.fs_size;
+		p_s->mtime = fs.fs_mtime;
+		// only deflate is done by the pipe, other
+		// methods are left to libzip
+		p_s->comp = (comp_level >= 0) && (ZIP_CM_DEFLATE == codec_);
+		zip_error_init(&p_s->err);
+		zip_source_t	*p_zf = zip_source_function(z_, pipe_src_cb, p_s);
+		if(!p_zf) {
+			zip_error_fini(&p_s->err);
+			delete p_s;
+			throw fsarchive::rt_error("Can't create source file for zip ") << f;
+		}
+		// only start reading once libzip owns the source
+		p_s->id = pipe_->add(f, fs.fs_size, (p_s->comp) ? comp_level : -1);
+		return add_data(p_zf, f, fs, 0, FS_TYPE_FILE_NEW, comp_level);
+	}
 	zip_source_t	*p_zf = zip_source_file_create(f.c_str(), 0, -1, 0);
 	if(!p_zf)
 		throw fsarchive::rt_error("Can't open source file for zip ") << f;
 	return add_data(p_zf, f, fs, 0, FS_TYPE_FILE_NEW, comp_level);
 }
 
-bool fsarchive::zip_fs::add_file_bsdiff(const std::string& f, const fsarchive::stat64_t& fs, const std::string& diff, const char* prev, const int comp_level) {
-	const std::string	tmp_f = create_write_tmp_file(diff);
-	tmp_files_.insert(tmp_f);
-	zip_source_t		*p_zf = zip_source_file_create(tmp_f.c_str(), 0, -1, 0);
-	if(!p_zf)
-		throw fsarchive::rt_error("Can't open source diff file for zip ") << tmp_f;
-	return add_data(p_zf, f, fs, prev, FS_TYPE_FILE_MOD, comp_level);
+bool fsarchive::zip_fs::add_source(const std::string& f, const fsarchive::stat64_t& fs, pdata_source_t&& src, const char *prev, const uint32_t type, const int comp_level) {
+	data_src_t	*p_s = new data_src_t();
+	p_s->src = std::move(src);
+	p_s->mtime = fs.fs_mtime;
+	zip_error_init(&p_s->err);
+	zip_source_t	*p_zf = zip_source_function(z_, data_src_cb, p_s);
+	if(!p_zf) {
+		zip_error_fini(&p_s->err);
+		delete p_s;
+		throw fsarchive::rt_error("Can't create source for file for zip ") << f << " (type " << type << ")";
+	}
+	return add_data(p_zf, f, fs, prev, type, comp_level);
+}
+
+bool fsarchive::zip_fs::add_file_bsdiff(const std::string& f, const fsarchive::stat64_t& fs, pdata_source_t&& diff, const char* prev, const int comp_level) {
+	return add_source(f, fs, std::move(diff), prev, FS_TYPE_FILE_MOD, comp_level);
+}
+
+bool fsarchive::zip_fs::add_file_cbsdiff(const std::string& f, const fsarchive::stat64_t& fs, pdata_source_t&& diff, const char* prev, const int comp_level) {
+	return add_source(f, fs, std::move(diff), prev, FS_TYPE_FILE_CMOD, comp_level);
 }
 
 bool fsarchive::zip_fs::add_file_unchanged(const std::string& f, const fsarchive::stat64_t& fs, const char* prev) {
@@ -124,24 +414,58 @@ bool fsarchive::zip_fs::add_file_unchanged(const std::string& f, const fsarchive
 	return add_data(p_zf, f, fs, prev, FS_TYPE_FILE_UNC, -1);
 }
 
+bool fsarchive::zip_fs::add_file_cdc(const std::string& f, const fsarchive::stat64_t& fs, pdata_source_t&& src, const char* prev, const int comp_level) {
+	return add_source(f, fs, std::move(src), prev, FS_TYPE_FILE_CDC, comp_level);
+}
+
+bool fsarchive::zip_fs::add_file_copy(const std::string& f, const fsarchive::stat64_t& fs, const zip_fs& src, const std::string& src_f) {
+	const auto z_idx = zip_name_locate(src.z_, src_f.c_str(), 0);
+	if(-1 == z_idx)
+		throw fsarchive::rt_error("Can't locate file ") << src_f << " in archive " << src.fname_;
+	zip_stat_t s = {0};
+	if(zip_stat_index(src.z_, z_idx, 0, &s) || !(s.valid & ZIP_STAT_COMP_METHOD))
+		throw fsarchive::rt_error("Can't zip_stat_index file ") << src_f << " in archive " << src.fname_;
+	zip_source_t	*p_zf = zip_source_zip(z_, src.z_, z_idx, ZIP_FL_COMPRESSED, 0, -1);
+	if(!p_zf)
+		throw fsarchive::rt_error("Can't create source for copied file for zip ") << f << ": " << zip_strerror(z_);
+	return add_data(p_zf, f, fs, 0, FS_TYPE_FILE_NEW, 0, s.comp_method);
+}
+
+bool fsarchive::zip_fs::add_file_data(const std::string& f, const fsarchive::stat64_t& fs, pdata_source_t&& src, const int comp_level) {
+	return add_source(f, fs, std::move(src), 0, FS_TYPE_FILE_NEW, comp_level);
+}
+
+bool fsarchive::zip_fs::add_file_dup(const std::string& f, const fsarchive::stat64_t& fs, const char* prev, const std::string& target) {
+	char	*data = (char*)malloc(target.size());
+	if(!data)
+		throw fsarchive::rt_error("Can't allocate buffer for duplicate file ") << f;
+	memcpy(data, target.c_str(), target.size());
+	zip_source_t	*p_zf = zip_source_buffer(z_, data, target.size(), 1);
+	if(!p_zf) {
+		free(data);
+		throw fsarchive::rt_error("Can't create buffer for duplicate file for zip ") << f;
+	}
+	return add_data(p_zf, f, fs, prev, FS_TYPE_FILE_DUP, -1);
+}
+
 bool fsarchive::zip_fs::add_directory(const std::string& d, const fsarchive::stat64_t& fs) {
 	const auto d_idx = zip_dir_add(z_, d.c_str(), ZIP_FL_ENC_GUESS);
 	if(-1 == d_idx)
 		throw fsarchive::rt_error("Can't add directory ") << d << " to archive";
 	if(zip_file_extra_field_set(z_, d_idx, FS_ZIP_EXTRA_FIELD_ID, 0, (const zip_uint8_t*)&fs, sizeof(fs), ZIP_FL_LOCAL))
 		throw fsarchive::rt_error("Can't set extra field FS_ZIP_EXTRA_FIELD_ID for directory ") << d;
-	f_map_[d] = {.s = fs, .crc = 0};
+	f_map_->insert(d, {.s = fs, .crc = 0});
 	LOG_SPAM << "Directory '" << d << "' added to archive " << z_;
 	return true;
 }
 
 bool fsarchive::zip_fs::extract_file(const std::string& f, fsarchive::buffer_t& data, fsarchive::stat64_t& stat) const {
-	const auto it_f = f_map_.find(f);
-	if(f_map_.end() == it_f) {
+	stat64_ext_t	fs_e;
+	if(!f_map_->find(f, fs_e)) {
 		LOG_WARNING << "Can't extract/find file '" << f << "' in archive " << z_;
 		return false;
 	}
-	stat = it_f->second.s;
+	stat = fs_e.s;
 	const auto z_idx = zip_name_locate(z_, f.c_str(), 0);
 	if(-1 == z_idx)
 		throw fsarchive::rt_error("Can't locate file ") << f << " in archive";
@@ -153,6 +477,8 @@ bool fsarchive::zip_fs::extract_file(const std::string& f, fsarchive::buffer_t&
 		zip_fopen_index(z_, z_idx, 0),
 		[](zip_file_t* z){ if(z) zip_fclose(z); }
 	);
+	if(!z_file)
+		throw fsarchive::rt_error("Can't open file ") << f << " in archive (compression method " << s.comp_method << "): " << zip_strerror(z_);
 	const auto rb = zip_fread(z_file.get(), (void*)data.data(), data.size());
 	if(rb < 0 || (uint64_t)rb != s.size)
 		throw fsarchive::rt_error("Can't full zip_fread ") << f << " in archive";
@@ -160,14 +486,48 @@ bool fsarchive::zip_fs::extract_file(const std::string& f, fsarchive::buffer_t&
 	return true;
 }
 
+fsarchive::zip_fs::pzip_file_t fsarchive::zip_fs::open_file(const std::string& f, fsarchive::stat64_t& stat) const {
+	stat64_ext_t	fs_e;
+	if(!f_map_->find(f, fs_e))
+		throw fsarchive::rt_error("Can't find file ") << f << " in archive";
+	stat = fs_e.s;
+	const auto z_idx = zip_name_locate(z_, f.c_str(), 0);
+	if(-1 == z_idx)
+		throw fsarchive::rt_error("Can't locate file ") << f << " in archive";
+	pzip_file_t	rv(zip_fopen_index(z_, z_idx, 0), zip_fclose);
+	if(!rv)
+		throw fsarchive::rt_error("Can't open file ") << f << " in archive: " << zip_strerror(z_);
+	LOG_SPAM << "File '" << f << "' opened from archive " << z_;
+	return rv;
+}
+
 const fsarchive::fileset_ext_t& fsarchive::zip_fs::get_fileset(void) const {
+	return *f_map_;
+}
+
+fsarchive::zip_fs::pcfileset_t fsarchive::zip_fs::get_shared_fileset(void) const {
 	return f_map_;
 }
 
+const std::string& fsarchive::zip_fs::get_name(void) const {
+	return fname_;
+}
+
+size_t fsarchive::zip_fs::mem_usage(void) const {
+	// each entry is kept both in f_map_ and by libzip
+	// (central directory), the latter with its name;
+	// shared entries are counted by the archive which
+	// has read them
+	const size_t	ZIP_ENTRY_OVERHEAD = 128;
+	return sizeof(*this) + ((shared_) ? 0 : f_map_->mem_usage()) + f_map_->size()*ZIP_ENTRY_OVERHEAD + f_map_->paths_size();
+}
+
 void fsarchive::zip_fs::save_and_close(void) {
 	if(!ro_) {
 		// if we're not in R/O mode, then log the progress
 		// to archive
+		if(catalog_)
+			add_catalog();
 		fsarchive::log::progress	p("Archiving zip file");
 		zip_register_progress_callback_with_state(z_, 0.0001, progress_cb, 0, &p);
 		if(zip_close(z_)) {
@@ -176,13 +536,14 @@ void fsarchive::zip_fs::save_and_close(void) {
 			zip_error_fini(err);
 			// let's try to find out which file was removed before it could be
 			// archived
-			for(const auto& f : f_map_) {
+			for(size_t i = 0; i < f_map_->size(); ++i) {
+				const std::string	f = f_map_->path(i);
 				// just try to open in R/O mode
 				// if this fails, we won't be able to archive anyway
 				// hence we don't need to check many other conditions
-				const int t_fd = open(f.first.c_str(), O_RDONLY);
+				const int t_fd = open(f.c_str(), O_RDONLY);
 				if(-1 == t_fd)
-					LOG_ERROR << "The file/directory '" << f.first << "' is not accessible anymore";
+					LOG_ERROR << "The file/directory '" << f << "' is not accessible anymore";
 				else
 					close(t_fd);
 			}
@@ -199,12 +560,8 @@ fsarchive::zip_fs::~zip_fs() {
 	if(z_) {
 		zip_close(z_);
 	}
-	// at this stage, do unlink all
-	// the temporary files, thus
-	// deleting the same
-	for(const auto& f : tmp_files_)
-		if(unlink(f.c_str()))
-			LOG_WARNING << "Can't unlink temporary file " << f;
+	// stop reading ahead
+	pipe_.reset();
 	LOG_SPAM << "Closed zip, id " << z_;
 }
 
@@ -25,6 +25,9 @@
 #include <set>
 #include <vector>
 #include <string>
+#include <memory>
+#include "file_pipe.h"
+#include "fileset.h"
 
 namespace fsarchive {
 	extern const char					*FS_ARCHIVE_BASE;
@@ -35,63 +38,148 @@ namespace fsarchive {
 								FS_TYPE_FILE_MOD = 2,
 								// FS_TYPE_FILE_DEL = xxx, we don't need to store deleted
 								// files because we take a new snap every time
-								FS_TYPE_FILE_UNC = 3;
+								FS_TYPE_FILE_UNC = 3,
+								// modified file stored as a sequence of
+								// bsdiff patches, one per window
+								FS_TYPE_FILE_CMOD = 4,
+								// same content of another file, the entry
+								// data being its path in the fs_prev archive
+								FS_TYPE_FILE_DUP = 5,
+								// modified file stored as a sequence of
+								// chunks, either new or in the previous
+								// version (see --cdc)
+								FS_TYPE_FILE_CDC = 6,
+								// not a file: the catalog of all the
+								// other entries (see zip_fs)
+								FS_TYPE_CATALOG = 0x100;
+
+	typedef fileset						fileset_ext_t;
 
-	typedef struct _stat64 {
-		mode_t fs_mode;
-		uid_t fs_uid;
-		gid_t fs_gid;
-		uint32_t fs_type;
-		time_t fs_atime;
-		time_t fs_mtime;
-		time_t fs_ctime;
-		off64_t fs_size;
-		char	fs_prev[32];
-	} stat64_t;
+	typedef std::set<std::string>				filelist_t;
 
-	typedef struct _stat64_ext_t {
-		stat64_t	s;
-		uint32_t	crc;
-	} stat64_ext_t;
+	typedef std::vector<uint8_t>				buffer_t;
 
-	static_assert(sizeof(stat64_t) == (48 + 32), "sizeof(stat64_t) is not 48 + 32 bytes");
+	// Archive of files and directories, each entry having its
+	// metadata (stat64_t) in a local extra field. When saved, a
+	// catalog of all the entries metadata sorted by path can be
+	// added as last entry (stored), so that opening the archive
+	// doesn't need to read the local header of each entry; archives
+	// without a (valid) catalog are read entry by entry
+	class zip_fs {
+	public:
+		typedef std::unique_ptr<zip_file_t, int (*)(zip_file_t*)>	pzip_file_t;
 
-	typedef std::unordered_map<std::string, stat64_ext_t>	fileset_ext_t;
+		// data of an entry produced while the archive is
+		// being saved, read sequentially until read returns
+		// 0; read can throw
+		class data_source {
+		public:
+			virtual size_t read(uint8_t *out, const size_t len) = 0;
 
-	typedef std::set<std::string>				filelist_t;
+			virtual ~data_source() {
+			}
+		};
 
-	typedef std::vector<uint8_t>				buffer_t;
+		typedef std::unique_ptr<data_source>	pdata_source_t;
 
-	class zip_fs {
+		typedef std::shared_ptr<const fileset_ext_t>	pcfileset_t;
+	private:
 		static const char	NO_DATA;
+		const std::string	fname_;
 		zip_t			*z_;
 		const bool		ro_;
-		fileset_ext_t		f_map_;
-		filelist_t		tmp_files_;
+		// compression method for compressed entries
+		const zip_int32_t	codec_;
+		// shared among the R/O archives of the
+		// same file (see get_shared_fileset)
+		std::shared_ptr<fileset_ext_t>	f_map_;
+		const bool		shared_;
+		// add the catalog when saving
+		const bool		catalog_;
+		// when set, new files are read through it
+		std::unique_ptr<file_pipe>	pipe_;
 
 		zip_fs();
 		zip_fs(const zip_fs&);
 		zip_fs& operator=(const zip_fs&);
 
-		bool add_data(zip_source_t *p_zf, const std::string& f, const stat64_t& fs, const char *prev, const uint32_t type, const int comp_level);
+		// comp_method is the method of data already compressed
+		// (see add_file_copy), ZIP_CM_DEFAULT otherwise
+		bool add_data(zip_source_t *p_zf, const std::string& f, const stat64_t& fs, const char *prev, const uint32_t type, const int comp_level, const zip_int32_t comp_method = ZIP_CM_DEFAULT);
+
+		bool add_source(const std::string& f, const stat64_t& fs, pdata_source_t&& src, const char *prev, const uint32_t type, const int comp_level);
+
+		void add_catalog(void);
+
+		bool load_catalog(void);
 	public:
-		zip_fs(const std::string& fname, const bool ro);
+		// when writing, codec is the zip compression method
+		// (i.e. ZIP_CM_DEFLATE or ZIP_CM_ZSTD) to be used and
+		// if pipe_threads > 0, the files added with add_file_new
+		// are read ahead by pipe_threads threads using up to
+		// pipe_mem bytes while saving the archive; the catalog
+		// is only added if catalog is set, since versions
+		// without it can't read such archives
+		zip_fs(const std::string& fname, const bool ro, const zip_int32_t codec = ZIP_CM_DEFLATE, const size_t pipe_threads = 0, const size_t pipe_mem = 0, const bool catalog = false);
+
+		// opens again (R/O) archive fname with entries, taken
+		// from another zip_fs of the same archive opened R/O
+		// (see get_shared_fileset), rather than reading them;
+		// this way threads, which can't share libzip handles,
+		// don't keep a copy of the entries each
+		zip_fs(const std::string& fname, const pcfileset_t& entries);
 
 		// comp_level < 0 -- do not compress
 		// comp_level == 0 -- default
-		// comp_level 1 .. 9 fastest .. best
+		// comp_level 1 .. 9 (19 for zstd) fastest .. best
 		bool add_file_new(const std::string& f, const stat64_t& fs, const int comp_level);
 
-		bool add_file_bsdiff(const std::string& f, const stat64_t& fs, const std::string& diff, const char* prev, const int comp_level);
+		// diff is the bsdiff patch, only read
+		// when saving the archive
+		bool add_file_bsdiff(const std::string& f, const stat64_t& fs, pdata_source_t&& diff, const char* prev, const int comp_level);
+
+		// diff are windowed patches (see FS_TYPE_FILE_CMOD),
+		// only read when saving the archive
+		bool add_file_cbsdiff(const std::string& f, const stat64_t& fs, pdata_source_t&& diff, const char* prev, const int comp_level);
 
 		bool add_file_unchanged(const std::string& f, const stat64_t& fs, const char* prev);
 
+		// src is only read when saving the archive
+		bool add_file_cdc(const std::string& f, const stat64_t& fs, pdata_source_t&& src, const char* prev, const int comp_level);
+
+		// f has the same content of file target in archive prev
+		bool add_file_dup(const std::string& f, const stat64_t& fs, const char* prev, const std::string& target);
+
+		// stores as new the data of file src_f of archive src as
+		// is (still compressed), src has to be kept open until
+		// this archive is saved
+		bool add_file_copy(const std::string& f, const stat64_t& fs, const zip_fs& src, const std::string& src_f);
+
+		// stores as new the data read from src, only read
+		// when saving the archive
+		bool add_file_data(const std::string& f, const stat64_t& fs, pdata_source_t&& src, const int comp_level);
+
 		bool add_directory(const std::string& d, const stat64_t& fs);
 
 		bool extract_file(const std::string& f, buffer_t& data, stat64_t& stat) const;
 
+		// opens file f to read its data sequentially (zip_fread),
+		// without loading all of it in memory
+		pzip_file_t open_file(const std::string& f, stat64_t& stat) const;
+
+		// when opened R/O the entries are sorted by
+		// path (see fileset::sort)
 		const fileset_ext_t& get_fileset(void) const;
 
+		// only of archives opened R/O
+		pcfileset_t get_shared_fileset(void) const;
+
+		const std::string& get_name(void) const;
+
+		// rough estimate of the memory used to keep
+		// the archive open (entries metadata)
+		size_t mem_usage(void) const;
+
 		// this is not great but needed given the
 		// way libzip works
 		void save_and_close(void);
@@ -0,0 +1,109 @@
+/*
+*	fsarchive (C) 2023 E. Oriani, ema <AT> fastwebnet <DOT> it
+*
+*	This file is part of fsarchive.
+*
+*	fsarchive is free software: you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License as published by
+*	the Free Software Foundation, either version 3 of the License, or
+*	(at your option) any later version.
+*
+*	fsarchive is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with fsarchive.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Checks the CRC32 implementation selected at runtime
+// against the table based one; with --bench measures
+// the throughput of both
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <random>
+#include <chrono>
+#include "../src/crc32.h"
+
+namespace {
+	int	n_errors = 0;
+
+	void check(const uint32_t exp, const uint32_t got, const char* what, const size_t off, const size_t len) {
+		if(exp == got)
+			return;
+		if(++n_errors <= 16)
+			std::fprintf(stderr, "%s mismatch (off %zu, len %zu): expected %08x, got %08x\n", what, off, len, exp, got);
+	}
+
+	void run_checks(void) {
+		// standard check value
+		const uint8_t	digits[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+		check(0xcbf43926, crc32::compute(digits, sizeof(digits)), "check value", 0, sizeof(digits));
+		check(0xcbf43926, crc32::compute_table(digits, sizeof(digits)), "check value", 0, sizeof(digits));
+		std::mt19937_64		rng(42);
+		std::vector<uint8_t>	buf(1024*1024 + 64);
+		for(auto& b : buf)
+			b = rng();
+		// all the short lengths, unaligned too
+		for(size_t off = 0; off < 16; ++off)
+			for(size_t len = 0; len <= 4096 + 64; ++len) {
+				const uint32_t	exp = crc32::compute_table(buf.data() + off, len);
+				check(exp, crc32::compute(buf.data() + off, len), "compute", off, len);
+			}
+		// random lengths and chained computations
+		std::uniform_int_distribution<size_t>	d_len(0, 1024*1024),
+							d_off(0, 63);
+		for(int i = 0; i < 256; ++i) {
+			const size_t	off = d_off(rng),
+					len = d_len(rng),
+					split = len ? rng() % len : 0;
+			const uint8_t	*p = buf.data() + off;
+			const uint32_t	exp = crc32::compute_table(p, len);
+			check(exp, crc32::compute(p, len), "compute", off, len);
+			check(exp, crc32::compute(p + split, len - split, crc32::compute(p, split)), "chained", off, len);
+			check(exp, crc32::compute_table(p + split, len - split, crc32::compute(p, split)), "mixed", off, len);
+		}
+	}
+
+	double bench(uint32_t (*fn)(const void*, const size_t, uint32_t), const std::vector<uint8_t>& buf, uint32_t& crc) {
+		const int	n_iter = 16;
+		const auto	start = std::chrono::steady_clock::now();
+		crc = 0;
+		for(int i = 0; i < n_iter; ++i)
+			crc = fn(buf.data(), buf.size(), crc);
+		const double	secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return (double)buf.size()*n_iter/secs/(1024.0*1024.0*1024.0);
+	}
+
+	void run_bench(void) {
+		std::vector<uint8_t>	buf(64*1024*1024);
+		std::mt19937_64		rng(7);
+		for(auto& b : buf)
+			b = rng();
+		uint32_t	crc_table = 0,
+				crc_impl = 0;
+		const double	gbs_table = bench(crc32::compute_table, buf, crc_table),
+				gbs_impl = bench(crc32::compute, buf, crc_impl);
+		std::printf("table:\t%.2f GiB/s\n", gbs_table);
+		std::printf("%s:\t%.2f GiB/s\n", crc32::impl_name(), gbs_impl);
+		check(crc_table, crc_impl, "bench", 0, buf.size());
+	}
+}
+
+int main(int argc, char *argv[]) {
+	std::printf("crc32 implementation: %s\n", crc32::impl_name());
+	run_checks();
+	if(argc > 1 && !std::strcmp(argv[1], "--bench"))
+		run_bench();
+	if(n_errors) {
+		std::fprintf(stderr, "%d error(s)\n", n_errors);
+		return 1;
+	}
+	std::printf("All checks passed\n");
+	return 0;
+}